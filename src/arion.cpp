@@ -46,6 +46,11 @@
 #include "models/copy.hpp"
 #include "models/fingerprint.hpp"
 #include "utils/utils.hpp"
+#include "utils/jpeg_decoder.hpp"
+#include "utils/input_file.hpp"
+#include "utils/orientation.hpp"
+#include "utils/thread_budget.hpp"
+#include "utils/thread_pool.hpp"
 #include "arion.hpp"
 
 // Local Third party
@@ -63,6 +68,7 @@
 #include <boost/foreach.hpp>
 #include <boost/program_options.hpp>
 #include <boost/thread.hpp>
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/optional/optional.hpp>
 
@@ -83,6 +89,64 @@ using boost::property_tree::ptree;
 using namespace rapidjson;
 using namespace std;
 
+// Images are decoded with their native channel count (gray, BGR or BGRA) so
+// grayscale scans aren't tripled and alpha survives. This also keeps OpenCV
+// from applying the EXIF orientation on its own, orientation is handled
+// explicitly (see handleOrientation).
+#define ARION_IMREAD_FLAGS cv::IMREAD_UNCHANGED
+
+// JPEG decodes that would hold more than this many pixels (after DCT scaling
+// and cropping) are streamed through a band downscaler so the full resolution
+// image is never stored. 16MP is ~48MB of BGR pixels.
+// This can be overridden at build time or per job (0 disables streaming)
+#ifndef ARION_STREAMING_DECODE_PIXELS
+#define ARION_STREAMING_DECODE_PIXELS 16000000
+#endif
+
+// Resizes start from an earlier (larger) resize result instead of the decoded
+// source if that result has at least this many times their resolution. The
+// default keeps INTER_AREA quality indistinguishable from a direct resize.
+// This can be overridden at build time or per job (values below 1 disable it)
+#ifndef ARION_RESIZE_CASCADE_FACTOR
+#define ARION_RESIZE_CASCADE_FACTOR 2.0
+#endif
+
+// Outcome of running an operation, see runOperations()
+enum
+{
+  ArionOperationSucceeded = 0,
+  ArionOperationFailed    = 1,
+  ArionOperationThrew     = 2,
+  ArionOperationNotRun    = 3
+};
+
+// Maximum relative difference between the aspect ratio of an embedded preview
+// and the source for the preview to be decoded instead
+#define ARION_PREVIEW_ASPECT_TOLERANCE 0.01
+
+// Serializes the XMP toolkit, which is not thread safe on its own. Metadata is
+// parsed on a helper thread while operations may be writing XMP to outputs
+// (under Operation::getMetadataMutex(), which is why this is a separate,
+// recursive lock).
+static boost::recursive_mutex xmpMutex;
+
+//------------------------------------------------------------------------------
+// Exiv2::XmpParser::XmpLockFct backed by xmpMutex
+//------------------------------------------------------------------------------
+static void lockXmp(void* pLockData, bool lockUnlock)
+{
+  boost::recursive_mutex* pMutex = static_cast<boost::recursive_mutex*>(pLockData);
+
+  if (lockUnlock)
+  {
+    pMutex->lock();
+  }
+  else
+  {
+    pMutex->unlock();
+  }
+}
+
 //------------------------------------------------------------------------------
 // Exceptions
 //------------------------------------------------------------------------------
@@ -106,9 +170,19 @@ class ArionOperationNotSupportedException: public exception
 //------------------------------------------------------------------------------
 Arion::Arion() : 
   mCorrectOrientation(false),
+  mAllowPreview(false),
+  mFastDecode(false),
+  mResizeCascadeFactor(ARION_RESIZE_CASCADE_FACTOR),
+  mStreamingDecodePixels(ARION_STREAMING_DECODE_PIXELS),
+  mMaxParallelOps(0),
+  mHasThreadBudget(false),
+  mThreadBudget(),
+  mSourceOrientation(1),
   mpExifData(0),
   mpXmpData(0),
   mpIptcData(0),
+  mMetadataThread(),
+  mMetadataRead(false),
   mInputFile(),
   mTotalOperations(0),
   mFailedOperations(0),
@@ -121,6 +195,12 @@ Arion::Arion() :
 //------------------------------------------------------------------------------
 Arion::~Arion() 
 {
+  // The metadata thread reads mExivImage and mInput
+  if (mMetadataThread)
+  {
+    mMetadataThread->join();
+  }
+
   mpExifData = 0;
   mpXmpData = 0;
   mpIptcData = 0;
@@ -184,6 +264,93 @@ bool Arion::setup(const string& inputJson)
   {
     // Not required
   }
+
+  //--------------------------------
+  //     Allow preview flag
+  //--------------------------------
+  try
+  {
+    mAllowPreview = mInputTree.get<bool>("allow_preview");
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
+
+  //--------------------------------
+  //      Decode speed option
+  //--------------------------------
+  try
+  {
+    string decodeSpeed = mInputTree.get<std::string>("decode_speed");
+
+    // Make sure it's lowercase
+    transform(decodeSpeed.begin(), decodeSpeed.end(), decodeSpeed.begin(), ::tolower);
+
+    // Anything other than fast gets the default (accurate) decode. Jobs with
+    // an operation that needs exact pixels (fingerprints) ignore it, see
+    // decodeJpeg().
+    mFastDecode = (decodeSpeed == "fast");
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
+
+  //--------------------------------
+  //     Resize cascade factor
+  //--------------------------------
+  try
+  {
+    mResizeCascadeFactor = mInputTree.get<double>("resize_cascade_factor");
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
+
+  //--------------------------------
+  //   Streaming decode threshold
+  //--------------------------------
+  try
+  {
+    mStreamingDecodePixels = mInputTree.get<size_t>("streaming_decode_pixels");
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
+
+  //--------------------------------
+  //   Parallel operations limit
+  //--------------------------------
+  try
+  {
+    mMaxParallelOps = mInputTree.get<unsigned>("max_parallel_ops");
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
+
+  //--------------------------------
+  //         Thread budget
+  //--------------------------------
+  // Only limits this job: the process wide budget (which sizes the shared
+  // pool and OpenCV's thread count) is left to ArionSetThreadBudget()
+  try
+  {
+    const ptree& threadBudget = mInputTree.get_child("thread_budget");
+
+    mThreadBudget = ThreadBudget::allocate(threadBudget.get<unsigned>("threads", 0),
+                                           threadBudget.get<unsigned>("images", 1),
+                                           threadBudget.get<unsigned>("operations", 0));
+    mHasThreadBudget = true;
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
   
   return true;
 }
@@ -193,6 +360,8 @@ bool Arion::setup(const string& inputJson)
 void Arion::setSourceImage(cv::Mat& sourceImage)
 {
   mSourceImage = sourceImage;
+
+  normalizeImage(mSourceImage);
 }
 
 //------------------------------------------------------------------------------
@@ -206,6 +375,12 @@ void Arion::setIgnoreMetadata(bool ignoreMetadata)
 //------------------------------------------------------------------------------
 cv::Mat& Arion::getSourceImage()
 {
+  // Resizes may have left the decoded source in its stored orientation
+  if (handleOrientation(mSourceOrientation, mSourceImage))
+  {
+    mSourceOrientation = 1;
+  }
+
   return mSourceImage;
 }
 
@@ -328,92 +503,124 @@ void Arion::parseInputUrl(std::string inputUrl)
 }
 
 //------------------------------------------------------------------------------
-// Return true if image was rotated, false otherwise
+// Returns the EXIF orientation of the input, 1 (normal) if there is none
 //------------------------------------------------------------------------------
-bool Arion::handleOrientation(Exiv2::ExifData& exifData, cv::Mat& image)
+int Arion::getOrientation() const
 {
+  if (!mpExifData)
+  {
+    return 1;
+  }
 
   Exiv2::ExifKey key("Exif.Image.Orientation");
 
-  Exiv2::ExifData::iterator pos = exifData.findKey(key);
+  Exiv2::ExifData::const_iterator pos = mpExifData->findKey(key);
 
-  if (pos == exifData.end())
+  if (pos == mpExifData->end())
   {
-    return false;
+    return 1;
   }
 
-  long orientation = pos->toLong();
+  return (int)pos->toLong();
+}
 
-  switch(orientation)
+//------------------------------------------------------------------------------
+// The orientation, without waiting for (or starting) the metadata thread if
+// possible. JPEG orientation comes straight from the EXIF segment of the input.
+//------------------------------------------------------------------------------
+int Arion::readOrientation()
+{
+  if (!mIgnoreMetadata)
   {
-    case 1: // normal (do nothing)
-      break;
+    const int orientation = JpegDecoder::readExifOrientation(mInput.getData(), mInput.getSize());
 
-    case 2: // horizontal flip
+    if (orientation > 0)
     {
-      cv::flip(image, image, 1);
-
-      return true;
+      return orientation;
     }
+  }
 
-    case 3: // 180 rotate left (two left rotations)
-    {
-      // TODO: even though this is rare it needs to be more efficient
-      cv::transpose(image, image);
-      cv::flip(image, image, 0);
-      cv::transpose(image, image);
-      cv::flip(image, image, 0);
+  finishMetadata();
 
-      return true;
-    }
+  return getOrientation();
+}
 
-    case 4: // vertical flip
-    {
-      cv::flip(image, image, 0);
+//------------------------------------------------------------------------------
+// Return true if image was rotated, false otherwise
+//------------------------------------------------------------------------------
+bool Arion::handleOrientation(int orientation, cv::Mat& image)
+{
+  if ((orientation < 2) || (orientation > 8))
+  {
+    return false;
+  }
 
-      return true;
-    }
+  // A single pass, whatever the orientation
+  orientImage(image, image, orientation);
 
-    case 5: // vertical flip + 90 rotate right
-    {
-      cv::flip(image, image, 0);
-      cv::transpose(image, image);
-      cv::flip(image, image, 1);
+  return true;
+}
 
-      return true;
-    }
+//------------------------------------------------------------------------------
+// Every operation that looks at pixels can take them in their stored
+// orientation and rotate its own (smaller) output instead
+//------------------------------------------------------------------------------
+bool Arion::getOperationsHandleOrientation() const
+{
+  BOOST_FOREACH (const Operation& operation, mOperations)
+  {
+    const unsigned requirements = operation.getRequirements();
 
-    case 6: // 90 rotate right x
+    if ((requirements & OperationRequiresPixels) && !(requirements & OperationHandlesOrientation))
     {
-      cv::transpose(image, image);
-      cv::flip(image, image, 1);
-
-      return true;
+      return false;
     }
+  }
 
-    case 7: // horizontal flip + 90 rotate right
-    {
-      cv::flip(image, image, 1);
-      cv::transpose(image, image);
-      cv::flip(image, image, 1);
+  return true;
+}
 
-      return true;
-    }
+//------------------------------------------------------------------------------
+// Operations work on 8-bit images of 1, 3 or 4 channels. Deeper images (16-bit
+// PNG/TIFF, float) are scaled down to 8 bits and two channel (gray + alpha)
+// images are expanded to BGRA.
+//------------------------------------------------------------------------------
+void Arion::normalizeImage(cv::Mat& image)
+{
+  if (image.empty())
+  {
+    return;
+  }
 
-    case 8: // 90 rotate left
-    {
-      cv::transpose(image, image);
-      cv::flip(image, image, 0);
+  switch (image.depth())
+  {
+    case CV_8U:
+      break;
 
-      return true;
-    }
+    case CV_16U:
+      image.convertTo(image, CV_8U, 1.0/257.0);
+      break;
+
+    case CV_32F:
+    case CV_64F:
+      image.convertTo(image, CV_8U, 255.0);
+      break;
 
     default:
+      image.convertTo(image, CV_8U);
       break;
   }
 
-  return false;
+  if (image.channels() == 2)
+  {
+    std::vector<cv::Mat> planes;
+    cv::split(image, planes);
+
+    std::vector<cv::Mat> bgra(3, planes[0]);
+    bgra.push_back(planes[1]);
 
+    cv::merge(bgra, image);
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -604,160 +811,738 @@ bool Arion::parseOperations(const ptree& pt)
 //------------------------------------------------------------------------------
 void Arion::extractImageData(const string& imageFilePath)
 {
-  
-  if (mIgnoreMetadata)
+  // Map the file once, metadata and pixels are then extracted from the same
+  // bytes in memory
+  if (!mInput.open(imageFilePath))
   {
-    // If the ignore metadata flag is set simply read the image data
-    mSourceImage = cv::imread(imageFilePath);
+    throw extractException;
   }
-  else
-  {
-    // If we are taking metadata into account first read the image into memory
-    // and then extract pixel and metadata from memory...
-    std::ifstream input(imageFilePath.c_str(), std::ios::binary);
-
-    // copies all data into buffer
-    std::vector<char> buffer((std::istreambuf_iterator<char>(input)),(std::istreambuf_iterator<char>()));
-
-    if (buffer.empty())
-    {
-      throw extractException;
-    }
-
-    try
-    {
-      mExivImage = Exiv2::ImageFactory::open((const Exiv2::byte *)&buffer.front(), (long)buffer.size());
 
-      if (mExivImage.get() != 0)
-      {
-        mExivImage->readMetadata();
+  // Metadata is skipped entirely if the ignore metadata flag is set or nothing
+  // reads it (JPEG orientation is read without it, see readOrientation()),
+  // otherwise it is parsed while the pixels are decoded. Embedded previews are
+  // found through it too (see decodePreview()).
+  const unsigned requirements = getOperationRequirements();
 
-        Exiv2::ExifData& exifData = mExivImage->exifData();
+  const bool orientationNeedsMetadata = mCorrectOrientation &&
+    (JpegDecoder::readExifOrientation(mInput.getData(), mInput.getSize()) <= 0);
 
-        if (!exifData.empty())
-        {
-          mpExifData = &exifData;
+  const bool previewNeedsMetadata = mAllowPreview && (requirements & OperationRequiresPixels);
 
-  #if DEBUG
-          Utils::exifDebug(exifData);
-  #endif
+  if (!mIgnoreMetadata &&
+      ((requirements & OperationRequiresMetadata) || orientationNeedsMetadata || previewNeedsMetadata))
+  {
+    startMetadata();
+  }
 
-          if (mCorrectOrientation)
-          {
-            handleOrientation(exifData, mSourceImage);
-          }
-        }
+  // Only decode the bytes if some operation looks at pixels, otherwise the
+  // dimensions from the container header are enough
+  if (requirements & OperationRequiresPixels)
+  {
+    decodeImage(mInput.getData(), mInput.getSize());
+  }
+  else if (!readSourceSize(mInput.getData(), mInput.getSize()))
+  {
+    // The header could not be parsed, fall back to a full decode
+    decodeImage(mInput.getData(), mInput.getSize());
+  }
 
-        Exiv2::XmpData& xmpData = mExivImage->xmpData();
+  // Operations need the metadata from here on
+  finishMetadata();
 
-        if (!xmpData.empty())
-        {
-          mpXmpData = &xmpData;
+  if (!mSourceSize.area())
+  {
+    throw extractException;
+  }
+}
 
-  #if DEBUG
-          Utils::xmpDebug(xmpData);
-  #endif
-        }
+//------------------------------------------------------------------------------
+// Open the input with Exiv2 and start parsing its metadata (EXIF, IPTC and
+// XMP packets, which can be hundreds of KB) on a helper thread. Both this and
+// the pixel decode only read the immutable input bytes.
+//------------------------------------------------------------------------------
+void Arion::startMetadata()
+{
+  try
+  {
+    mExivImage = Exiv2::ImageFactory::open((const Exiv2::byte *)mInput.getData(), (long)mInput.getSize());
+  }
+  catch (Exiv2::AnyError& e)
+  {
+    // Not the end of the world if reading EXIF data failed
+    return;
+  }
 
-        Exiv2::IptcData& iptcData = mExivImage->iptcData();
+  if (mExivImage.get() == 0)
+  {
+    return;
+  }
 
-        if (!iptcData.empty())
-        {
-          mpIptcData = &iptcData;
+  // The XMP toolkit has to be initialized (with a lock) before it is used
+  // from a thread
+  Exiv2::XmpParser::initialize(lockXmp, &xmpMutex);
 
-  #if DEBUG
-          Utils::iptcDebug(iptcData);
-  #endif
-        }
-      }
-    }
-    catch (Exiv2::AnyError& e)
-    {
-      // Not the end of the world if reading EXIF data failed
-    }
+  mMetadataThread.reset(new boost::thread(boost::bind(&Arion::readMetadata, this)));
+}
 
-    // Now actually decode the bytes
-    cv::InputArray buf(buffer);
+//------------------------------------------------------------------------------
+// Runs on the metadata thread
+//------------------------------------------------------------------------------
+void Arion::readMetadata()
+{
+  try
+  {
+    mExivImage->readMetadata();
 
-    mSourceImage = cv::imdecode(buf, cv::IMREAD_COLOR);
+    mMetadataRead = true;
   }
-  
-  if (mSourceImage.empty())
+  catch (Exiv2::AnyError& e)
   {
-    throw extractException;
+    // Not the end of the world if reading EXIF data failed
+  }
+  catch (std::exception& e)
+  {
+    // Same as above, but nothing may escape the thread
   }
 }
 
 //------------------------------------------------------------------------------
+// Wait for the metadata thread (if any) and publish what it read. Safe to call
+// more than once.
 //------------------------------------------------------------------------------
-bool Arion::run()
+void Arion::finishMetadata()
 {
-
-  //----------------------------------
-  //        Preprocessing
-  //----------------------------------
-  if (mInputFile.length())
+  if (!mMetadataThread)
   {
-    try
-    {
-      // TODO: only read pixels if required by operations 
-      // (e.g. copy operation does not require read here)
-      // We have an input file, so lets read it
-      extractImageData(mInputFile);
-    }
-    catch (boost::exception& e)
-    {
-
-      mResult = false;
-      mErrorMessage = "Error extracting image";
-      constructErrorJson();
-      
-      return false;
-    }
-    catch (std::exception& e)
-    {
-      mResult = false;
-      mErrorMessage = e.what();;
-      constructErrorJson();
-      
-      return false;
-    }
+    return;
   }
-  
-  //----------------------------------
-  //        Write metadata
-  //----------------------------------
-  if (!mInputTree.empty())
+
+  mMetadataThread->join();
+  mMetadataThread.reset();
+
+  if (!mMetadataRead)
   {
-    overrideMeta(mInputTree);
+    return;
   }
-  
-  // Make sure we have image data to work with
-  if (mSourceImage.empty())
+
+  Exiv2::ExifData& exifData = mExivImage->exifData();
+
+  if (!exifData.empty())
   {
-    mResult = false;
-    mErrorMessage = "Input image data is empty";
-    constructErrorJson();
+    mpExifData = &exifData;
 
-    return false;
+#if DEBUG
+    Utils::exifDebug(exifData);
+#endif
   }
-  
-  StringBuffer s;
-    
-  #ifdef JSON_PRETTY_OUTPUT
-    PrettyWriter<StringBuffer> writer(s);
-  #else
-    Writer<StringBuffer> writer(s);
-  #endif
 
-  writer.StartObject();
+  Exiv2::XmpData& xmpData = mExivImage->xmpData();
 
-  // Dimensions
-  writer.String("height");
-  writer.Uint(mSourceImage.rows);
+  if (!xmpData.empty())
+  {
+    mpXmpData = &xmpData;
+
+#if DEBUG
+    Utils::xmpDebug(xmpData);
+#endif
+  }
+
+  Exiv2::IptcData& iptcData = mExivImage->iptcData();
+
+  if (!iptcData.empty())
+  {
+    mpIptcData = &iptcData;
+
+#if DEBUG
+    Utils::iptcDebug(iptcData);
+#endif
+  }
+}
+
+//------------------------------------------------------------------------------
+// Combined requirements of all queued operations
+//------------------------------------------------------------------------------
+unsigned Arion::getOperationRequirements() const
+{
+  unsigned requirements = OperationRequiresNothing;
+
+  BOOST_FOREACH (const Operation& operation, mOperations)
+  {
+    requirements |= operation.getRequirements();
+  }
+
+  return requirements;
+}
+
+//------------------------------------------------------------------------------
+// Determine the (upright) source dimensions without decoding any pixels.
+// Uses the JPEG frame header if possible, otherwise the dimensions Exiv2 found
+// while reading metadata.
+//------------------------------------------------------------------------------
+bool Arion::readSourceSize(const unsigned char* data, size_t size)
+{
+  const int orientation = mCorrectOrientation ? readOrientation() : 1;
+
+  JpegDecoder jpegDecoder;
+
+  if (jpegDecoder.readHeader(data, size))
+  {
+    mSourceSize = orientSize(jpegDecoder.getSize(), orientation);
+    return true;
+  }
+
+  finishMetadata();
+
+  if (mExivImage.get() != 0)
+  {
+    const cv::Size pixelSize(mExivImage->pixelWidth(), mExivImage->pixelHeight());
+
+    if (pixelSize.width > 0 && pixelSize.height > 0)
+    {
+      mSourceSize = orientSize(pixelSize, orientation);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// The smallest fraction of the source resolution that satisfies every
+// queued operation
+//------------------------------------------------------------------------------
+double Arion::getMinimumSourceScale(const cv::Size& sourceSize) const
+{
+  double scale = 0.0;
+
+  BOOST_FOREACH (const Operation& operation, mOperations)
+  {
+    scale = max(scale, operation.getMinimumSourceScale(sourceSize));
+  }
+
+  return scale;
+}
+
+//------------------------------------------------------------------------------
+// The union of the source regions read by operations that look at pixels
+//------------------------------------------------------------------------------
+cv::Rect Arion::getSourceRegion(const cv::Size& sourceSize) const
+{
+  cv::Rect region;
+
+  BOOST_FOREACH (const Operation& operation, mOperations)
+  {
+    if (!(operation.getRequirements() & OperationRequiresPixels))
+    {
+      continue;
+    }
+
+    const cv::Rect operationRegion = operation.getSourceRegion(sourceSize);
+
+    // Older OpenCV versions include the origin when taking the union with an
+    // empty rectangle
+    if (!region.area())
+    {
+      region = operationRegion;
+    }
+    else if (operationRegion.area())
+    {
+      region |= operationRegion;
+    }
+  }
+
+  return region;
+}
+
+//------------------------------------------------------------------------------
+// A resize taking part in the cascade, see planResizeCascade()
+//------------------------------------------------------------------------------
+struct CascadeStep
+{
+  unsigned index;
+  const Resize* resize;
+  cv::Rect cropRegion;
+  double xScale;
+  double yScale;
+};
+
+//------------------------------------------------------------------------------
+// Largest output resolution first
+//------------------------------------------------------------------------------
+static bool compareCascadeSteps(const CascadeStep& a, const CascadeStep& b)
+{
+  return (a.xScale * a.yScale) > (b.xScale * b.yScale);
+}
+
+//------------------------------------------------------------------------------
+// Plan the resize operations as a cascade. Resizes run from the largest to
+// the smallest output and each one starts from the smallest earlier result
+// that covers its whole crop region with at least mResizeCascadeFactor times
+// its resolution and was filtered the same way, instead of the decoded source.
+// Only results that are smaller than the decoded source are worth starting
+// from.
+//
+// sources receives the index of the operation each operation starts from (-1
+// for the decoded source) and order the order operations have to run in.
+// Operations other than resizes keep their place.
+//------------------------------------------------------------------------------
+void Arion::planResizeCascade(vector<int>& sources, vector<unsigned>& order) const
+{
+  sources.assign(mOperations.size(), -1);
+  order.resize(mOperations.size());
+
+  vector<CascadeStep> steps;
+
+  for (unsigned i = 0; i < mOperations.size(); ++i)
+  {
+    order[i] = i;
+
+    const Resize* resize = dynamic_cast<const Resize*>(&mOperations[i]);
+
+    CascadeStep step;
+    cv::Size size;
+
+    if ((mResizeCascadeFactor < 1.0) || !resize ||
+        !resize->getCascadeGeometry(mSourceSize, step.cropRegion, size))
+    {
+      continue;
+    }
+
+    step.index = i;
+    step.resize = resize;
+    step.xScale = (double)size.width / (double)step.cropRegion.width;
+    step.yScale = (double)size.height / (double)step.cropRegion.height;
+
+    steps.push_back(step);
+  }
+
+  if (steps.size() < 2)
+  {
+    return;
+  }
+
+  // Resizes take the slots of the original order, largest first
+  vector<unsigned> slots;
+
+  BOOST_FOREACH (const CascadeStep& step, steps)
+  {
+    slots.push_back(step.index);
+  }
+
+  stable_sort(steps.begin(), steps.end(), compareCascadeSteps);
+
+  for (unsigned i = 0; i < steps.size(); ++i)
+  {
+    order[slots[i]] = steps[i].index;
+  }
+
+  // Resolution of the decoded source relative to the full resolution source
+  const cv::Size imageSize = orientSize(mSourceImage.size(), mSourceOrientation);
+
+  const int decodedWidth = mDecodedSize.area() ? mDecodedSize.width : imageSize.width;
+  const int decodedHeight = mDecodedSize.area() ? mDecodedSize.height : imageSize.height;
+
+  const double decodedXScale = (double)decodedWidth / (double)mSourceSize.width;
+  const double decodedYScale = (double)decodedHeight / (double)mSourceSize.height;
+
+  for (unsigned i = 1; i < steps.size(); ++i)
+  {
+    const CascadeStep& step = steps[i];
+
+    int best = -1;
+
+    for (unsigned j = 0; j < i; ++j)
+    {
+      const CascadeStep& candidate = steps[j];
+
+      if ((candidate.xScale >= decodedXScale) || (candidate.yScale >= decodedYScale))
+      {
+        continue;
+      }
+
+      if ((candidate.xScale < step.xScale * mResizeCascadeFactor) ||
+          (candidate.yScale < step.yScale * mResizeCascadeFactor))
+      {
+        continue;
+      }
+
+      if ((candidate.cropRegion & step.cropRegion) != step.cropRegion)
+      {
+        continue;
+      }
+
+      if (!step.resize->canCascadeFrom(*candidate.resize))
+      {
+        continue;
+      }
+
+      // Earlier steps are larger, so the last match is the smallest
+      best = j;
+    }
+
+    if (best >= 0)
+    {
+      sources[step.index] = steps[best].index;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// What a pre-filtered resize blurs, see sharePreFilters()
+//------------------------------------------------------------------------------
+struct PreFilterRequest
+{
+  Resize* resize;
+  cv::Rect region;
+  double sigma;
+  int mode;
+};
+
+//------------------------------------------------------------------------------
+// Pre-filtered resizes of the decoded source that blur the same region only
+// blur it once. Each of them is registered with the cache, which drops the
+// blurred region after the last one has read it. A lone pre-filtered resize
+// (and any resize of an intermediate) does not use the cache, so its blurred
+// image is freed as soon as it is done.
+//------------------------------------------------------------------------------
+void Arion::sharePreFilters(const vector<int>& sources)
+{
+  vector<PreFilterRequest> requests;
+
+  for (unsigned i = 0; i < mOperations.size(); ++i)
+  {
+    Resize* resize = dynamic_cast<Resize*>(&mOperations[i]);
+
+    if (!resize || !resize->getPreFilter() || (sources[i] >= 0))
+    {
+      continue;
+    }
+
+    // What it blurs depends on the image it is handed
+    prepareOperation(i, sources);
+
+    PreFilterRequest request;
+    request.resize = resize;
+
+    if (resize->getPreFilterRequest(request.region, request.sigma, request.mode))
+    {
+      requests.push_back(request);
+    }
+  }
+
+  BOOST_FOREACH (const PreFilterRequest& request, requests)
+  {
+    unsigned matches = 0;
+
+    BOOST_FOREACH (const PreFilterRequest& other, requests)
+    {
+      if ((other.region == request.region) && (other.sigma == request.sigma) &&
+          (other.mode == request.mode))
+      {
+        matches++;
+      }
+    }
+
+    // Every request matches itself
+    if (matches > 1)
+    {
+      request.resize->setPreFilterCache(&mPreFilterCache);
+
+      mPreFilterCache.addConsumer(mSourceImage, request.region, request.sigma, request.mode);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Decode pixels from memory. JPEG data is decoded by libjpeg at the smallest
+// DCT scale that still satisfies every operation (e.g. a 640px thumbnail of a
+// 6000px original only needs a 1/8 decode), everything else goes to OpenCV.
+// If allowed, a large enough embedded preview is decoded instead.
+//
+// Metadata may still be parsed in the background, only previews wait for it.
+//------------------------------------------------------------------------------
+void Arion::decodeImage(const unsigned char* data, size_t size)
+{
+  // Only JPEG decodes are planned in the upright frame, anything else is
+  // rotated after decoding
+  int orientation = 1;
+
+  if (mCorrectOrientation && JpegDecoder::isJpeg(data, size))
+  {
+    orientation = readOrientation();
+  }
+
+  bool decodedJpeg = false;
+
+  // The preview decision needs the full resolution size up front
+  if (mAllowPreview && readSourceSize(data, size))
+  {
+    finishMetadata();
+
+    decodedJpeg = decodePreview(orientation);
+
+    if (decodedJpeg)
+    {
+      mDecodeSource = "preview";
+    }
+  }
+
+  if (!decodedJpeg)
+  {
+    JpegDecoder jpegDecoder;
+
+    if (jpegDecoder.readHeader(data, size))
+    {
+      // Operations see the upright image, so plan the decode in that frame
+      mSourceSize = orientSize(jpegDecoder.getSize(), orientation);
+
+      decodedJpeg = decodeJpeg(jpegDecoder, orientation);
+    }
+  }
+
+  if (!decodedJpeg)
+  {
+    cv::Mat buf(1, (int)size, CV_8UC1, (void*)data);
+
+    mSourceImage = cv::imdecode(buf, ARION_IMREAD_FLAGS);
+
+    normalizeImage(mSourceImage);
+  }
+
+  if (mSourceImage.empty())
+  {
+    return;
+  }
+
+  if (mDecodeSource.empty())
+  {
+    mDecodeSource = "image";
+  }
+
+  if (mCorrectOrientation && !JpegDecoder::isJpeg(data, size))
+  {
+    orientation = readOrientation();
+  }
+
+  // Rotating the full resolution source is left to the operations if they
+  // can rotate their (smaller) outputs instead
+  if (getOperationsHandleOrientation())
+  {
+    mSourceOrientation = orientation;
+  }
+  else
+  {
+    handleOrientation(orientation, mSourceImage);
+  }
+
+  if (!decodedJpeg)
+  {
+    mSourceSize = orientSize(mSourceImage.size(), mSourceOrientation);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Decode a JPEG whose header has already been read. This is either the source
+// itself or a (smaller) preview of it, so scale and region are planned
+// relative to mSourceSize, which must be set.
+//------------------------------------------------------------------------------
+bool Arion::decodeJpeg(JpegDecoder& jpegDecoder, int orientation)
+{
+  const cv::Size size = orientSize(jpegDecoder.getSize(), orientation);
+
+  const double xf = (double)size.width / (double)mSourceSize.width;
+  const double yf = (double)size.height / (double)mSourceSize.height;
+
+  jpegDecoder.setMinimumScale(getMinimumSourceScale(mSourceSize) / min(xf, yf));
+
+  // Only decode the part of the image operations actually read, mapped back
+  // to the stored (not upright) frame
+  const cv::Rect region = getSourceRegion(mSourceSize);
+
+  const int x0 = (int)floor(region.x * xf);
+  const int y0 = (int)floor(region.y * yf);
+  const int x1 = (int)ceil((region.x + region.width) * xf);
+  const int y1 = (int)ceil((region.y + region.height) * yf);
+
+  const cv::Rect storedRegion = orientRect(cv::Rect(x0, y0, x1 - x0, y1 - y0),
+                                           size, inverseOrientation(orientation));
+
+  jpegDecoder.setRegion(storedRegion);
+  jpegDecoder.setStreamingThreshold(mStreamingDecodePixels);
+  jpegDecoder.setFast(mFastDecode && !(getOperationRequirements() & OperationRequiresExactPixels));
+  jpegDecoder.setThreadPool(&ThreadPool::getShared(), getThreadAllocation().kernel);
+
+  if (!jpegDecoder.decode(mSourceImage))
+  {
+    return false;
+  }
+
+  const cv::Size decodedSize = jpegDecoder.getOutputSize();
+  const cv::Rect decodedRegion = jpegDecoder.getOutputRegion();
+
+  if (decodedRegion.size() != decodedSize)
+  {
+    mSourceRegion = orientRect(decodedRegion, decodedSize, orientation);
+    mDecodedSize = orientSize(decodedSize, orientation);
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Decode the smallest embedded JPEG preview (e.g. the EXIF thumbnail) that is
+// at least as large as every operation needs and has the same aspect ratio as
+// the source. Previews share the orientation of the main image.
+//------------------------------------------------------------------------------
+bool Arion::decodePreview(int orientation)
+{
+  if (mExivImage.get() == 0)
+  {
+    return false;
+  }
+
+  const double scale = getMinimumSourceScale(mSourceSize);
+
+  const cv::Size required((int)ceil(mSourceSize.width * scale - 1e-6),
+                          (int)ceil(mSourceSize.height * scale - 1e-6));
+
+  const double aspect = (double)mSourceSize.width / (double)mSourceSize.height;
+
+  try
+  {
+    Exiv2::PreviewManager previewManager(*mExivImage);
+
+    // Previews are listed from smallest to largest
+    Exiv2::PreviewPropertiesList properties = previewManager.getPreviewProperties();
+
+    BOOST_FOREACH (const Exiv2::PreviewProperties& preview, properties)
+    {
+      const cv::Size size = orientSize(cv::Size(preview.width_, preview.height_), orientation);
+
+      if ((preview.mimeType_ != "image/jpeg") || !size.area())
+      {
+        continue;
+      }
+
+      if ((size.width < required.width) || (size.height < required.height))
+      {
+        continue;
+      }
+
+      const double previewAspect = (double)size.width / (double)size.height;
+
+      // Thumbnails are often letterboxed to a fixed size, which is useless
+      if (fabs(previewAspect - aspect) > (aspect * ARION_PREVIEW_ASPECT_TOLERANCE))
+      {
+        continue;
+      }
+
+      Exiv2::PreviewImage image = previewManager.getPreviewImage(preview);
+
+      JpegDecoder jpegDecoder;
+
+      if (jpegDecoder.readHeader(image.pData(), image.size()) &&
+          (jpegDecoder.getSize() == cv::Size(preview.width_, preview.height_)) &&
+          decodeJpeg(jpegDecoder, orientation))
+      {
+        return true;
+      }
+    }
+  }
+  catch (Exiv2::AnyError& e)
+  {
+    // Fall back to decoding the image itself
+  }
+
+  return false;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Arion::run()
+{
+  // Waits while the thread budget's images are already being processed
+  ThreadBudget::ImageSlot imageSlot;
+
+  //----------------------------------
+  //        Preprocessing
+  //----------------------------------
+  if (mInputFile.length())
+  {
+    try
+    {
+      // We have an input file, so lets read it (pixels are only decoded if
+      // required by operations)
+      extractImageData(mInputFile);
+    }
+    catch (boost::exception& e)
+    {
+
+      mResult = false;
+      mErrorMessage = "Error extracting image";
+      constructErrorJson();
+      
+      return false;
+    }
+    catch (std::exception& e)
+    {
+      mResult = false;
+      mErrorMessage = e.what();;
+      constructErrorJson();
+      
+      return false;
+    }
+  }
+  
+  //----------------------------------
+  //        Write metadata
+  //----------------------------------
+  if (!mInputTree.empty())
+  {
+    overrideMeta(mInputTree);
+  }
+  
+  // Make sure we have image data to work with
+  if (mSourceImage.empty() &&
+      (!mSourceSize.area() || (getOperationRequirements() & OperationRequiresPixels)))
+  {
+    mResult = false;
+    mErrorMessage = "Input image data is empty";
+    constructErrorJson();
+
+    return false;
+  }
+
+  // The source image was provided directly rather than decoded
+  if (!mSourceSize.area())
+  {
+    mSourceSize = mSourceImage.size();
+  }
+  
+  StringBuffer s;
+    
+  #ifdef JSON_PRETTY_OUTPUT
+    PrettyWriter<StringBuffer> writer(s);
+  #else
+    Writer<StringBuffer> writer(s);
+  #endif
+
+  writer.StartObject();
+
+  // Dimensions (of the full resolution source, pixels may have been decoded
+  // at a reduced resolution)
+  writer.String("height");
+  writer.Uint(mSourceSize.height);
   
   writer.String("width");
-  writer.Uint(mSourceImage.cols);
+  writer.Uint(mSourceSize.width);
+
+  // Whether pixels came from the image itself or an embedded preview
+  if (!mDecodeSource.empty())
+  {
+    writer.String("decode_source");
+    writer.String(mDecodeSource);
+  }
   
   //----------------------------------
   //       Execute operations
@@ -766,45 +1551,72 @@ bool Arion::run()
   writer.StartArray();
   
   mTotalOperations = mOperations.size();
-  
-  BOOST_FOREACH (Operation& operation, mOperations)
+
+  // Resizes may start from the result of a larger resize
+  vector<int> sources;
+  vector<unsigned> order;
+
+  planResizeCascade(sources, order);
+
+  sharePreFilters(sources);
+
+  // Operations run in levels. Resizes that start from the result of another
+  // resize are one level below it, everything within a level runs
+  // concurrently.
+  vector<unsigned> levels(mOperations.size(), 0);
+  unsigned levelCount = 0;
+
+  BOOST_FOREACH (unsigned index, order)
   {
-    try
+    if (sources[index] >= 0)
     {
-      
-      operation.setImage(mSourceImage);
+      static_cast<Resize&>(mOperations[sources[index]]).setKeepIntermediate(true);
 
-      // Give operations meta data if it exists
-      if (mpExifData)
-      {
-        operation.setExifData(mpExifData);
-      }
+      levels[index] = levels[sources[index]] + 1;
+    }
 
-      if (mpXmpData)
-      {
-        operation.setXmpData(mpXmpData);
-      }
+    levelCount = max(levelCount, levels[index] + 1);
+  }
 
-      if (mpIptcData)
-      {
-        operation.setIptcData(mpIptcData);
-      }
-      
-      if (!operation.run())
+  vector<char> failed(mOperations.size(), ArionOperationNotRun);
+  vector<string> errors(mOperations.size());
+
+  for (unsigned level = 0; level < levelCount; ++level)
+  {
+    vector<unsigned> indices;
+
+    BOOST_FOREACH (unsigned index, order)
+    {
+      if (levels[index] == level)
       {
-        mFailedOperations++;
+        indices.push_back(index);
       }
-
-      operation.serialize(writer);
     }
-    catch (std::exception& e)
+
+    runOperations(indices, sources, failed, errors);
+
+    // An exception in any operation fails the whole job. Like a serial run,
+    // only operations that ran are counted.
+    BOOST_FOREACH (unsigned index, order)
     {
-      mFailedOperations++;
-      mErrorMessage = e.what();
-      constructErrorJson();
-      return mResult;
+      if (failed[index] == ArionOperationThrew)
+      {
+        mFailedOperations += count(failed.begin(), failed.end(), ArionOperationFailed) +
+                             count(failed.begin(), failed.end(), ArionOperationThrew);
+        mErrorMessage = errors[index];
+        constructErrorJson();
+        return mResult;
+      }
     }
   }
+
+  mFailedOperations += count(failed.begin(), failed.end(), ArionOperationFailed);
+
+  // Results are reported in the order operations were given
+  BOOST_FOREACH (Operation& operation, mOperations)
+  {
+    operation.serialize(writer);
+  }
   
   writer.EndArray();
 
@@ -828,6 +1640,29 @@ bool Arion::run()
   writer.String("failed_operations");
   writer.Uint(mFailedOperations);
 
+  // How threads were divided, see ThreadBudget
+  const ThreadAllocation allocation = getThreadAllocation();
+
+  writer.String("thread_allocation");
+  writer.StartObject();
+
+  writer.String("threads");
+  writer.Uint(allocation.threads);
+
+  writer.String("images");
+  writer.Uint(allocation.images);
+
+  writer.String("operations");
+  writer.Uint(allocation.operations);
+
+  writer.String("kernel");
+  writer.Uint(allocation.kernel);
+
+  writer.String("pool_threads");
+  writer.Uint(ThreadPool::getShared().getThreadCount());
+
+  writer.EndObject();
+
   writer.EndObject();
   
   mJson = s.GetString();
@@ -836,6 +1671,179 @@ bool Arion::run()
   
 }
 
+//------------------------------------------------------------------------------
+// Operations of one level of the job, shared by the tasks running them
+//------------------------------------------------------------------------------
+struct Arion::OperationQueue
+{
+  OperationQueue(const vector<unsigned>& indices,
+                 const vector<int>& sources,
+                 vector<char>& failed,
+                 vector<string>& errors) :
+    indices(indices),
+    sources(sources),
+    failed(failed),
+    errors(errors),
+    next(0),
+    stop(false),
+    mutex()
+  {
+  }
+
+  const vector<unsigned>& indices;
+  const vector<int>& sources;
+
+  // Written by whichever task ran the operation (one element each)
+  vector<char>& failed;
+  vector<string>& errors;
+
+  size_t next;
+
+  // Set when an operation throws, no further operations are started
+  bool stop;
+  boost::mutex mutex;
+};
+
+//------------------------------------------------------------------------------
+// Hand an operation its input: the decoded source or, for cascaded resizes,
+// the result of the resize it starts from
+//------------------------------------------------------------------------------
+void Arion::prepareOperation(unsigned index, const vector<int>& sources)
+{
+  Operation& operation = mOperations[index];
+
+  operation.setImage(mSourceImage);
+  operation.setOrientation(mSourceOrientation);
+  operation.setSourceSize(mSourceSize);
+  if (operation.getRequirements() & OperationRequiresInputData)
+  {
+    operation.setInputData(mInput.getData(), mInput.getSize());
+  }
+
+  if (mSourceRegion.area())
+  {
+    operation.setImageRegion(mSourceRegion, mDecodedSize);
+  }
+
+  if (sources[index] >= 0)
+  {
+    cv::Mat intermediate;
+    cv::Rect region;
+    cv::Size fullSize;
+
+    // Falls back to the decoded source if the larger resize failed
+    if (static_cast<Resize&>(mOperations[sources[index]]).getIntermediate(intermediate, region, fullSize))
+    {
+      // Intermediates are upright
+      operation.setImage(intermediate);
+      operation.setOrientation(1);
+      operation.setImageRegion(region, fullSize);
+
+      static_cast<Resize&>(operation).setDerivedFrom(sources[index]);
+    }
+  }
+
+  // Give operations meta data if it exists
+  if (mpExifData)
+  {
+    operation.setExifData(mpExifData);
+  }
+
+  if (mpXmpData)
+  {
+    operation.setXmpData(mpXmpData);
+  }
+
+  if (mpIptcData)
+  {
+    operation.setIptcData(mpIptcData);
+  }
+}
+
+//------------------------------------------------------------------------------
+// The thread budget's allocation for this job, see ThreadBudget. The operation
+// level is further limited by mMaxParallelOps. A budget of the job's own does
+// not change OpenCV's (process wide) thread count, its kernel level only
+// applies to our own kernels.
+//------------------------------------------------------------------------------
+ThreadAllocation Arion::getThreadAllocation() const
+{
+  ThreadAllocation allocation = mHasThreadBudget ? mThreadBudget : ThreadBudget::get();
+
+  if (mMaxParallelOps)
+  {
+    allocation.operations = min(allocation.operations, mMaxParallelOps);
+  }
+
+  return allocation;
+}
+
+//------------------------------------------------------------------------------
+// Run the given (independent) operations on the shared thread pool, with at
+// most getThreadAllocation().operations of them at a time. failed receives the
+// outcome of each operation (with the message in errors if it threw). Once one
+// throws no further operations are started, those keep ArionOperationNotRun.
+//------------------------------------------------------------------------------
+void Arion::runOperations(const vector<unsigned>& indices,
+                          const vector<int>& sources,
+                          vector<char>& failed,
+                          vector<string>& errors)
+{
+  if (indices.empty())
+  {
+    return;
+  }
+
+  ThreadPool& threadPool = ThreadPool::getShared();
+
+  const unsigned taskCount = min(getThreadAllocation().operations, (unsigned)indices.size());
+
+  OperationQueue queue(indices, sources, failed, errors);
+
+  // Every task keeps taking operations until none are left, so the number of
+  // tasks caps how many run at once
+  vector<ThreadPool::Task> tasks(taskCount, boost::bind(&Arion::runOperationQueue, this, boost::ref(queue)));
+
+  threadPool.run(tasks);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Arion::runOperationQueue(OperationQueue& queue)
+{
+  for (;;)
+  {
+    unsigned index;
+
+    {
+      boost::mutex::scoped_lock lock(queue.mutex);
+
+      if (queue.stop || (queue.next == queue.indices.size()))
+      {
+        return;
+      }
+
+      index = queue.indices[queue.next++];
+    }
+
+    try
+    {
+      prepareOperation(index, queue.sources);
+
+      queue.failed[index] = mOperations[index].run() ? ArionOperationSucceeded : ArionOperationFailed;
+    }
+    catch (std::exception& e)
+    {
+      queue.failed[index] = ArionOperationThrew;
+      queue.errors[index] = e.what();
+
+      boost::mutex::scoped_lock lock(queue.mutex);
+
+      queue.stop = true;
+    }
+  }
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 void Arion::constructErrorJson()
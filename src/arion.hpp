@@ -40,6 +40,8 @@
 // Boost
 #include <boost/property_tree/ptree.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
 
 // OpenCV
 #include <opencv2/core/core.hpp>
@@ -49,6 +51,10 @@
 
 // Local
 #include "models/operation.hpp"
+#include "utils/input_file.hpp"
+#include "utils/jpeg_decoder.hpp"
+#include "utils/pre_filter_cache.hpp"
+#include "utils/thread_budget.hpp"
 #include "carion.h"
 
 //------------------------------------------------------------------------------
@@ -81,9 +87,35 @@ class Arion
     //--------------------
     //      Helpers
     //--------------------
-    bool handleOrientation(Exiv2::ExifData& exifData, cv::Mat& image);
+    int getOrientation() const;
+    int readOrientation();
+    bool handleOrientation(int orientation, cv::Mat& image);
+    bool getOperationsHandleOrientation() const;
+    void normalizeImage(cv::Mat& image);
     bool parseOperations(const boost::property_tree::ptree& pt);
     void extractImageData(const std::string& imageFilePath);
+    void startMetadata();
+    void readMetadata();
+    void finishMetadata();
+    void decodeImage(const unsigned char* data, size_t size);
+    bool decodeJpeg(JpegDecoder& jpegDecoder, int orientation);
+    bool decodePreview(int orientation);
+    bool readSourceSize(const unsigned char* data, size_t size);
+    unsigned getOperationRequirements() const;
+    void planResizeCascade(std::vector<int>& sources, std::vector<unsigned>& order) const;
+    void sharePreFilters(const std::vector<int>& sources);
+
+    struct OperationQueue;
+
+    void prepareOperation(unsigned index, const std::vector<int>& sources);
+    void runOperations(const std::vector<unsigned>& indices,
+                       const std::vector<int>& sources,
+                       std::vector<char>& failed,
+                       std::vector<std::string>& errors);
+    void runOperationQueue(OperationQueue& queue);
+    ThreadAllocation getThreadAllocation() const;
+    double getMinimumSourceScale(const cv::Size& sourceSize) const;
+    cv::Rect getSourceRegion(const cv::Size& sourceSize) const;
     void overrideMeta(const boost::property_tree::ptree& pt);
     void constructErrorJson();
     void parseInputUrl(std::string inputUrl);
@@ -93,13 +125,50 @@ class Arion
     //--------------------
     boost::property_tree::ptree mInputTree;
     std::string mInputFile;
+
+    // Encoded input bytes. This must outlive mExivImage, which reads from it.
+    InputFile mInput;
     bool mCorrectOrientation;
+    bool mAllowPreview;
+    bool mFastDecode;
+    double mResizeCascadeFactor;
+
+    // See ARION_STREAMING_DECODE_PIXELS
+    size_t mStreamingDecodePixels;
+
+    // Upper limit for operations running at the same time, 0 for as many as
+    // the thread budget allows
+    unsigned mMaxParallelOps;
+
+    // This job's own division of threads (thread_budget in the input JSON),
+    // used instead of the process wide ThreadBudget if mHasThreadBudget
+    bool mHasThreadBudget;
+    ThreadAllocation mThreadBudget;
     bool mIgnoreMetadata;
     cv::Mat mSourceImage;
+
+    // EXIF orientation still to be applied to mSourceImage (1 if it is
+    // upright), see getOperationsHandleOrientation()
+    int mSourceOrientation;
+
+    // Full resolution (upright) size of the source. mSourceImage may have
+    // been decoded at a reduced resolution.
+    cv::Size mSourceSize;
+
+    // If only part of the source was decoded, mSourceImage covers
+    // mSourceRegion of the (upright) source decoded at mDecodedSize
+    cv::Rect mSourceRegion;
+    cv::Size mDecodedSize;
+
+    // "image" or "preview", empty if no pixels were decoded
+    std::string mDecodeSource;
     
     typedef boost::ptr_vector<Operation> Operations;
     
     Operations mOperations;
+
+    // Shared by resizes that pre-filter the same region
+    PreFilterCache mPreFilterCache;
     
     //--------------------
     //     Image info
@@ -109,6 +178,11 @@ class Arion
     Exiv2::IptcData* mpIptcData;
     Exiv2::Image::AutoPtr mExivImage;
 
+    // mExivImage parses its metadata on this thread while pixels are being
+    // decoded. It must not be touched until finishMetadata() has been called.
+    boost::scoped_ptr<boost::thread> mMetadataThread;
+    bool mMetadataRead;
+
     // The following describe the result of the operations
     bool mResult;
     std::string mErrorMessage;
@@ -0,0 +1,500 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------
+// Times Arion's image kernels against the OpenCV calls they replace on the
+// source and target sizes we resize between most. The source is the given
+// image scaled up to each source size, so it has realistic detail.
+//
+// OpenCV's bilinear, cubic and Lanczos interpolations do not stretch their
+// filters when shrinking. They are faster than the resampler's filters of the
+// same name on large reductions, but alias where the resampler does not.
+//------------------------------------------------------------------------------
+
+// Local
+#include "utils/area_resizer.hpp"
+#include "utils/resampler.hpp"
+#include "utils/pre_filter_cache.hpp"
+#include "utils/watermark_blender.hpp"
+#include "utils/watermark_cache.hpp"
+
+// Boost
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/program_options.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+// Stdlib
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include <string>
+
+using namespace boost::program_options;
+using namespace cv;
+using namespace std;
+
+struct ResizeCase
+{
+  int sourceWidth;
+  int sourceHeight;
+  int targetWidth;
+  int targetHeight;
+};
+
+// Camera originals to our output sizes, down to grid thumbnails
+static const ResizeCase RESIZE_CASES[] =
+{
+  { 6000, 4000, 1600, 1067 },
+  { 6000, 4000, 640, 427 },
+  { 6000, 4000, 150, 100 },
+  { 4032, 3024, 1600, 1200 },
+  { 4032, 3024, 320, 240 },
+  { 1600, 1067, 640, 427 },
+  { 1600, 1067, 150, 100 }
+};
+
+struct FilterCase
+{
+  const char* name;
+  int filter;
+  int interpolation;
+};
+
+static const FilterCase FILTER_CASES[] =
+{
+  { "area", ResamplerFilterArea, INTER_AREA },
+  { "bilinear", ResamplerFilterBilinear, INTER_LINEAR },
+  { "catrom", ResamplerFilterCatrom, INTER_CUBIC },
+  { "mitchell", ResamplerFilterMitchell, INTER_CUBIC },
+  { "lanczos3", ResamplerFilterLanczos3, INTER_LANCZOS4 }
+};
+
+//------------------------------------------------------------------------------
+// Fastest of the given number of runs in milliseconds
+//------------------------------------------------------------------------------
+static double timeBest(const boost::function<void ()>& run, unsigned iterations)
+{
+  double best = 0.0;
+
+  for (unsigned i = 0; i < iterations; ++i)
+  {
+    const int64 start = getTickCount();
+
+    run();
+
+    const double elapsed = (getTickCount() - start) * 1000.0 / getTickFrequency();
+
+    if ((i == 0) || (elapsed < best))
+    {
+      best = elapsed;
+    }
+  }
+
+  return best;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static void resizeOpenCV(const Mat* source, Mat* target, Size size, int interpolation)
+{
+  resize(*source, *target, size, 0, 0, interpolation);
+}
+
+//------------------------------------------------------------------------------
+// Includes looking up the weights, like a resize operation does
+//------------------------------------------------------------------------------
+static void resizeResampler(const Mat* source, Mat* target, Size size, int filter)
+{
+  Resampler resampler(source->size(), size, filter);
+
+  resampler.resize(*source, *target);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static void benchmarkResample(const Mat& image, unsigned iterations)
+{
+  cout << "Resampler vs cv::resize (best of " << iterations << ", ms)" << endl;
+
+  Mat source;
+  Mat target;
+
+  for (unsigned i = 0; i < sizeof(RESIZE_CASES) / sizeof(RESIZE_CASES[0]); ++i)
+  {
+    const ResizeCase& resizeCase = RESIZE_CASES[i];
+    const Size sourceSize(resizeCase.sourceWidth, resizeCase.sourceHeight);
+    const Size targetSize(resizeCase.targetWidth, resizeCase.targetHeight);
+
+    resize(image, source, sourceSize, 0, 0, INTER_CUBIC);
+
+    for (unsigned j = 0; j < sizeof(FILTER_CASES) / sizeof(FILTER_CASES[0]); ++j)
+    {
+      const FilterCase& filterCase = FILTER_CASES[j];
+
+      const double opencv = timeBest(boost::bind(&resizeOpenCV, &source, &target, targetSize,
+                                                 filterCase.interpolation), iterations);
+
+      const double resampler = timeBest(boost::bind(&resizeResampler, &source, &target, targetSize,
+                                                    filterCase.filter), iterations);
+
+      printf("  %4dx%-4d -> %4dx%-4d  %-8s  opencv %8.2f  resampler %8.2f  (%.2fx)\n",
+             sourceSize.width, sourceSize.height, targetSize.width, targetSize.height,
+             filterCase.name, opencv, resampler, opencv / resampler);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static void resizeLinearLight(const Mat* source, Mat* target, Size size, int filter)
+{
+  Resampler resampler(source->size(), size, filter);
+
+  resampler.resizeLinearLight(*source, *target);
+}
+
+//------------------------------------------------------------------------------
+// Cost of linear light over the 8-bit path it would replace
+//------------------------------------------------------------------------------
+static void benchmarkLinearLight(const Mat& image, unsigned iterations)
+{
+  cout << "Linear light vs 8-bit area resize (best of " << iterations << ", ms)" << endl;
+
+  Mat source;
+  Mat target;
+
+  for (unsigned i = 0; i < sizeof(RESIZE_CASES) / sizeof(RESIZE_CASES[0]); ++i)
+  {
+    const ResizeCase& resizeCase = RESIZE_CASES[i];
+    const Size sourceSize(resizeCase.sourceWidth, resizeCase.sourceHeight);
+    const Size targetSize(resizeCase.targetWidth, resizeCase.targetHeight);
+
+    resize(image, source, sourceSize, 0, 0, INTER_CUBIC);
+
+    const double opencv = timeBest(boost::bind(&resizeOpenCV, &source, &target, targetSize,
+                                               (int)INTER_AREA), iterations);
+
+    const double resampler = timeBest(boost::bind(&resizeResampler, &source, &target, targetSize,
+                                                  (int)ResamplerFilterArea), iterations);
+
+    const double linear = timeBest(boost::bind(&resizeLinearLight, &source, &target, targetSize,
+                                               (int)ResamplerFilterArea), iterations);
+
+    printf("  %4dx%-4d -> %4dx%-4d  opencv %8.2f  resampler %8.2f  linear %8.2f  (%.2fx opencv)\n",
+           sourceSize.width, sourceSize.height, targetSize.width, targetSize.height,
+           opencv, resampler, linear, linear / opencv);
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static void resizeArea(const Mat* source, Mat* target, Size size)
+{
+  AreaResizer areaResizer(source->size(), size);
+
+  areaResizer.resize(*source, *target);
+}
+
+//------------------------------------------------------------------------------
+// The default resize path: the two-stage area resize where it is selected and
+// how close it is to a direct INTER_AREA resize
+//------------------------------------------------------------------------------
+static void benchmarkAreaResize(const Mat& image, unsigned iterations)
+{
+  cout << "Two-stage area resize vs INTER_AREA (best of " << iterations << ", ms)" << endl;
+
+  Mat source;
+  Mat direct;
+  Mat target;
+
+  for (unsigned i = 0; i < sizeof(RESIZE_CASES) / sizeof(RESIZE_CASES[0]); ++i)
+  {
+    const ResizeCase& resizeCase = RESIZE_CASES[i];
+    const Size sourceSize(resizeCase.sourceWidth, resizeCase.sourceHeight);
+    const Size targetSize(resizeCase.targetWidth, resizeCase.targetHeight);
+
+    resize(image, source, sourceSize, 0, 0, INTER_CUBIC);
+
+    AreaResizer areaResizer(sourceSize, targetSize);
+
+    if (!areaResizer.getTwoStage())
+    {
+      printf("  %4dx%-4d -> %4dx%-4d  direct\n",
+             sourceSize.width, sourceSize.height, targetSize.width, targetSize.height);
+      continue;
+    }
+
+    const double opencv = timeBest(boost::bind(&resizeOpenCV, &source, &direct, targetSize,
+                                               (int)INTER_AREA), iterations);
+
+    // The single pass area filter of the resampler, for comparison
+    const double resampler = timeBest(boost::bind(&resizeResampler, &source, &target, targetSize,
+                                                  (int)ResamplerFilterArea), iterations);
+
+    const double twoStage = timeBest(boost::bind(&resizeArea, &source, &target, targetSize), iterations);
+
+    const Size reducedSize = areaResizer.getReducedSize();
+
+    printf("  %4dx%-4d -> %4dx%-4d  via %4dx%-4d  opencv %8.2f  resampler %8.2f  two-stage %8.2f  (%.2fx)  psnr %.1f\n",
+           sourceSize.width, sourceSize.height, targetSize.width, targetSize.height,
+           reducedSize.width, reducedSize.height, opencv, resampler, twoStage, opencv / twoStage,
+           PSNR(direct, target));
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static void preFilter(const Mat* source, Mat* target, double sigma, int mode)
+{
+  PreFilterCache::blur(*source, *target, sigma, mode);
+}
+
+//------------------------------------------------------------------------------
+// The pre_filter blur of a full resolution source (sigma is width / 1000)
+//------------------------------------------------------------------------------
+static void benchmarkPreFilter(const Mat& image, unsigned iterations)
+{
+  cout << "Pre-filter accurate vs fast (best of " << iterations << ", ms)" << endl;
+
+  Mat source;
+  Mat target;
+
+  for (unsigned i = 0; i < sizeof(RESIZE_CASES) / sizeof(RESIZE_CASES[0]); ++i)
+  {
+    const ResizeCase& resizeCase = RESIZE_CASES[i];
+    const Size sourceSize(resizeCase.sourceWidth, resizeCase.sourceHeight);
+
+    // Only the distinct source sizes
+    if ((i > 0) && (sourceSize.width == RESIZE_CASES[i - 1].sourceWidth))
+    {
+      continue;
+    }
+
+    resize(image, source, sourceSize, 0, 0, INTER_CUBIC);
+
+    const double sigma = sourceSize.width / 1000.0;
+
+    const double accurate = timeBest(boost::bind(&preFilter, &source, &target, sigma,
+                                                 (int)PreFilterModeAccurate), iterations);
+
+    const double fast = timeBest(boost::bind(&preFilter, &source, &target, sigma,
+                                             (int)PreFilterModeFast), iterations);
+
+    printf("  %4dx%-4d  sigma %.2f  accurate %8.2f  fast %8.2f  (%.2fx)\n",
+           sourceSize.width, sourceSize.height, sigma, accurate, fast, accurate / fast);
+  }
+}
+
+// Large outputs, where blending in parallel pays off
+static const Size WATERMARK_SIZES[] =
+{
+  Size(2048, 1365),
+  Size(4096, 2731)
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static void blendWatermark(const WatermarkBlender* blender, Mat* target)
+{
+  blender->blend(*target, 0, target->rows);
+}
+
+//------------------------------------------------------------------------------
+// Includes averaging the blocks, like a resize operation does
+//------------------------------------------------------------------------------
+static void blendWatermarkBlocks(WatermarkBlender* blender, Mat* target)
+{
+  blender->setBlocks(*target, WATERMARK_BLOCK_SIZE);
+  blender->blend(*target, 0, target->rows);
+}
+
+//------------------------------------------------------------------------------
+// Watermark blending on 1, 2, 4... threads up to one per core. The same output
+// is blended again on every run, which does not change the work done.
+//------------------------------------------------------------------------------
+static void benchmarkWatermark(const Mat& image, const Mat& watermarkImage, unsigned iterations)
+{
+  cout << "Watermark blending by threads (best of " << iterations << ", ms)" << endl;
+
+  const boost::shared_ptr<const Watermark> watermark = WatermarkCache::prepare(watermarkImage);
+
+  WatermarkBlender standard(*watermark, 0.1);
+  WatermarkBlender adaptive(*watermark, 0.1, 0.5);
+  WatermarkBlender adaptiveBlock(*watermark, 0.1, 0.5);
+
+  static const char* const TYPE_NAMES[] = { "standard", "adaptive", "adaptive_block" };
+
+  vector<int> threadCounts;
+
+  for (int threads = 1; threads < getNumberOfCPUs(); threads *= 2)
+  {
+    threadCounts.push_back(threads);
+  }
+
+  threadCounts.push_back(getNumberOfCPUs());
+
+  const int defaultThreads = getNumThreads();
+
+  Mat target;
+
+  for (unsigned i = 0; i < sizeof(WATERMARK_SIZES) / sizeof(WATERMARK_SIZES[0]); ++i)
+  {
+    const Size targetSize = WATERMARK_SIZES[i];
+
+    resize(image, target, targetSize, 0, 0, INTER_CUBIC);
+
+    for (int type = 0; type < 3; ++type)
+    {
+      double single = 0.0;
+
+      printf("  %4dx%-4d  %-14s", targetSize.width, targetSize.height, TYPE_NAMES[type]);
+
+      for (size_t j = 0; j < threadCounts.size(); ++j)
+      {
+        setNumThreads(threadCounts[j]);
+
+        boost::function<void ()> run;
+
+        if (type == 2)
+        {
+          run = boost::bind(&blendWatermarkBlocks, &adaptiveBlock, &target);
+        }
+        else
+        {
+          run = boost::bind(&blendWatermark, (type == 1) ? &adaptive : &standard, &target);
+        }
+
+        const double elapsed = timeBest(run, iterations);
+
+        if (j == 0)
+        {
+          single = elapsed;
+        }
+
+        printf("  %2d: %7.2f (%.2fx)", threadCounts[j], elapsed, single / elapsed);
+      }
+
+      printf("\n");
+    }
+  }
+
+  setNumThreads(defaultThreads);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+  try
+  {
+    options_description desc("Arion benchmark\n\n Arguments");
+
+    desc.add_options()
+        ("help", "Produce this help message")
+        ("image", value<string>()->default_value("../examples/images/image-1.jpg"),
+         "Image to build the sources from")
+        ("watermark", value<string>()->default_value("../tests/images/watermark.png"),
+         "Watermark for the watermark benchmark")
+        ("iterations", value<unsigned>()->default_value(5), "Runs per measurement")
+        ("suite", value<string>()->default_value("all"), "Benchmark to run: all, resample, area_resize, linear_light, pre_filter, watermark");
+
+    variables_map vm;
+
+    store(parse_command_line(argc, argv, desc), vm);
+
+    notify(vm);
+
+    if (vm.count("help"))
+    {
+      cerr << desc << endl;
+      return 1;
+    }
+
+    const string suite = vm["suite"].as<string>();
+    const unsigned iterations = max(vm["iterations"].as<unsigned>(), 1u);
+
+    Mat image = imread(vm["image"].as<string>(), IMREAD_COLOR);
+
+    if (image.empty())
+    {
+      cerr << "Could not read " << vm["image"].as<string>() << endl;
+      return 1;
+    }
+
+    if ((suite == "all") || (suite == "resample"))
+    {
+      benchmarkResample(image, iterations);
+    }
+
+    if ((suite == "all") || (suite == "area_resize"))
+    {
+      benchmarkAreaResize(image, iterations);
+    }
+
+    if ((suite == "all") || (suite == "linear_light"))
+    {
+      benchmarkLinearLight(image, iterations);
+    }
+
+    if ((suite == "all") || (suite == "pre_filter"))
+    {
+      benchmarkPreFilter(image, iterations);
+    }
+
+    if ((suite == "all") || (suite == "watermark"))
+    {
+      Mat watermark = imread(vm["watermark"].as<string>(), IMREAD_UNCHANGED);
+
+      if (watermark.empty())
+      {
+        cerr << "Could not read " << vm["watermark"].as<string>() << endl;
+        return 1;
+      }
+
+      benchmarkWatermark(image, watermark, iterations);
+    }
+  }
+  catch (exception& e)
+  {
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -1,6 +1,7 @@
 // Local
 #include "arion.hpp"
 #include "models/resize.hpp"
+#include "utils/thread_budget.hpp"
 #include "carion.h"
 #include <stdio.h>
 #include <string.h>
@@ -14,7 +15,7 @@ char* getChars(const std::string& string)
   const char* localOutputJson = string.c_str();
   
   // Create on the heap
-  char* outputJson = (char*)malloc(strlen(localOutputJson));
+  char* outputJson = (char*)malloc(strlen(localOutputJson) + 1);
   
   strcpy(outputJson, localOutputJson);
   
@@ -129,3 +130,10 @@ struct ArionResizeResult ArionResize(struct ArionInputOptions inputOptions,
   
   return result;
 }
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void ArionSetThreadBudget(unsigned threads, unsigned images, unsigned operations)
+{
+  ThreadBudget::set(threads, images, operations);
+}
@@ -63,6 +63,14 @@ extern "C" {
   struct ArionResizeResult ArionResize(struct ArionInputOptions inputOptions,
                                        struct ArionResizeOptions resizeOptions);
 
+  // Divide the threads of the process (0 for one per core) between images
+  // processed at the same time (e.g. ArionResize() called from that many
+  // threads), the operations of each image (0 for as many as its share of
+  // threads) and the kernels within each operation. Further images wait until
+  // one of those finishes. This sizes the shared thread pool and sets
+  // OpenCV's thread count, so call it before any images are processed.
+  void ArionSetThreadBudget(unsigned threads, unsigned images, unsigned operations);
+
 #ifdef __cplusplus
 }
 #endif
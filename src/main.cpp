@@ -44,6 +44,7 @@
 #include "models/resize.hpp"
 #include "models/read_meta.hpp"
 #include "utils/utils.hpp"
+#include "utils/thread_budget.hpp"
 #include "arion.hpp"
 
 // Boost
@@ -89,7 +90,9 @@ int main(int argc, char* argv[])
     desc.add_options()
         ("help", "Produce this help message")
         ("version", "Print version")
-        ("input", value< string >(), "The input operations to execute in JSON");
+        ("input", value< string >(), "The input operations to execute in JSON")
+        ("threads", value< unsigned >(), "Threads to use (0 for one per core)")
+        ("operations", value< unsigned >()->default_value(0), "Operations to run at once with --threads (0 for as many as there are threads)");
 
     variables_map vm;
 
@@ -122,6 +125,12 @@ int main(int argc, char* argv[])
       return 1;
     }
     
+    // The process only handles one image, so the budget is set up front
+    if (vm.count("threads"))
+    {
+      ThreadBudget::set(vm["threads"].as<unsigned>(), 1, vm["operations"].as<unsigned>());
+    }
+
     Arion arion;
 
     if (!arion.setup(inputJson))
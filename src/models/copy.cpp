@@ -103,6 +103,22 @@ void Copy::setup(const ptree& params)
   }
 }
 
+//------------------------------------------------------------------------------
+// Pixels are never looked at, so any source resolution will do
+//------------------------------------------------------------------------------
+double Copy::getMinimumSourceScale(const cv::Size& sourceSize) const
+{
+  return 0.0;
+}
+
+//------------------------------------------------------------------------------
+// Output is written from the original bytes
+//------------------------------------------------------------------------------
+unsigned Copy::getRequirements() const
+{
+  return (OperationRequiresMetadata | OperationRequiresInputData);
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 bool Copy::getStatus() const
@@ -123,10 +139,28 @@ bool Copy::run()
     return false;
   }
 
-  std::ifstream src(mInputFile.c_str(),  std::ios::binary);
   std::ofstream dst(mOutputFile.c_str(), std::ios::binary);
 
-  dst << src.rdbuf();
+  if (mpInputData)
+  {
+    // Write straight from the bytes that are already in memory
+    dst.write((const char*)mpInputData, mInputSize);
+  }
+  else
+  {
+    std::ifstream src(mInputFile.c_str(),  std::ios::binary);
+
+    dst << src.rdbuf();
+  }
+
+  dst.close();
+
+  if (dst.fail())
+  {
+    mStatus = CopyStatusError;
+    mErrorMessage = "Could not write output file";
+    return false;
+  }
 
   //--------------------------------
   //  Inherit EXIF data if needed
@@ -135,6 +169,8 @@ bool Copy::run()
   {
     try
     {
+      boost::mutex::scoped_lock lock(getMetadataMutex());
+
       // NOTE: writing metadata is split out into separate data types for future
       //       functionality where we may want to inject certain input data into
       //       these formats
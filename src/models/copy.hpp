@@ -70,6 +70,8 @@ class Copy : public Operation
     virtual bool run();
     virtual bool getJpeg(std::vector<unsigned char>& data);
     virtual bool getPNG(std::vector<unsigned char>& data);
+    virtual double getMinimumSourceScale(const cv::Size& sourceSize) const;
+    virtual unsigned getRequirements() const;
 
     std::string getOutputFile() const;
     bool getStatus() const;
@@ -87,6 +87,15 @@ void Fingerprint::setup(const ptree& params)
   readType(params);
 }
 
+//------------------------------------------------------------------------------
+// Only pixels are hashed
+//------------------------------------------------------------------------------
+unsigned Fingerprint::getRequirements() const
+{
+  // Hashes of a fast decode would not match those of other jobs
+  return (OperationRequiresPixels | OperationRequiresExactPixels);
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 bool Fingerprint::getStatus() const
@@ -154,7 +163,24 @@ bool Fingerprint::run()
     //--------------------------------
     //      Compute Image MD5
     //--------------------------------
-    mpPixelMd5 = Utils::computeMd5((char*)mImage.data, (int)mImage.step[0] * mImage.rows);
+    // The hash is always taken over BGR pixels, so it doesn't depend on the
+    // channel count an image happens to be decoded with
+    Mat image;
+
+    if (mImage.channels() == 1)
+    {
+      cvtColor(mImage, image, COLOR_GRAY2BGR);
+    }
+    else if (mImage.channels() == 4)
+    {
+      cvtColor(mImage, image, COLOR_BGRA2BGR);
+    }
+    else
+    {
+      image = mImage;
+    }
+
+    mpPixelMd5 = Utils::computeMd5((char*)image.data, (int)image.step[0] * image.rows);
 
     if (mpPixelMd5)
     {
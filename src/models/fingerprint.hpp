@@ -76,6 +76,7 @@ class Fingerprint : public Operation
     virtual bool run();
     virtual bool getJpeg(std::vector<unsigned char>& data);
     virtual bool getPNG(std::vector<unsigned char>& data);
+    virtual unsigned getRequirements() const;
 
     void setType(const std::string& type);
     bool getStatus() const;
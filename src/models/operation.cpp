@@ -32,6 +32,7 @@
 //------------------------------------------------------------------------------
 
 #include "models/operation.hpp"
+#include "utils/orientation.hpp"
 
 #include <iostream>
 #include <string>
@@ -45,12 +46,18 @@
 using boost::property_tree::ptree;
 using namespace std;
 
+// See getMetadataMutex()
+static boost::mutex metadataMutex;
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 Operation::Operation() :     
     mpExifData(0),
     mpXmpData(0),
-    mpIptcData(0)
+    mpIptcData(0),
+    mOrientation(1),
+    mpInputData(0),
+    mInputSize(0)
 {
 }
 
@@ -70,6 +77,13 @@ ptree Operation::getParams() const
   return mParams;
 }
 
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+boost::mutex& Operation::getMetadataMutex()
+{
+  return metadataMutex;
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 void Operation::setExifData(const Exiv2::ExifData* exifData)
@@ -97,3 +111,66 @@ void Operation::setImage(cv::Mat& image)
 {
   mImage = image;
 }
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Operation::setSourceSize(const cv::Size& sourceSize)
+{
+  mSourceSize = sourceSize;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Operation::setInputData(const unsigned char* data, size_t size)
+{
+  mpInputData = data;
+  mInputSize = size;
+}
+
+//------------------------------------------------------------------------------
+// The image passed to setImage() is only the given region of the source
+// decoded at fullSize (e.g. a region of interest decode)
+//------------------------------------------------------------------------------
+void Operation::setImageRegion(const cv::Rect& region, const cv::Size& fullSize)
+{
+  mImageRegion = region;
+  mImageFullSize = fullSize;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Operation::setOrientation(int orientation)
+{
+  mOrientation = orientation;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+cv::Size Operation::getImageSize() const
+{
+  return orientSize(mImage.size(), mOrientation);
+}
+
+//------------------------------------------------------------------------------
+// By default assume all source pixels are needed
+//------------------------------------------------------------------------------
+double Operation::getMinimumSourceScale(const cv::Size& sourceSize) const
+{
+  return 1.0;
+}
+
+//------------------------------------------------------------------------------
+// By default assume the whole source is needed
+//------------------------------------------------------------------------------
+cv::Rect Operation::getSourceRegion(const cv::Size& sourceSize) const
+{
+  return cv::Rect(0, 0, sourceSize.width, sourceSize.height);
+}
+
+//------------------------------------------------------------------------------
+// By default assume both pixels and metadata are needed
+//------------------------------------------------------------------------------
+unsigned Operation::getRequirements() const
+{
+  return (OperationRequiresPixels | OperationRequiresMetadata);
+}
@@ -42,6 +42,7 @@
 
 // Boost
 #include <boost/property_tree/ptree.hpp>
+#include <boost/thread/mutex.hpp>
 
 // OpenCV
 #include <opencv2/core/core.hpp>
@@ -51,6 +52,21 @@
 #include "thirdparty/rapidjson/prettywriter.h"
 #include "thirdparty/rapidjson/stringbuffer.h"
 
+// What an operation needs from the input (bit flags, see getRequirements())
+enum
+{
+  OperationRequiresNothing   = 0,
+  OperationRequiresPixels    = 1 << 0,
+  OperationRequiresMetadata  = 1 << 1,
+  OperationRequiresInputData = 1 << 2,
+
+  // Pixels may be handed over in their stored orientation, see setOrientation()
+  OperationHandlesOrientation = 1 << 3,
+
+  // Pixels must match a standard decode exactly (no fast JPEG IDCT)
+  OperationRequiresExactPixels = 1 << 4,
+};
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 class Operation : boost::noncopyable
@@ -79,10 +95,39 @@ class Operation : boost::noncopyable
     void setXmpData(const Exiv2::XmpData* xmpData);
     void setIptcData(const Exiv2::IptcData* iptcData);
     void setImage(cv::Mat& image);
+    void setSourceSize(const cv::Size& sourceSize);
+    void setInputData(const unsigned char* data, size_t size);
+    void setImageRegion(const cv::Rect& region, const cv::Size& fullSize);
+
+    // The EXIF orientation the image passed to setImage() still needs. Only
+    // operations with the OperationHandlesOrientation requirement are given
+    // anything other than 1 (upright). The source size and image region are
+    // always upright.
+    void setOrientation(int orientation);
+
+    // The smallest fraction of the source resolution this operation can work
+    // from without losing output quality. This lets the input be decoded at a
+    // reduced size. Operations that need every source pixel return 1.
+    virtual double getMinimumSourceScale(const cv::Size& sourceSize) const;
+
+    // The part of the (full resolution) source this operation reads pixels
+    // from. Lets the input decode skip everything outside of it.
+    virtual cv::Rect getSourceRegion(const cv::Size& sourceSize) const;
+
+    // Combination of the OperationRequires* flags. Pixels are only decoded if
+    // at least one queued operation requires them.
+    virtual unsigned getRequirements() const;
 
   protected:
     
     void operator=( const Operation& );
+
+    // Operations may run concurrently, but Exiv2 (in particular the XMP
+    // toolkit) must only be used to write metadata from one thread at a time
+    static boost::mutex& getMetadataMutex();
+
+    // Size of mImage once mOrientation is applied
+    cv::Size getImageSize() const;
     
     boost::property_tree::ptree mParams;
 
@@ -91,6 +136,23 @@ class Operation : boost::noncopyable
     const Exiv2::IptcData* mpIptcData;
     cv::Mat mImage;
 
+    // Full resolution size of the source. The image passed to setImage()
+    // may be a reduced resolution version of it.
+    cv::Size mSourceSize;
+
+    // mImage may only cover mImageRegion of the whole source decoded at
+    // mImageFullSize. Both are empty if mImage is the whole source.
+    cv::Rect mImageRegion;
+    cv::Size mImageFullSize;
+
+    // EXIF orientation still to be applied to mImage, 1 if it is upright
+    int mOrientation;
+
+    // Original (encoded) bytes of the input file, owned by the caller. May be
+    // null if pixels were provided directly.
+    const unsigned char* mpInputData;
+    size_t mInputSize;
+
 };
 
 #endif // OPERATION_HPP
@@ -102,6 +102,22 @@ void Read_meta::setup(const ptree& params)
   }
 }
 
+//------------------------------------------------------------------------------
+// Pixels are never looked at, so any source resolution will do
+//------------------------------------------------------------------------------
+double Read_meta::getMinimumSourceScale(const cv::Size& sourceSize) const
+{
+  return 0.0;
+}
+
+//------------------------------------------------------------------------------
+// Only metadata is read
+//------------------------------------------------------------------------------
+unsigned Read_meta::getRequirements() const
+{
+  return OperationRequiresMetadata;
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 bool Read_meta::getStatus() const
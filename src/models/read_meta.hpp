@@ -72,6 +72,8 @@ class Read_meta : public Operation
     virtual bool run();
     virtual bool getJpeg(std::vector<unsigned char>& data);
     virtual bool getPNG(std::vector<unsigned char>& data);
+    virtual double getMinimumSourceScale(const cv::Size& sourceSize) const;
+    virtual unsigned getRequirements() const;
     
     bool getStatus() const;
     
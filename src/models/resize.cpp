@@ -33,6 +33,12 @@
 
 #include "models/resize.hpp"
 #include "utils/utils.hpp"
+#include "utils/area_resizer.hpp"
+#include "utils/orientation.hpp"
+#include "utils/resampler.hpp"
+#include "utils/unsharp_mask.hpp"
+#include "utils/watermark_blender.hpp"
+#include "utils/watermark_cache.hpp"
 
 #include <iostream>
 #include <string>
@@ -43,6 +49,7 @@
 #include <boost/exception/error_info.hpp>
 #include <boost/exception/all.hpp>
 #include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
 
 // OpenCV
 #include <opencv2/imgproc.hpp>
@@ -65,15 +72,26 @@ Resize::Resize() :
     mQuality(92),
     mGravity(ResizeGravitytCenter),
     mPreFilter(false),
+    mPreFilterMode(PreFilterModeAccurate),
+    mpPreFilterCache(0),
+    mFilter(ResizeFilterOpenCV),
+    mLinearLight(false),
     mPassThroughFullSize(true),
     mSharpenAmount(0),
     mSharpenRadius(0.0),
+    mSharpenThreshold(0),
     mPreserveMeta(false),
     mWatermarkFile(),
     mWatermarkType(ResizeWatermarkTypeStandard),
     mWatermarkAmount(0.05),
     mWatermarkMin(0.05),
     mWatermarkMax(0.5),
+    mWatermarkGravity(ResizeWatermarkGravityTile),
+    mWatermarkScale(0.0),
+    mWatermarkMargin(0),
+    mCropRegion(),
+    mKeepIntermediate(false),
+    mDerivedFrom(-1),
     mStatus(ResizeStatusDidNotTry),
     mErrorMessage()
 {
@@ -132,6 +150,8 @@ void Resize::setup(const ptree& params)
   
   readGravity(params);
 
+  readFilter(params);
+
   try
   {
     mPreserveMeta = params.get<bool>("preserve_meta");
@@ -159,6 +179,24 @@ void Resize::setup(const ptree& params)
     // Not required
   }
 
+  try
+  {
+    validatePreFilterMode(params.get<string>("pre_filter_mode"));
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
+
+  try
+  {
+    mLinearLight = params.get<bool>("linear_light");
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
+
   try
   {
     validateSharpenAmount(params.get<unsigned>("sharpen_amount"));
@@ -177,6 +215,15 @@ void Resize::setup(const ptree& params)
     // Not required
   }
 
+  try
+  {
+    validateSharpenThreshold(params.get<unsigned>("sharpen_threshold"));
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
+
   try
   {
     validateWatermarkType(params.get<string>("watermark_type"));
@@ -213,6 +260,38 @@ void Resize::setup(const ptree& params)
   {
     // Not required
   }
+
+  try
+  {
+    string watermarkGravity = params.get<string>("watermark_gravity");
+
+    // Make sure it's lowercase
+    transform(watermarkGravity.begin(), watermarkGravity.end(), watermarkGravity.begin(), ::tolower);
+
+    validateWatermarkGravity(watermarkGravity);
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
+
+  try
+  {
+    validateWatermarkScale(params.get<float>("watermark_scale"));
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
+
+  try
+  {
+    mWatermarkMargin = params.get<unsigned>("watermark_margin");
+  }
+  catch (boost::exception& e)
+  {
+    // Not required
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -299,6 +378,27 @@ void Resize::setWatermarkMinMax(float watermarkMin, float watermarkMax)
   validateWatermarkMinMax(watermarkMin, watermarkMax);
 }
 
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::setWatermarkGravity(const std::string& watermarkGravity)
+{
+  validateWatermarkGravity(watermarkGravity);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::setWatermarkScale(float watermarkScale)
+{
+  validateWatermarkScale(watermarkScale);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::setWatermarkMargin(unsigned watermarkMargin)
+{
+  mWatermarkMargin = watermarkMargin;
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 void Resize::setOutputUrl(const std::string& outputUrl)
@@ -320,6 +420,17 @@ bool Resize::getPreserveMeta() const
   return mPreserveMeta;
 }
 
+//------------------------------------------------------------------------------
+// Resizes rotate their own output, so the source can stay in its stored
+// orientation. Metadata is only needed to copy it to the output.
+//------------------------------------------------------------------------------
+unsigned Resize::getRequirements() const
+{
+  const unsigned requirements = (OperationRequiresPixels | OperationHandlesOrientation);
+
+  return mPreserveMeta ? (requirements | OperationRequiresMetadata) : requirements;
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 bool Resize::getStatus() const
@@ -327,6 +438,137 @@ bool Resize::getStatus() const
   return mStatus;
 }
 
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Resize::getPreFilter() const
+{
+  return mPreFilter;
+}
+
+//------------------------------------------------------------------------------
+// What run() will blur when pre-filtering the image it was given: the region
+// of the image, the sigma and the mode (see PreFilterCache). False if it will
+// not pre-filter.
+//------------------------------------------------------------------------------
+bool Resize::getPreFilterRequest(Rect& imageRegion, double& sigma, int& mode) const
+{
+  if (!mPreFilter || mImage.empty() ||
+      (mHeight == 0) || (mWidth == 0) || (mHeight * mWidth > ARION_RESIZE_MAX_PIXELS))
+  {
+    return false;
+  }
+
+  const Size sourceSize = mSourceSize.area() ? mSourceSize : getImageSize();
+
+  // Same condition as in run()
+  if (!mPassThroughFullSize ||
+      (mHeight == sourceSize.height && mWidth == sourceSize.width && getImageSize() == sourceSize))
+  {
+    return false;
+  }
+
+  Rect cropRegion;
+  Size size;
+
+  if (!computeGeometry(sourceSize, cropRegion, size))
+  {
+    return false;
+  }
+
+  imageRegion = orientRect(mapToImage(cropRegion, sourceSize),
+                           getImageSize(),
+                           inverseOrientation(mOrientation));
+
+  sigma = (double)orientSize(imageRegion.size(), mOrientation).width/1000.0;
+  mode = mPreFilterMode;
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::setPreFilterCache(PreFilterCache* cache)
+{
+  mpPreFilterCache = cache;
+}
+
+//------------------------------------------------------------------------------
+// The crop region and output size of a resize that could take part in a
+// cascade. Returns false for resizes that fail without looking at pixels or
+// pass the source through at full size.
+//------------------------------------------------------------------------------
+bool Resize::getCascadeGeometry(const Size& sourceSize, Rect& cropRegion, Size& size) const
+{
+  if ((mHeight == 0) || (mWidth == 0) || (mHeight * mWidth > ARION_RESIZE_MAX_PIXELS))
+  {
+    return false;
+  }
+
+  if ((mHeight == (unsigned)sourceSize.height) && (mWidth == (unsigned)sourceSize.width))
+  {
+    return false;
+  }
+
+  if (!computeGeometry(sourceSize, cropRegion, size))
+  {
+    return false;
+  }
+
+  return (cropRegion & Rect(0, 0, sourceSize.width, sourceSize.height)) == cropRegion;
+}
+
+//------------------------------------------------------------------------------
+// Whether this resize may start from the intermediate of other. Both must
+// filter the same way, otherwise e.g. the pre-filter blur or the linear light
+// of one would carry over into the other.
+//------------------------------------------------------------------------------
+bool Resize::canCascadeFrom(const Resize& other) const
+{
+  return (mPreFilter == other.mPreFilter) &&
+         (mPreFilterMode == other.mPreFilterMode) &&
+         (mFilter == other.mFilter) &&
+         (mLinearLight == other.mLinearLight);
+}
+
+//------------------------------------------------------------------------------
+// After a successful run, the resized (not yet sharpened or watermarked) image
+// covers region of the full resolution source scaled to fullSize. Other
+// resizes can start from it instead of the decoded source.
+//------------------------------------------------------------------------------
+bool Resize::getIntermediate(Mat& image, Rect& region, Size& fullSize) const
+{
+  if ((mStatus != ResizeStatusSuccess) || mImageResized.empty() || !mCropRegion.area())
+  {
+    return false;
+  }
+
+  const Size sourceSize = mSourceSize.area() ? mSourceSize : getImageSize();
+
+  const double xf = (double)mImageResized.cols / (double)mCropRegion.width;
+  const double yf = (double)mImageResized.rows / (double)mCropRegion.height;
+
+  image = mImageResized;
+  fullSize = Size((int)round(sourceSize.width * xf), (int)round(sourceSize.height * yf));
+  region = Rect((int)round(mCropRegion.x * xf), (int)round(mCropRegion.y * yf),
+                mImageResized.cols, mImageResized.rows);
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::setKeepIntermediate(bool keepIntermediate)
+{
+  mKeepIntermediate = keepIntermediate;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::setDerivedFrom(int operationIndex)
+{
+  mDerivedFrom = operationIndex;
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 bool Resize::getJpeg(std::vector<unsigned char>& data)
@@ -412,44 +654,119 @@ void Resize::readGravity(const ptree& params)
 }
 
 //------------------------------------------------------------------------------
+// One of the ResizeGravity* values, -1 if gravity is not one of their names
 //------------------------------------------------------------------------------
-void Resize::validateGravity(const string& gravity)
+static int parseGravity(const string& gravity)
 {
   if (gravity == "center" || gravity == "c")
   {
-    mGravity = ResizeGravitytCenter;
+    return ResizeGravitytCenter;
   }
   else if (gravity == "north" || gravity == "n")
   {
-    mGravity = ResizeGravityNorth;
+    return ResizeGravityNorth;
   }
   else if (gravity == "south" || gravity == "s")
   {
-    mGravity = ResizeGravitySouth;
+    return ResizeGravitySouth;
   }
   else if (gravity == "west" || gravity == "w")
   {
-    mGravity = ResizeGravityWest;
+    return ResizeGravityWest;
   }
   else if (gravity == "east" || gravity == "e")
   {
-    mGravity = ResizeGravityEast;
+    return ResizeGravityEast;
   }
   else if (gravity == "northwest" || gravity == "nw")
   {
-    mGravity = ResizeGravityNorthWest;
+    return ResizeGravityNorthWest;
   }
   else if (gravity == "northeast" || gravity == "ne")
   {
-    mGravity = ResizeGravityNorthEast;
+    return ResizeGravityNorthEast;
   }
   else if (gravity == "southwest" || gravity == "sw")
   {
-    mGravity = ResizeGravitySouthWest;
+    return ResizeGravitySouthWest;
   }
   else if (gravity == "southeast" || gravity == "se")
   {
-    mGravity = ResizeGravitySouthEast;
+    return ResizeGravitySouthEast;
+  }
+
+  return -1;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::validateGravity(const string& gravity)
+{
+  const int value = parseGravity(gravity);
+
+  if (value >= 0)
+  {
+    mGravity = value;
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::readFilter(const ptree& params)
+{
+  try
+  {
+    string filter = params.get<std::string>("filter");
+
+    // Make sure it's lowercase
+    transform(filter.begin(), filter.end(), filter.begin(), ::tolower);
+
+    validateFilter(filter);
+  }
+  catch (boost::exception& e)
+  {
+    // Not required, resize with OpenCV's INTER_AREA (set by constructor)
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::validateFilter(const string& filter)
+{
+  if (filter == "area")
+  {
+    mFilter = ResamplerFilterArea;
+  }
+  else if (filter == "bilinear")
+  {
+    mFilter = ResamplerFilterBilinear;
+  }
+  else if (filter == "catrom")
+  {
+    mFilter = ResamplerFilterCatrom;
+  }
+  else if (filter == "mitchell")
+  {
+    mFilter = ResamplerFilterMitchell;
+  }
+  else if (filter == "lanczos3")
+  {
+    mFilter = ResamplerFilterLanczos3;
+  }
+}
+
+//------------------------------------------------------------------------------
+// The fast mode approximates the Gaussian blur with box blurs
+//------------------------------------------------------------------------------
+void Resize::validatePreFilterMode(const string& preFilterMode)
+{
+  if (preFilterMode == "accurate")
+  {
+    mPreFilterMode = PreFilterModeAccurate;
+  }
+  else if (preFilterMode == "fast")
+  {
+    mPreFilterMode = PreFilterModeFast;
   }
 }
 
@@ -499,6 +816,10 @@ void Resize::validateWatermarkType(const string& watermarkType)
   {
     mWatermarkType = ResizeWatermarkTypeAdaptive;
   }
+  else if (watermarkType == "adaptive_block")
+  {
+    mWatermarkType = ResizeWatermarkTypeAdaptiveBlock;
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -516,7 +837,7 @@ void Resize::validateWatermarkAmount(float watermarkAmount)
 }
 
 //------------------------------------------------------------------------------
-// These values only apply to the adaptive watermark type
+// These values only apply to the adaptive and adaptive_block watermark types
 //------------------------------------------------------------------------------
 void Resize::validateWatermarkMinMax(float watermarkMin, float watermarkMax)
 {
@@ -543,6 +864,39 @@ void Resize::validateWatermarkMinMax(float watermarkMin, float watermarkMax)
 
 }
 
+//------------------------------------------------------------------------------
+// "tile" repeats the watermark over the output, a gravity places it once
+//------------------------------------------------------------------------------
+void Resize::validateWatermarkGravity(const string& watermarkGravity)
+{
+  if (watermarkGravity == "tile")
+  {
+    mWatermarkGravity = ResizeWatermarkGravityTile;
+    return;
+  }
+
+  const int value = parseGravity(watermarkGravity);
+
+  if (value >= 0)
+  {
+    mWatermarkGravity = value;
+  }
+}
+
+//------------------------------------------------------------------------------
+// A fraction of the output width, 0 keeps the watermark's own size
+//------------------------------------------------------------------------------
+void Resize::validateWatermarkScale(float watermarkScale)
+{
+  if ((watermarkScale < 0.0) || (watermarkScale > 1.0))
+  {
+    // Keep constructor default
+    return;
+  }
+
+  mWatermarkScale = watermarkScale;
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 void Resize::validateQuality(unsigned quality)
@@ -575,42 +929,48 @@ void Resize::validateSharpenRadius(float sharpenRadius)
 
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
-void Resize::computeSizeSquare()
+void Resize::validateSharpenThreshold(unsigned sharpenThreshold)
+{
+  if (sharpenThreshold <= 255)
+  {
+    mSharpenThreshold = sharpenThreshold;
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resize::computeSizeSquare(const Size& sourceSize, Rect& cropRegion, Size& size) const
 {
   // Don't assume the height and width the user specified are the same
   // and just use the width
-  mSize = Size(mWidth, mWidth);
+  size = Size(mWidth, mWidth);
   
-  const unsigned sourceHeight = (unsigned)mImage.rows;
-  const unsigned sourceWidth = (unsigned)mImage.cols;
+  const unsigned sourceHeight = (unsigned)sourceSize.height;
+  const unsigned sourceWidth = (unsigned)sourceSize.width;
 
   if (sourceHeight == sourceWidth)
   {
     // Easy... the image is already square
-    mImageToResize = mImage;
+    cropRegion = Rect(0, 0, sourceWidth, sourceHeight);
   }
   else if (sourceHeight > sourceWidth)
   {
     int y = round(((double)sourceHeight - (double)sourceWidth)/2.0);
-    Rect cropRegion(0, y, sourceWidth, sourceWidth);
-
-    mImageToResize = mImage(cropRegion);
+    cropRegion = Rect(0, y, sourceWidth, sourceWidth);
   }
   else // sourceWidth < sourceHeight
   {
     int x = round(((double)sourceWidth - (double)sourceHeight)/2.0);
-    Rect cropRegion(x, 0, sourceHeight, sourceHeight);
-
-    mImageToResize = mImage(cropRegion);
+    cropRegion = Rect(x, 0, sourceHeight, sourceHeight);
   }
 }
 
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
-void Resize::computeSizeWidth()
+void Resize::computeSizeWidth(const Size& sourceSize, Rect& cropRegion, Size& size) const
 {
-  const unsigned sourceHeight = (unsigned)mImage.rows;
-  const unsigned sourceWidth = (unsigned)mImage.cols;
+  const unsigned sourceHeight = (unsigned)sourceSize.height;
+  const unsigned sourceWidth = (unsigned)sourceSize.width;
   
   double aspect = (double)sourceHeight / (double)sourceWidth;
   
@@ -624,17 +984,17 @@ void Resize::computeSizeWidth()
     resizeWidth = getAspectWidth(resizeHeight, aspect);
   }
 
-  mImageToResize = mImage;
-  mSize = Size(resizeWidth, resizeHeight);
+  cropRegion = Rect(0, 0, sourceWidth, sourceHeight);
+  size = Size(resizeWidth, resizeHeight);
 
 }
 
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
-void Resize::computeSizeHeight()
+void Resize::computeSizeHeight(const Size& sourceSize, Rect& cropRegion, Size& size) const
 {
-  const unsigned sourceHeight = (unsigned)mImage.rows;
-  const unsigned sourceWidth = (unsigned)mImage.cols;
+  const unsigned sourceHeight = (unsigned)sourceSize.height;
+  const unsigned sourceWidth = (unsigned)sourceSize.width;
   
   double aspect = (double)sourceHeight / (double)sourceWidth;
   
@@ -648,16 +1008,16 @@ void Resize::computeSizeHeight()
     resizeHeight = getAspectHeight(resizeWidth, aspect);
   }
 
-  mImageToResize = mImage;
-  mSize = Size(resizeWidth, resizeHeight);
+  cropRegion = Rect(0, 0, sourceWidth, sourceHeight);
+  size = Size(resizeWidth, resizeHeight);
 }
 
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
-void Resize::computeSizeFill()
+void Resize::computeSizeFill(const Size& sourceSize, Rect& cropRegion, Size& size) const
 {
-  const unsigned sourceHeight = mImage.rows;
-  const unsigned sourceWidth = mImage.cols;
+  const unsigned sourceHeight = sourceSize.height;
+  const unsigned sourceWidth = sourceSize.width;
   
   double destAspect = (double)mHeight / (double)mWidth;
   
@@ -730,14 +1090,148 @@ void Resize::computeSizeFill()
 
   }
   
-  Rect cropRegion(cropX, cropY, cropWidth, cropHeight);
-
-  mImageToResize = mImage(cropRegion);
+  cropRegion = Rect(cropX, cropY, cropWidth, cropHeight);
   
-  mSize = Size(mWidth, mHeight);
+  size = Size(mWidth, mHeight);
 
 }
 
+//------------------------------------------------------------------------------
+// Work out which region of the source gets resized and the final output size.
+// Returns false if the resize type is unknown.
+//------------------------------------------------------------------------------
+bool Resize::computeGeometry(const Size& sourceSize, Rect& cropRegion, Size& size) const
+{
+  switch (mType)
+  {
+    //--------------------------
+    //      Square resize
+    //--------------------------
+    case ResizeTypeSquare:
+      computeSizeSquare(sourceSize, cropRegion, size);
+      return true;
+
+    //--------------------------
+    //  Height priority resize
+    //--------------------------
+    case ResizeTypeFixedHeight:
+      computeSizeHeight(sourceSize, cropRegion, size);
+      return true;
+
+    //--------------------------
+    //      Fill resize
+    //--------------------------
+    case ResizeTypeFill:
+      computeSizeFill(sourceSize, cropRegion, size);
+      return true;
+
+    //--------------------------
+    //  Width priority resize
+    //--------------------------
+    case ResizeTypeFixedWidth:
+      computeSizeWidth(sourceSize, cropRegion, size);
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Map a region of the full resolution source onto mImage, which may have been
+// decoded at a reduced resolution and/or only cover part of the source. The
+// result is in the upright frame, see getImageSize().
+//------------------------------------------------------------------------------
+Rect Resize::mapToImage(const Rect& region, const Size& sourceSize) const
+{
+  const Size imageSize = getImageSize();
+  const Size fullSize = mImageFullSize.area() ? mImageFullSize : imageSize;
+  const Point offset = mImageRegion.tl();
+
+  if ((sourceSize == fullSize) && (offset.x == 0) && (offset.y == 0))
+  {
+    return region;
+  }
+
+  const double xf = (double)fullSize.width / (double)sourceSize.width;
+  const double yf = (double)fullSize.height / (double)sourceSize.height;
+
+  int x0 = (int)round(region.x * xf) - offset.x;
+  int y0 = (int)round(region.y * yf) - offset.y;
+  int x1 = (int)round((region.x + region.width) * xf) - offset.x;
+  int y1 = (int)round((region.y + region.height) * yf) - offset.y;
+
+  x0 = max(0, min(x0, imageSize.width - 1));
+  y0 = max(0, min(y0, imageSize.height - 1));
+  x1 = max(x0 + 1, min(x1, imageSize.width));
+  y1 = max(y0 + 1, min(y1, imageSize.height));
+
+  return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+//------------------------------------------------------------------------------
+// The source only needs enough resolution to cover the crop region at the
+// output size, anything beyond that is thrown away by the resize
+//------------------------------------------------------------------------------
+double Resize::getMinimumSourceScale(const Size& sourceSize) const
+{
+  // These will fail in run() without looking at any pixels
+  if ((mHeight == 0) || (mWidth == 0) || (mHeight * mWidth > ARION_RESIZE_MAX_PIXELS))
+  {
+    return 0.0;
+  }
+
+  // Passed through at full size
+  if ((mHeight == (unsigned)sourceSize.height) && (mWidth == (unsigned)sourceSize.width))
+  {
+    return 1.0;
+  }
+
+  Rect cropRegion;
+  Size size;
+
+  if (!computeGeometry(sourceSize, cropRegion, size))
+  {
+    return 0.0;
+  }
+
+  double scale = max((double)size.width / (double)cropRegion.width,
+                     (double)size.height / (double)cropRegion.height);
+
+  return min(scale, 1.0);
+}
+
+//------------------------------------------------------------------------------
+// Only the crop region is read, which lets fill and square resizes of off
+// aspect sources skip decoding the rest
+//------------------------------------------------------------------------------
+Rect Resize::getSourceRegion(const Size& sourceSize) const
+{
+  const Rect whole(0, 0, sourceSize.width, sourceSize.height);
+
+  // These will fail in run() without looking at any pixels
+  if ((mHeight == 0) || (mWidth == 0) || (mHeight * mWidth > ARION_RESIZE_MAX_PIXELS))
+  {
+    return Rect();
+  }
+
+  // Passed through at full size
+  if ((mHeight == (unsigned)sourceSize.height) && (mWidth == (unsigned)sourceSize.width))
+  {
+    return whole;
+  }
+
+  Rect cropRegion;
+  Size size;
+
+  if (!computeGeometry(sourceSize, cropRegion, size))
+  {
+    return Rect();
+  }
+
+  return (cropRegion & whole);
+}
+
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 bool Resize::run()
@@ -752,6 +1246,10 @@ bool Resize::run()
     return false;
   }
 
+  // The image may have been decoded at a reduced resolution, all geometry is
+  // computed relative to the full resolution source
+  const Size sourceSize = mSourceSize.area() ? mSourceSize : getImageSize();
+
   //---------------------------------------------------
   //  Validate resize dimensions
   //---------------------------------------------------
@@ -780,85 +1278,80 @@ bool Resize::run()
   //---------------------------------------------------
   //  Perform the resize operation and write to disk
   //---------------------------------------------------
+  bool sharpen = false;
+
   try
   {
     //---------------------------------------------------
     // Only resize if the requested image size does not
     // already match the requested image
     //---------------------------------------------------
-    if (mPassThroughFullSize && !(mHeight == mImage.rows && mWidth == mImage.cols)) {
-      static const int interpolation = INTER_AREA;
+    if (mPassThroughFullSize && !(mHeight == sourceSize.height && mWidth == sourceSize.width && getImageSize() == sourceSize)) {
+      Rect cropRegion;
 
-      switch (mType)
+      if (!computeGeometry(sourceSize, cropRegion, mSize))
       {
-        //--------------------------
-        //      Square resize
-        //--------------------------s
-        case ResizeTypeSquare:
-        {
-          computeSizeSquare();
-          break;
-        }
-
-        //--------------------------
-        //  Height priority resize
-        //--------------------------
-        case ResizeTypeFixedHeight:
-        {
-          computeSizeHeight();
-          break;
-        }
-        
-        //--------------------------
-        //      Fill resize
-        //--------------------------
-        case ResizeTypeFill:
-        {
-          computeSizeFill();
-          break;
-        }
-
-        //--------------------------
-        //  Width priority resize
-        //--------------------------
-        case ResizeTypeFixedWidth:
-        {
-          computeSizeWidth();
-          break;
-        }
-        
         //--------------------------
         //  Error (unknown type)
         //--------------------------
-        default:
-          mStatus = ResizeStatusError;
-          mErrorMessage = "Invalid resize type";
-          return false;
+        mStatus = ResizeStatusError;
+        mErrorMessage = "Invalid resize type";
+        return false;
       }
 
+      mCropRegion = cropRegion;
+
+      // The image may still be in its stored orientation, in which case the
+      // crop is taken in that frame and the (small) result rotated instead
+      const Rect imageRegion = orientRect(mapToImage(cropRegion, sourceSize),
+                                          getImageSize(),
+                                          inverseOrientation(mOrientation));
+
+      mImageToResize = mImage(imageRegion);
+
       if (mPreFilter)
       {
-        double sigma = (double)mImageToResize.cols/1000.0;
+        double sigma = (double)orientSize(mImageToResize.size(), mOrientation).width/1000.0;
 
         // Make sure we're not editing the original...
         Mat imageToResizeFiltered;
 
-        GaussianBlur(mImageToResize, imageToResizeFiltered, cv::Size(0, 0), sigma);
+        if (mpPreFilterCache)
+        {
+          imageToResizeFiltered = mpPreFilterCache->get(mImage, imageRegion, sigma, mPreFilterMode);
+        }
+        else
+        {
+          PreFilterCache::blur(mImageToResize, imageToResizeFiltered, sigma, mPreFilterMode);
+        }
 
         // Resize operation
-        resize(imageToResizeFiltered, mImageResized, mSize, 0, 0, interpolation);
+        resample(imageToResizeFiltered);
       }
       else
       {
         // Resize operation
-        resize(mImageToResize, mImageResized, mSize, 0, 0, interpolation);
+        resample(mImageToResize);
       }
 
-      if (mSharpenAmount)
+      if (mSharpenAmount && mKeepIntermediate)
+      {
+        // Filled in by finishImage()
+        mImageResizedFinal.create(mImageResized.size(), mImageResized.type());
+
+        sharpen = true;
+      }
+      else if (mSharpenAmount)
       {
-        GaussianBlur(mImageResized, mImageResizedFinal, cv::Size(0, 0), mSharpenRadius);
+        // Sharpened in place by finishImage()
+        mImageResizedFinal = mImageResized;
 
-        addWeighted(mImageResized, 1.0 + (mSharpenAmount/100.0), mImageResizedFinal, -(mSharpenAmount/100.0), 0, mImageResizedFinal);
+        sharpen = true;
+      }
+      else if (mKeepIntermediate && mWatermarkFile.length())
+      {
+        // The watermark is applied in place
+        mImageResizedFinal = mImageResized.clone();
       }
       else
       {
@@ -867,13 +1360,10 @@ bool Resize::run()
       }
     } else {
       // The image already matches the requested dimensions, so no resize or retouch required.
-      mImageResizedFinal = mImage.clone();
+      orientImage(mImage, mImageResizedFinal, mOrientation);
     }
 
-    if (mWatermarkFile.length())
-    {
-      applyWatermark();
-    }
+    finishImage(sharpen);
   }
   catch(boost::exception& e)
   {
@@ -902,6 +1392,8 @@ bool Resize::run()
     {
       try
       {
+        boost::mutex::scoped_lock lock(getMetadataMutex());
+
         Exiv2::Image::AutoPtr outputExivImage = Exiv2::ImageFactory::open(mOutputFile.c_str());
 
         if (outputExivImage.get() != 0)
@@ -943,99 +1435,179 @@ bool Resize::run()
 }
 
 //------------------------------------------------------------------------------
-// Apply the watermark in place
+// Resize source to mSize into mImageResized with the requested filter. Linear
+// light resizes and large non-integer reductions (see AreaResizer) without a
+// filter use the resampler's area filter, which does the latter in a single
+// pass faster than both INTER_AREA and the two-stage AreaResizer.
+//
+// A source that is still in its stored orientation is resized to the rotated
+// size, and only the result is rotated upright.
 //------------------------------------------------------------------------------
-void Resize::applyWatermark()
+void Resize::resample(const Mat& source)
 {
-  Mat watermark = imread(mWatermarkFile, IMREAD_UNCHANGED);
+  const Size size = orientSize(mSize, inverseOrientation(mOrientation));
+
+  const bool largeReduction = AreaResizer(source.size(), size).getTwoStage();
 
-  if (watermark.empty())
+  if (((mFilter != ResizeFilterOpenCV) || mLinearLight || largeReduction) && Resampler::canResample(source))
+  {
+    const int filter = (mFilter != ResizeFilterOpenCV) ? mFilter : ResamplerFilterArea;
+
+    Resampler resampler(source.size(), size, filter);
+
+    if (mLinearLight)
+    {
+      resampler.resizeLinearLight(source, mImageResized);
+    }
+    else
+    {
+      resampler.resize(source, mImageResized);
+    }
+  }
+  else
+  {
+    resize(source, mImageResized, size, 0, 0, INTER_AREA);
+  }
+
+  orientImage(mImageResized, mImageResized, mOrientation);
+}
+
+//------------------------------------------------------------------------------
+// Sharpen (unsharp mask of mImageResized into mImageResizedFinal, which may
+// be the same image) and watermark the output in tiles of rows small enough to
+// stay in cache, rather than one full image pass per step.
+//------------------------------------------------------------------------------
+void Resize::finishImage(bool sharpen)
+{
+  boost::shared_ptr<const Watermark> watermark;
+
+  if (mWatermarkFile.length())
+  {
+    WatermarkCache& watermarkCache = WatermarkCache::getShared();
+
+    watermark = watermarkCache.get(mWatermarkFile);
+
+    if (watermark && (mWatermarkScale > 0.0))
+    {
+      // Scaled once per output size and kept by the cache
+      const int width = max(1, (int)round(mWatermarkScale * mImageResizedFinal.cols));
+      const int height = max(1, (int)round((double)width * watermark->alpha.rows / watermark->alpha.cols));
+
+      watermark = watermarkCache.get(mWatermarkFile, Size(width, height));
+    }
+  }
+
+  const bool watermarked = (watermark.get() != 0);
+
+  if (!sharpen && !watermarked)
   {
     return;
   }
 
-  double blend = mWatermarkAmount / 255.0;
-  const double blendMin = mWatermarkMin / 255.0;
-  const double blendMax = mWatermarkMax / 255.0;
-  const double blendDelta = blendMax - blendMin;
-  const double normFactor = 9.0 / 255.0;
+  const int rows = mImageResizedFinal.rows;
+  const int rowBytes = mImageResizedFinal.cols * (int)mImageResizedFinal.elemSize();
 
-  // In case we can't compute brightness for adaptive watermark use the min blend specified
-  if (mWatermarkType == ResizeWatermarkTypeAdaptive)
+  // Without sharpening the watermark is blended in a single call, which gives
+  // it the most rows to split between threads
+  const int tileRows = sharpen ? max(1, ARION_RESIZE_TILE_BYTES / max(1, rowBytes)) : max(1, rows);
+
+  boost::scoped_ptr<UnsharpMask> unsharpMask;
+  boost::scoped_ptr<WatermarkBlender> watermarkBlender;
+
+  if (sharpen)
   {
-    blend = blendMin;
+    unsharpMask.reset(new UnsharpMask(mImageResized,
+                                      mImageResizedFinal,
+                                      mSharpenRadius,
+                                      mSharpenAmount / 100.0,
+                                      mSharpenThreshold));
   }
 
-  int wx = 0;
-  int wy = 0;
-  
-  for (int y = 0; y < mImageResizedFinal.rows; ++y)
+  if (watermarked)
   {
-    // If the final image is taller than the watermark, repeat it
-    if (y >= watermark.rows)
+    if (mWatermarkType == ResizeWatermarkTypeAdaptive)
     {
-      wy = y % watermark.rows;
+      watermarkBlender.reset(new WatermarkBlender(*watermark, mWatermarkMin, mWatermarkMax));
+    }
+    else if (mWatermarkType == ResizeWatermarkTypeAdaptiveBlock)
+    {
+      watermarkBlender.reset(new WatermarkBlender(*watermark, mWatermarkMin, mWatermarkMax));
+
+      // Block brightness is taken before sharpening, which may write to
+      // mImageResizedFinal as it goes
+      watermarkBlender->setBlocks(sharpen ? mImageResized : mImageResizedFinal, WATERMARK_BLOCK_SIZE);
     }
     else
     {
-      wy = y;
+      watermarkBlender.reset(new WatermarkBlender(*watermark, mWatermarkAmount));
     }
 
-    for (int x = 0; x < mImageResizedFinal.cols; ++x)
+    if (mWatermarkGravity != ResizeWatermarkGravityTile)
     {
-      // If the final image is wider than the watermark, repeat it
-      if (x >= watermark.cols)
-      {
-        wx = x % watermark.cols;
-      }
-      else
-      {
-        wx = x;
-      }
+      watermarkBlender->setPosition(getWatermarkOrigin(watermark->alpha.size()), false);
+    }
+  }
 
-      int watermarkIdx = wy * watermark.step + wx * watermark.channels();
-      
-      // determine the opacity of the foreground pixel, using its fourth (alpha) channel.
-      unsigned char alpha = watermark.data[watermarkIdx + 3];
+  for (int y0 = 0; y0 < rows; y0 += tileRows)
+  {
+    const int y1 = min(rows, y0 + tileRows);
 
-      // Only apply watermark if alpha is non-zero
-      if (alpha)
-      {
-        int i = y * mImageResizedFinal.step + x * mImageResizedFinal.channels();
+    if (sharpen)
+    {
+      unsharpMask->process(y1);
+    }
 
-        if ((mWatermarkType == ResizeWatermarkTypeAdaptive) && mImageResizedFinal.channels() >= 3)
-        {
-          unsigned char b = mImageResizedFinal.data[i];
-          unsigned char g = mImageResizedFinal.data[i+1];
-          unsigned char r = mImageResizedFinal.data[i+2];
+    if (watermarked)
+    {
+      watermarkBlender->blend(mImageResizedFinal, y0, y1);
+    }
+  }
+}
 
-          // Use a fast approximation for brightness
-          // http://stackoverflow.com/questions/596216/formula-to-determine-brightness-of-rgb-color
-          unsigned brightness = (r+r+r+b+g+g+g+g)>>3;
+//------------------------------------------------------------------------------
+// Top left corner of a watermark placed by mWatermarkGravity, mWatermarkMargin
+// pixels in from the edges it is placed against
+//------------------------------------------------------------------------------
+Point Resize::getWatermarkOrigin(const Size& watermarkSize) const
+{
+  const int margin = (int)mWatermarkMargin;
 
-          // Log-based blend
-          // blend = (blendMax - blendMin) * log10 ( 9*(brightness / 255) + 1) + blendMin
-          blend = blendDelta * log10(1.0 + normFactor * (double)brightness) + blendMin;
+  const int left = margin;
+  const int centerX = (mImageResizedFinal.cols - watermarkSize.width) / 2;
+  const int right = mImageResizedFinal.cols - watermarkSize.width - margin;
 
-          // Linear blend - for reference...
-          // blend = (blendMax - blendMin) * ((double)brightness/255.0) + blendMin;
+  const int top = margin;
+  const int centerY = (mImageResizedFinal.rows - watermarkSize.height) / 2;
+  const int bottom = mImageResizedFinal.rows - watermarkSize.height - margin;
 
-        }
+  switch (mWatermarkGravity)
+  {
+    case ResizeGravityNorth:
+      return Point(centerX, top);
 
-        double opacity = blend * ((double) alpha);
+    case ResizeGravityNorthWest:
+      return Point(left, top);
 
-        // Combine the background and watermark pixel, using the opacity, 
-        for (int c = 0; c < mImageResizedFinal.channels(); ++c)
-        {
-          int finalOffset = i + c;
-          unsigned char foregroundPx = watermark.data[watermarkIdx + c];
-          unsigned char backgroundPx = mImageResizedFinal.data[finalOffset];
-          
-          // Apply in place
-          mImageResizedFinal.data[finalOffset] = backgroundPx * (1.0 - opacity) + foregroundPx * opacity;
-        }
-      }
-    }
+    case ResizeGravityNorthEast:
+      return Point(right, top);
+
+    case ResizeGravitySouth:
+      return Point(centerX, bottom);
+
+    case ResizeGravitySouthWest:
+      return Point(left, bottom);
+
+    case ResizeGravitySouthEast:
+      return Point(right, bottom);
+
+    case ResizeGravityWest:
+      return Point(left, centerY);
+
+    case ResizeGravityEast:
+      return Point(right, centerY);
+
+    default:
+      return Point(centerX, centerY);
   }
 }
 
@@ -1069,6 +1641,18 @@ void Resize::serialize(rapidjson::Writer<rapidjson::StringBuffer>& writer) const
     writer.String("output_width");
     writer.Uint(mImageResized.cols);
 
+    // Which image the output was resized from
+    writer.String("derived_from");
+
+    if (mDerivedFrom >= 0)
+    {
+      writer.Uint(mDerivedFrom);
+    }
+    else
+    {
+      writer.String("source");
+    }
+
   }
   else
   {
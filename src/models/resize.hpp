@@ -45,6 +45,7 @@
 
 // Local
 #include "models/operation.hpp"
+#include "utils/pre_filter_cache.hpp"
 
 // Resize images that are maximum 10,000 x 10,000 pixels
 // At the max this will use 3.2GB of memory (a 100MP image)
@@ -52,6 +53,14 @@
 #ifndef ARION_RESIZE_MAX_PIXELS
 #define ARION_RESIZE_MAX_PIXELS 100000000
 #endif
+
+// Sharpening and watermarking work through the output in tiles of rows of
+// about this many bytes, so each tile stays in L2 between the steps
+// This can be overridden at build time
+#ifndef ARION_RESIZE_TILE_BYTES
+#define ARION_RESIZE_TILE_BYTES (256 * 1024)
+#endif
+
 enum
 {
   ResizeTypeInvalid     = -1,
@@ -82,10 +91,25 @@ enum
   ResizeGravitySouthEast = 8
 };
 
+// Without a filter param resizes go through OpenCV's INTER_AREA, otherwise
+// mFilter is one of the ResamplerFilter* values (see utils/resampler.hpp)
+enum
+{
+  ResizeFilterOpenCV = -1
+};
+
 enum
 {
-  ResizeWatermarkTypeStandard = 0,
-  ResizeWatermarkTypeAdaptive = 1,
+  ResizeWatermarkTypeStandard      = 0,
+  ResizeWatermarkTypeAdaptive      = 1,
+  ResizeWatermarkTypeAdaptiveBlock = 2,
+};
+
+// Without a watermark_gravity the watermark is repeated over the whole output,
+// otherwise mWatermarkGravity is one of the ResizeGravity* values
+enum
+{
+  ResizeWatermarkGravityTile = -1
 };
 
 //------------------------------------------------------------------------------
@@ -101,6 +125,9 @@ class Resize : public Operation
     virtual bool run();
     virtual bool getJpeg(std::vector<unsigned char>& data);
     virtual bool getPNG(std::vector<unsigned char>& data);
+    virtual double getMinimumSourceScale(const cv::Size& sourceSize) const;
+    virtual cv::Rect getSourceRegion(const cv::Size& sourceSize) const;
+    virtual unsigned getRequirements() const;
     
     void setType(const std::string& type);
     void setHeight(unsigned height);
@@ -114,11 +141,24 @@ class Resize : public Operation
     void setWatermarkType(const std::string& watermarkType);
     void setWatermarkAmount(float watermarkAmount);
     void setWatermarkMinMax(float watermarkMin, float watermarkMax);
+    void setWatermarkGravity(const std::string& watermarkGravity);
+    void setWatermarkScale(float watermarkScale);
+    void setWatermarkMargin(unsigned watermarkMargin);
     void setOutputUrl(const std::string& outputUrl);
     
     std::string getOutputFile() const;
     bool getPreserveMeta() const;
     bool getStatus() const;
+    bool getPreFilter() const;
+    bool getPreFilterRequest(cv::Rect& imageRegion, double& sigma, int& mode) const;
+    void setPreFilterCache(PreFilterCache* cache);
+
+    // Resize cascade support, see Arion::planResizeCascade()
+    bool getCascadeGeometry(const cv::Size& sourceSize, cv::Rect& cropRegion, cv::Size& size) const;
+    bool canCascadeFrom(const Resize& other) const;
+    bool getIntermediate(cv::Mat& image, cv::Rect& region, cv::Size& fullSize) const;
+    void setKeepIntermediate(bool keepIntermediate);
+    void setDerivedFrom(int operationIndex);
     void outputStatus(std::ostream& s, unsigned indent) const;
     
   #ifdef JSON_PRETTY_OUTPUT
@@ -132,26 +172,36 @@ class Resize : public Operation
     int getAspectHeight(int resizeWidth, double aspect) const;
     int getAspectWidth(int resizeHeight, double aspect) const;
     
-    void computeSizeSquare();
-    void computeSizeWidth();
-    void computeSizeHeight();
-    void computeSizeFill();
+    void computeSizeSquare(const cv::Size& sourceSize, cv::Rect& cropRegion, cv::Size& size) const;
+    void computeSizeWidth(const cv::Size& sourceSize, cv::Rect& cropRegion, cv::Size& size) const;
+    void computeSizeHeight(const cv::Size& sourceSize, cv::Rect& cropRegion, cv::Size& size) const;
+    void computeSizeFill(const cv::Size& sourceSize, cv::Rect& cropRegion, cv::Size& size) const;
+    bool computeGeometry(const cv::Size& sourceSize, cv::Rect& cropRegion, cv::Size& size) const;
+    cv::Rect mapToImage(const cv::Rect& region, const cv::Size& sourceSize) const;
     
     void readType(const boost::property_tree::ptree& params);
     void readGravity(const boost::property_tree::ptree& params);
+    void readFilter(const boost::property_tree::ptree& params);
     
     void validateType(const std::string& type);
     void validateGravity(const std::string& gravity);
+    void validateFilter(const std::string& filter);
+    void validatePreFilterMode(const std::string& preFilterMode);
     void validateWatermarkUrl(const std::string& watermarkUrl);
     void validateWatermarkType(const std::string& watermarkType);
     void validateOutputUrl(const std::string& outputUrl);
     void validateWatermarkAmount(float watermarkAmount);
     void validateWatermarkMinMax(float watermarkMin, float watermarkMax);
+    void validateWatermarkGravity(const std::string& watermarkGravity);
+    void validateWatermarkScale(float watermarkScale);
     void validateQuality(unsigned quality);
     void validateSharpenAmount(unsigned sharpenAmount);
     void validateSharpenRadius(float sharpenRadius);
+    void validateSharpenThreshold(unsigned sharpenThreshold);
     
-    void applyWatermark();
+    void resample(const cv::Mat& source);
+    void finishImage(bool sharpen);
+    cv::Point getWatermarkOrigin(const cv::Size& watermarkSize) const;
 
     int mType;
     unsigned mHeight;
@@ -159,15 +209,30 @@ class Resize : public Operation
     unsigned mQuality;
     unsigned mGravity;
     bool mPreFilter;
+    int mPreFilterMode;
+
+    // Shares pre-filtered sources with other resizes, may be null
+    PreFilterCache* mpPreFilterCache;
+    int mFilter;
+
+    // Filter in linear light (opt-in, two to four times slower on large
+    // reductions, see Resampler::resizeLinearLight())
+    bool mLinearLight;
     bool mPassThroughFullSize;
     unsigned mSharpenAmount;
     float mSharpenRadius;
+    unsigned mSharpenThreshold;
     bool mPreserveMeta;
     std::string mWatermarkFile;
     unsigned mWatermarkType;
     double mWatermarkAmount;
     double mWatermarkMin;
     double mWatermarkMax;
+    int mWatermarkGravity;
+
+    // Watermark width as a fraction of the output width, 0 for its own size
+    double mWatermarkScale;
+    unsigned mWatermarkMargin;
     std::string mOutputFile;
 
     cv::Mat mImageResized;
@@ -176,6 +241,16 @@ class Resize : public Operation
     cv::Size mSize;
     cv::Mat mImageToResize;
 
+    // The part of the full resolution source mImageResized was resized from
+    cv::Rect mCropRegion;
+
+    // mImageResized is the source of other resizes and must not be modified
+    bool mKeepIntermediate;
+
+    // Index of the operation whose intermediate this was resized from, -1 if
+    // resized from the decoded source
+    int mDerivedFrom;
+
     int mStatus;
     std::string mErrorMessage;
 
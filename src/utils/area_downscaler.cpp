@@ -0,0 +1,251 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/area_downscaler.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Target scale factors must be <= 1 in both directions
+//------------------------------------------------------------------------------
+AreaDownscaler::AreaDownscaler(const cv::Rect& sourceRegion,
+                               const cv::Size& sourceSize,
+                               const cv::Size& targetSize,
+                               int channels,
+                               cv::Mat& image) :
+  mSourceRegion(sourceRegion),
+  mTargetRegion(mapRegion(sourceRegion, sourceSize, targetSize)),
+  mYScale((double)targetSize.height / (double)sourceSize.height),
+  mChannels(channels),
+  mTaps(),
+  mColumnWeights(mTargetRegion.width, 0.0f),
+  mRow(mTargetRegion.width * channels, 0.0f),
+  mCurrent(mTargetRegion.width * channels, 0.0f),
+  mNext(mTargetRegion.width * channels, 0.0f),
+  mCurrentWeight(0.0f),
+  mNextWeight(0.0f),
+  mSourceRow(0),
+  mTargetRow(0),
+  mImage()
+{
+  image.create(mTargetRegion.height, mTargetRegion.width, CV_8UC(channels));
+
+  // Shares the buffer of the caller's image
+  mImage = image;
+
+  const double xScale = (double)targetSize.width / (double)sourceSize.width;
+
+  // Each source column [x, x + 1) lands on [x * xScale, (x + 1) * xScale) in
+  // the target, which overlaps at most two target columns
+  for (int x = 0; x < mSourceRegion.width; ++x)
+  {
+    const double start = (mSourceRegion.x + x) * xScale;
+    const double end = (mSourceRegion.x + x + 1) * xScale;
+
+    for (int tx = (int)floor(start); tx < end; ++tx)
+    {
+      const double overlap = min(end, (double)(tx + 1)) - max(start, (double)tx);
+      const int target = tx - mTargetRegion.x;
+
+      if ((overlap <= 0.0) || (target < 0) || (target >= mTargetRegion.width))
+      {
+        continue;
+      }
+
+      Tap tap;
+      tap.source = x;
+      tap.target = target;
+      tap.weight = (float)overlap;
+
+      mTaps.push_back(tap);
+      mColumnWeights[target] += tap.weight;
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// The region of an image of targetSize that covers sourceRegion of an image of
+// sourceSize (rounded outwards)
+//------------------------------------------------------------------------------
+cv::Rect AreaDownscaler::mapRegion(const cv::Rect& sourceRegion,
+                                   const cv::Size& sourceSize,
+                                   const cv::Size& targetSize)
+{
+  const double xScale = (double)targetSize.width / (double)sourceSize.width;
+  const double yScale = (double)targetSize.height / (double)sourceSize.height;
+
+  const int x0 = (int)floor(sourceRegion.x * xScale);
+  const int y0 = (int)floor(sourceRegion.y * yScale);
+  const int x1 = (int)ceil((sourceRegion.x + sourceRegion.width) * xScale - 1e-9);
+  const int y1 = (int)ceil((sourceRegion.y + sourceRegion.height) * yScale - 1e-9);
+
+  return cv::Rect(x0, y0, x1 - x0, y1 - y0) &
+         cv::Rect(0, 0, targetSize.width, targetSize.height);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+cv::Rect AreaDownscaler::getTargetRegion() const
+{
+  return mTargetRegion;
+}
+
+//------------------------------------------------------------------------------
+// Add the next source row (mSourceRegion.width pixels of mChannels each)
+//------------------------------------------------------------------------------
+void AreaDownscaler::pushRow(const unsigned char* row)
+{
+  if (mSourceRow >= mSourceRegion.height)
+  {
+    return;
+  }
+
+  //--------------------------------
+  //  Horizontal pass
+  //--------------------------------
+  fill(mRow.begin(), mRow.end(), 0.0f);
+
+  if (mChannels == 1)
+  {
+    for (vector<Tap>::const_iterator tap = mTaps.begin(); tap != mTaps.end(); ++tap)
+    {
+      mRow[tap->target] += tap->weight * row[tap->source];
+    }
+  }
+  else if (mChannels == 3)
+  {
+    for (vector<Tap>::const_iterator tap = mTaps.begin(); tap != mTaps.end(); ++tap)
+    {
+      const unsigned char* s = row + 3*tap->source;
+      float* d = &mRow[3*tap->target];
+
+      d[0] += tap->weight * s[0];
+      d[1] += tap->weight * s[1];
+      d[2] += tap->weight * s[2];
+    }
+  }
+  else
+  {
+    for (vector<Tap>::const_iterator tap = mTaps.begin(); tap != mTaps.end(); ++tap)
+    {
+      const unsigned char* s = row + mChannels*tap->source;
+      float* d = &mRow[mChannels*tap->target];
+
+      for (int c = 0; c < mChannels; ++c)
+      {
+        d[c] += tap->weight * s[c];
+      }
+    }
+  }
+
+  //--------------------------------
+  //  Vertical pass
+  //--------------------------------
+  const double start = (mSourceRegion.y + mSourceRow) * mYScale;
+  const double end = (mSourceRegion.y + mSourceRow + 1) * mYScale;
+
+  for (int ty = (int)floor(start); ty < end; ++ty)
+  {
+    const float overlap = (float)(min(end, (double)(ty + 1)) - max(start, (double)ty));
+    const int target = ty - mTargetRegion.y;
+
+    if ((overlap <= 0.0f) || (target < mTargetRow))
+    {
+      continue;
+    }
+
+    vector<float>& accumulator = (target == mTargetRow) ? mCurrent : mNext;
+    float& weight = (target == mTargetRow) ? mCurrentWeight : mNextWeight;
+
+    for (size_t i = 0; i < mRow.size(); ++i)
+    {
+      accumulator[i] += overlap * mRow[i];
+    }
+
+    weight += overlap;
+  }
+
+  ++mSourceRow;
+
+  // The current target row is complete once a source row reaches its end
+  if (end >= (mTargetRegion.y + mTargetRow + 1) - 1e-9)
+  {
+    emitRow();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Write out any partially covered rows left at the bottom of the region
+//------------------------------------------------------------------------------
+void AreaDownscaler::finish()
+{
+  while (mTargetRow < mTargetRegion.height)
+  {
+    emitRow();
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void AreaDownscaler::emitRow()
+{
+  if (mTargetRow >= mTargetRegion.height)
+  {
+    return;
+  }
+
+  unsigned char* d = mImage.ptr(mTargetRow);
+
+  for (int x = 0; x < mTargetRegion.width; ++x)
+  {
+    const float weight = mCurrentWeight * mColumnWeights[x];
+    const float scale = (weight > 0.0f) ? (1.0f / weight) : 0.0f;
+
+    for (int c = 0; c < mChannels; ++c)
+    {
+      d[mChannels*x + c] = cv::saturate_cast<unsigned char>(mCurrent[mChannels*x + c] * scale);
+    }
+  }
+
+  mCurrent.swap(mNext);
+  mCurrentWeight = mNextWeight;
+
+  fill(mNext.begin(), mNext.end(), 0.0f);
+  mNextWeight = 0.0f;
+
+  ++mTargetRow;
+}
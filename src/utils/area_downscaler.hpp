@@ -0,0 +1,112 @@
+#ifndef AREA_DOWNSCALER_HPP
+#define AREA_DOWNSCALER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+//------------------------------------------------------------------------------
+// Incremental area (box) downscaler for 8-bit rows of 1 to 4 channels. Source
+// rows are pushed one at a time as they are decoded and finished target rows
+// are written out as soon as every source row covering them has been seen.
+// Only two target rows of accumulators are kept, so a full resolution source
+// never has to be held in memory.
+//
+// The source is a region of an image of sourceSize, the target covers the
+// matching region of the same image scaled to targetSize (see
+// getTargetRegion()) and is written into the given image, which keeps its
+// buffer if it already has the right size and type. Target pixels on the edge
+// of the region are averaged over the source pixels that are available.
+//------------------------------------------------------------------------------
+class AreaDownscaler : boost::noncopyable
+{
+  public:
+
+    AreaDownscaler(const cv::Rect& sourceRegion,
+                   const cv::Size& sourceSize,
+                   const cv::Size& targetSize,
+                   int channels,
+                   cv::Mat& image);
+
+    static cv::Rect mapRegion(const cv::Rect& sourceRegion,
+                              const cv::Size& sourceSize,
+                              const cv::Size& targetSize);
+
+    cv::Rect getTargetRegion() const;
+    void pushRow(const unsigned char* row);
+    void finish();
+
+  private:
+
+    struct Tap
+    {
+      int source;
+      int target;
+      float weight;
+    };
+
+    void emitRow();
+
+    cv::Rect mSourceRegion;
+    cv::Rect mTargetRegion;
+    double mYScale;
+    int mChannels;
+
+    // Horizontal filter taps (source column -> target column) and the total
+    // weight each target column receives
+    std::vector<Tap> mTaps;
+    std::vector<float> mColumnWeights;
+
+    // Accumulators for the current and the next target row
+    std::vector<float> mRow;
+    std::vector<float> mCurrent;
+    std::vector<float> mNext;
+    float mCurrentWeight;
+    float mNextWeight;
+
+    int mSourceRow;
+    int mTargetRow;
+
+    cv::Mat mImage;
+
+};
+
+#endif // AREA_DOWNSCALER_HPP
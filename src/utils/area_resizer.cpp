@@ -0,0 +1,326 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/area_resizer.hpp"
+#include "utils/resampler.hpp"
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+// OpenCV
+#include <opencv2/imgproc.hpp>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AREA_RESIZER_NEON 1
+#endif
+
+using namespace std;
+
+// Box sums are kept in 16 bits, which holds up to 257 pixels
+static const int MAX_FACTOR = 16;
+
+// Source row elements reduced at a time
+static const int RUN_LENGTH = 4096;
+
+//------------------------------------------------------------------------------
+// sums[i] = rows[0][i] + ... + rows[count - 1][i]
+//------------------------------------------------------------------------------
+static void sumRows(const unsigned char* const* rows, int count, int length, unsigned short* sums)
+{
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; i + 16 <= length; i += 16)
+  {
+    __m128i lo = zero;
+    __m128i hi = zero;
+
+    for (int k = 0; k < count; ++k)
+    {
+      const __m128i pixels = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+
+      lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(pixels, zero));
+      hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(pixels, zero));
+    }
+
+    _mm_storeu_si128((__m128i*)(sums + i), lo);
+    _mm_storeu_si128((__m128i*)(sums + i + 8), hi);
+  }
+#elif defined(AREA_RESIZER_NEON)
+  for (; i + 16 <= length; i += 16)
+  {
+    uint16x8_t lo = vdupq_n_u16(0);
+    uint16x8_t hi = lo;
+
+    for (int k = 0; k < count; ++k)
+    {
+      const uint8x16_t pixels = vld1q_u8(rows[k] + i);
+
+      lo = vaddw_u8(lo, vget_low_u8(pixels));
+      hi = vaddw_u8(hi, vget_high_u8(pixels));
+    }
+
+    vst1q_u16(sums + i, lo);
+    vst1q_u16(sums + i + 8, hi);
+  }
+#endif
+
+  for (; i < length; ++i)
+  {
+    unsigned short sum = 0;
+
+    for (int k = 0; k < count; ++k)
+    {
+      sum += rows[k][i];
+    }
+
+    sums[i] = sum;
+  }
+}
+
+//------------------------------------------------------------------------------
+// windows[i] = sums[i] + sums[i + step] + ... + sums[i + (count - 1) * step],
+// the sum of count pixels from element i on for step channels
+//------------------------------------------------------------------------------
+static void sumWindows(const unsigned short* sums, int count, int step, int length, unsigned short* windows)
+{
+  int i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 8 <= length; i += 8)
+  {
+    __m128i sum = _mm_loadu_si128((const __m128i*)(sums + i));
+
+    for (int k = 1; k < count; ++k)
+    {
+      sum = _mm_add_epi16(sum, _mm_loadu_si128((const __m128i*)(sums + i + k * step)));
+    }
+
+    _mm_storeu_si128((__m128i*)(windows + i), sum);
+  }
+#elif defined(AREA_RESIZER_NEON)
+  for (; i + 8 <= length; i += 8)
+  {
+    uint16x8_t sum = vld1q_u16(sums + i);
+
+    for (int k = 1; k < count; ++k)
+    {
+      sum = vaddq_u16(sum, vld1q_u16(sums + i + k * step));
+    }
+
+    vst1q_u16(windows + i, sum);
+  }
+#endif
+
+  for (; i < length; ++i)
+  {
+    unsigned short sum = 0;
+
+    for (int k = 0; k < count; ++k)
+    {
+      sum += sums[i + k * step];
+    }
+
+    windows[i] = sum;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Reduces bands of target rows
+//------------------------------------------------------------------------------
+class AreaResizer::ReduceBody : public cv::ParallelLoopBody
+{
+  public:
+
+    ReduceBody(const cv::Mat& source, cv::Mat& target, int xFactor, int yFactor) :
+      mSource(source),
+      mTarget(target),
+      mXFactor(xFactor),
+      mYFactor(yFactor)
+    {
+    }
+
+    //--------------------------------------------------------------------------
+    // Rows are reduced in runs of boxes that keep the sums in L1
+    //--------------------------------------------------------------------------
+    virtual void operator()(const cv::Range& range) const
+    {
+      const int channels = mSource.channels();
+      const int boxStep = mXFactor * channels;
+      const int runBoxes = max(1, RUN_LENGTH / boxStep);
+
+      // Rounded 16 bit reciprocal of the box area
+      const unsigned area = mXFactor * mYFactor;
+      const unsigned reciprocal = (65536 + area / 2) / area;
+
+      vector<const unsigned char*> rows(mYFactor);
+      vector<unsigned short> sums(runBoxes * boxStep);
+      vector<unsigned short> windows(runBoxes * boxStep);
+
+      for (int y = range.start; y < range.end; ++y)
+      {
+        unsigned char* target = mTarget.ptr(y);
+
+        for (int x0 = 0; x0 < mTarget.cols; x0 += runBoxes)
+        {
+          const int boxes = min(runBoxes, mTarget.cols - x0);
+
+          for (int k = 0; k < mYFactor; ++k)
+          {
+            rows[k] = mSource.ptr(y * mYFactor + k) + x0 * boxStep;
+          }
+
+          sumRows(&rows[0], mYFactor, boxes * boxStep, &sums[0]);
+
+          // Windows are needed up to the start of the last box
+          sumWindows(&sums[0], mXFactor, channels, boxes * boxStep - (mXFactor - 1) * channels, &windows[0]);
+
+          const unsigned short* window = &windows[0];
+          unsigned char* pixel = target + x0 * channels;
+
+          for (int x = 0; x < boxes; ++x, window += boxStep, pixel += channels)
+          {
+            for (int c = 0; c < channels; ++c)
+            {
+              pixel[c] = (unsigned char)((window[c] * reciprocal + 32768) >> 16);
+            }
+          }
+        }
+      }
+    }
+
+  private:
+
+    const cv::Mat& mSource;
+    cv::Mat& mTarget;
+    int mXFactor;
+    int mYFactor;
+
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+AreaResizer::AreaResizer(const cv::Size& sourceSize, const cv::Size& targetSize) :
+  mSourceSize(sourceSize),
+  mTargetSize(targetSize),
+  mXFactor(1),
+  mYFactor(1)
+{
+  if (!targetSize.area())
+  {
+    return;
+  }
+
+  // OpenCV handles whole number reductions with a fast path of its own
+  if ((sourceSize.width % targetSize.width == 0) && (sourceSize.height % targetSize.height == 0))
+  {
+    return;
+  }
+
+  mXFactor = getFactor(sourceSize.width, targetSize.width);
+  mYFactor = getFactor(sourceSize.height, targetSize.height);
+}
+
+//------------------------------------------------------------------------------
+// The largest box size that divides the source length evenly and leaves at
+// least AREA_RESIZER_MIN_RESIDUAL_SCALE times the target length. Boxes that do
+// not tile the source exactly would shift the result.
+//------------------------------------------------------------------------------
+int AreaResizer::getFactor(int sourceLength, int targetLength)
+{
+  const double scale = (double)sourceLength / (double)targetLength;
+
+  int factor = min(MAX_FACTOR, (int)floor(scale / AREA_RESIZER_MIN_RESIDUAL_SCALE));
+
+  while ((factor > 1) && (sourceLength % factor))
+  {
+    --factor;
+  }
+
+  return max(1, factor);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool AreaResizer::getTwoStage() const
+{
+  return (mXFactor > 1) || (mYFactor > 1);
+}
+
+//------------------------------------------------------------------------------
+// Size after the first stage, the source size for a direct resize
+//------------------------------------------------------------------------------
+cv::Size AreaResizer::getReducedSize() const
+{
+  return cv::Size(mSourceSize.width / mXFactor, mSourceSize.height / mYFactor);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void AreaResizer::resize(const cv::Mat& source, cv::Mat& target) const
+{
+  if (!getTwoStage() || !Resampler::canResample(source))
+  {
+    cv::resize(source, target, mTargetSize, 0, 0, cv::INTER_AREA);
+    return;
+  }
+
+  cv::Mat reduced;
+
+  reduce(source, reduced);
+
+  Resampler resampler(reduced.size(), mTargetSize, ResamplerFilterArea);
+
+  resampler.resize(reduced, target);
+}
+
+//------------------------------------------------------------------------------
+// Average mXFactor x mYFactor boxes of source into target
+//------------------------------------------------------------------------------
+void AreaResizer::reduce(const cv::Mat& source, cv::Mat& target) const
+{
+  target.create(getReducedSize(), source.type());
+
+  ReduceBody body(source, target, mXFactor, mYFactor);
+
+  cv::parallel_for_(cv::Range(0, target.rows), body);
+}
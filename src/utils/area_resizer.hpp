@@ -0,0 +1,93 @@
+#ifndef AREA_RESIZER_HPP
+#define AREA_RESIZER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// The integer box reduction stops while the image is still at least this many
+// times the target size, the rest is an exact area resample. Smaller values
+// are faster but further from a direct area resize: at 2 the result is 45dB
+// PSNR or more from an exact area resize, see the area_resize benchmark.
+// This can be overridden at build time
+#ifndef AREA_RESIZER_MIN_RESIDUAL_SCALE
+#define AREA_RESIZER_MIN_RESIDUAL_SCALE 2.0
+#endif
+
+//------------------------------------------------------------------------------
+// Area (INTER_AREA) downscaling of 8-bit images of 1 to 4 channels. Large
+// non-integer reductions are done in two stages: a box reduction by integer
+// factors (SSE2/NEON sums of whole source rows) to a few times the target
+// size, followed by a short area resample of that (see Resampler). Anything
+// else, including integer reductions OpenCV already has a fast path for, goes
+// straight to cv::resize().
+//
+// Resize only uses getTwoStage() to pick the reductions it hands to the
+// single-pass area resampler, which is faster still. The two-stage resize is
+// kept for comparison in the area_resize benchmark.
+//------------------------------------------------------------------------------
+class AreaResizer : boost::noncopyable
+{
+  public:
+
+    AreaResizer(const cv::Size& sourceSize, const cv::Size& targetSize);
+
+    bool getTwoStage() const;
+    cv::Size getReducedSize() const;
+
+    void resize(const cv::Mat& source, cv::Mat& target) const;
+
+  private:
+
+    class ReduceBody;
+
+    static int getFactor(int sourceLength, int targetLength);
+
+    void reduce(const cv::Mat& source, cv::Mat& target) const;
+
+    cv::Size mSourceSize;
+    cv::Size mTargetSize;
+
+    // Box size of the first stage, 1 x 1 for a direct resize
+    int mXFactor;
+    int mYFactor;
+
+};
+
+#endif // AREA_RESIZER_HPP
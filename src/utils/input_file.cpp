@@ -0,0 +1,205 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/input_file.hpp"
+
+#include <cerrno>
+
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Size of each read() when the input cannot be mapped
+#define INPUT_FILE_READ_CHUNK (1 << 20)
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+InputFile::InputFile() :
+    mpData(0),
+    mSize(0),
+    mMapped(false),
+    mBuffer()
+{
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+InputFile::~InputFile()
+{
+  close();
+}
+
+//------------------------------------------------------------------------------
+// Open and map (or read) the file at the given path. Returns false if the file
+// could not be read or is empty.
+//------------------------------------------------------------------------------
+bool InputFile::open(const string& path)
+{
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  struct stat info;
+
+  bool success = false;
+
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+  {
+    success = map(fd, (size_t)info.st_size);
+  }
+
+  if (!success)
+  {
+    success = read(fd);
+  }
+
+  ::close(fd);
+
+  return success;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void InputFile::close()
+{
+  if (mMapped)
+  {
+    munmap((void*)mpData, mSize);
+  }
+
+  mpData = 0;
+  mSize = 0;
+  mMapped = false;
+  
+  // Release the memory rather than just clearing
+  vector<unsigned char>().swap(mBuffer);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+const unsigned char* InputFile::getData() const
+{
+  return mpData;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+size_t InputFile::getSize() const
+{
+  return mSize;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool InputFile::empty() const
+{
+  return (mSize == 0);
+}
+
+//------------------------------------------------------------------------------
+// Map the whole file read-only. The data is consumed front to back (header,
+// metadata, then entropy coded data) so ask the kernel for aggressive
+// read-ahead.
+//------------------------------------------------------------------------------
+bool InputFile::map(int fd, size_t size)
+{
+  void* data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (data == MAP_FAILED)
+  {
+    return false;
+  }
+
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  mpData = (const unsigned char*)data;
+  mSize = size;
+  mMapped = true;
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Fallback for inputs that cannot be mapped
+//------------------------------------------------------------------------------
+bool InputFile::read(int fd)
+{
+  size_t length = 0;
+
+  while (true)
+  {
+    mBuffer.resize(length + INPUT_FILE_READ_CHUNK);
+
+    ssize_t count = ::read(fd, &mBuffer[length], INPUT_FILE_READ_CHUNK);
+
+    if (count < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      close();
+      return false;
+    }
+
+    if (count == 0)
+    {
+      break;
+    }
+
+    length += (size_t)count;
+  }
+
+  mBuffer.resize(length);
+
+  if (mBuffer.empty())
+  {
+    return false;
+  }
+
+  mpData = &mBuffer.front();
+  mSize = length;
+
+  return true;
+}
@@ -0,0 +1,79 @@
+#ifndef INPUT_FILE_HPP
+#define INPUT_FILE_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+//------------------------------------------------------------------------------
+// Read-only view of an input file. Regular files are memory mapped once and
+// the same bytes are handed to Exiv2, the decoder and operations that need the
+// original data (e.g. copy). Anything that cannot be mapped (pipes, special
+// files) is read into a buffer instead.
+//------------------------------------------------------------------------------
+class InputFile : boost::noncopyable
+{
+  public:
+
+    InputFile();
+    ~InputFile();
+
+    bool open(const std::string& path);
+    void close();
+
+    const unsigned char* getData() const;
+    size_t getSize() const;
+    bool empty() const;
+
+  private:
+
+    bool map(int fd, size_t size);
+    bool read(int fd);
+
+    const unsigned char* mpData;
+    size_t mSize;
+
+    // True if mpData points at a mapping rather than into mBuffer
+    bool mMapped;
+    std::vector<unsigned char> mBuffer;
+
+};
+
+#endif // INPUT_FILE_HPP
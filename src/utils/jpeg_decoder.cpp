@@ -0,0 +1,938 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/jpeg_decoder.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+// Number of scanlines handed to libjpeg per read call
+#define JPEG_DECODER_ROWS_PER_READ 16
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+JpegDecoder::JpegDecoder() :
+  mHeaderRead(false),
+  mpData(0),
+  mDataSize(0),
+  mMinimumScale(1.0),
+  mFast(false),
+  mRegion(),
+  mOutputSize(),
+  mOutputRegion(),
+  mStreamingThreshold(0),
+  mDownscaler(),
+  mBand(),
+  mpThreadPool(0),
+  mThreadCount(0),
+  mLayout(),
+  mMcuHeight(0),
+  mMcusPerRow(0),
+  mMcuRows(0),
+  mScaleNum(0),
+  mBandRegion()
+{
+  mInfo.err = jpeg_std_error(&mError.pub);
+  mError.pub.error_exit = errorExit;
+  mError.pub.output_message = outputMessage;
+
+  jpeg_create_decompress(&mInfo);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+JpegDecoder::~JpegDecoder()
+{
+  jpeg_destroy_decompress(&mInfo);
+}
+
+//------------------------------------------------------------------------------
+// libjpeg calls exit() on fatal errors by default, so jump back to the
+// decoder method that made the failing call instead
+//------------------------------------------------------------------------------
+void JpegDecoder::errorExit(j_common_ptr cinfo)
+{
+  ErrorManager* error = (ErrorManager*)cinfo->err;
+
+  longjmp(error->setjmpBuffer, 1);
+}
+
+//------------------------------------------------------------------------------
+// Swallow warnings (e.g. corrupt data) rather than writing them to stderr
+//------------------------------------------------------------------------------
+void JpegDecoder::outputMessage(j_common_ptr cinfo)
+{
+}
+
+//------------------------------------------------------------------------------
+// Check for the SOI marker followed by the start of another marker
+//------------------------------------------------------------------------------
+bool JpegDecoder::isJpeg(const unsigned char* data, size_t size)
+{
+  return (size > 3) && (data[0] == 0xFF) && (data[1] == 0xD8) && (data[2] == 0xFF);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static unsigned readExif16(const unsigned char* p, bool littleEndian)
+{
+  return littleEndian ? (p[0] | (p[1] << 8)) : ((p[0] << 8) | p[1]);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static size_t readExif32(const unsigned char* p, bool littleEndian)
+{
+  return littleEndian ? (readExif16(p, true) | ((size_t)readExif16(p + 2, true) << 16)) :
+                        (((size_t)readExif16(p, false) << 16) | readExif16(p + 2, false));
+}
+
+//------------------------------------------------------------------------------
+// Read the orientation tag from IFD0 of the EXIF APP1 segment without parsing
+// any other metadata. Returns 1 if there is no EXIF data or no orientation tag
+// and 0 if the data could not be read.
+//------------------------------------------------------------------------------
+int JpegDecoder::readExifOrientation(const unsigned char* data, size_t size)
+{
+  if (!isJpeg(data, size))
+  {
+    return 0;
+  }
+
+  size_t position = 2;
+
+  while (position + 4 <= size)
+  {
+    if (data[position] != 0xFF)
+    {
+      return 0;
+    }
+
+    const unsigned char marker = data[position + 1];
+
+    // Fill byte
+    if (marker == 0xFF)
+    {
+      position++;
+      continue;
+    }
+
+    // Metadata segments all come before the scan
+    if ((marker == 0xDA) || (marker == 0xD9))
+    {
+      return 1;
+    }
+
+    const size_t length = (data[position + 2] << 8) | data[position + 3];
+    const unsigned char* segment = data + position + 4;
+
+    if (position + 2 + length > size)
+    {
+      return 0;
+    }
+
+    if ((marker == 0xE1) && (length >= 2 + 6 + 8) && !memcmp(segment, "Exif\0\0", 6))
+    {
+      const unsigned char* tiff = segment + 6;
+      const size_t tiffSize = length - 2 - 6;
+
+      bool littleEndian;
+
+      if ((tiff[0] == 'I') && (tiff[1] == 'I'))
+      {
+        littleEndian = true;
+      }
+      else if ((tiff[0] == 'M') && (tiff[1] == 'M'))
+      {
+        littleEndian = false;
+      }
+      else
+      {
+        return 0;
+      }
+
+      const size_t ifd = readExif32(tiff + 4, littleEndian);
+
+      if ((ifd < 8) || (ifd + 2 > tiffSize))
+      {
+        return 0;
+      }
+
+      const unsigned entryCount = readExif16(tiff + ifd, littleEndian);
+
+      if (ifd + 2 + entryCount * 12 > tiffSize)
+      {
+        return 0;
+      }
+
+      for (unsigned i = 0; i < entryCount; ++i)
+      {
+        const unsigned char* entry = tiff + ifd + 2 + i * 12;
+
+        // Orientation is a single SHORT stored in the value field
+        if (readExif16(entry, littleEndian) == 0x0112)
+        {
+          return readExif16(entry + 8, littleEndian);
+        }
+      }
+
+      return 1;
+    }
+
+    position += 2 + length;
+  }
+
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool JpegDecoder::readHeader(const unsigned char* data, size_t size)
+{
+  mHeaderRead = false;
+  mSize = cv::Size();
+  mOutputSize = cv::Size();
+  mOutputRegion = cv::Rect();
+
+  if (!isJpeg(data, size))
+  {
+    return false;
+  }
+
+  if (setjmp(mError.setjmpBuffer))
+  {
+    jpeg_abort_decompress(&mInfo);
+    return false;
+  }
+
+  mpData = data;
+  mDataSize = size;
+
+  jpeg_mem_src(&mInfo, (unsigned char*)data, (unsigned long)size);
+
+  if (jpeg_read_header(&mInfo, TRUE) != JPEG_HEADER_OK)
+  {
+    jpeg_abort_decompress(&mInfo);
+    return false;
+  }
+
+  mSize = cv::Size(mInfo.image_width, mInfo.image_height);
+  mHeaderRead = true;
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// The smallest fraction of the full resolution the caller can work with. The
+// decoder picks the smallest DCT scale factor that yields at least this size.
+//------------------------------------------------------------------------------
+void JpegDecoder::setMinimumScale(double minimumScale)
+{
+  mMinimumScale = min(max(minimumScale, 0.0), 1.0);
+}
+
+//------------------------------------------------------------------------------
+// Only decode the given region (in full resolution pixels). The decoded area
+// is rounded out to whole iMCUs horizontally, see getOutputRegion().
+//------------------------------------------------------------------------------
+void JpegDecoder::setRegion(const cv::Rect& region)
+{
+  mRegion = region;
+}
+
+//------------------------------------------------------------------------------
+// If the decoded pixels (after DCT scaling and cropping) would exceed this
+// count, scanlines are decoded in bands and downscaled on the fly to exactly
+// the minimum scale instead of being stored. 0 disables streaming.
+//------------------------------------------------------------------------------
+void JpegDecoder::setStreamingThreshold(size_t pixels)
+{
+  mStreamingThreshold = pixels;
+}
+
+//------------------------------------------------------------------------------
+// Fast mode uses the fast integer IDCT and plain (box) chroma upsampling and
+// skips block smoothing of progressive scans. This is noticeably faster with
+// only minor artifacts, most of which a downscale hides anyway.
+//------------------------------------------------------------------------------
+void JpegDecoder::setFast(bool fast)
+{
+  mFast = fast;
+}
+
+//------------------------------------------------------------------------------
+// Large baseline JPEGs with restart markers are decoded in bands on this pool,
+// using at most threadCount of its threads
+//------------------------------------------------------------------------------
+void JpegDecoder::setThreadPool(ThreadPool* threadPool, unsigned threadCount)
+{
+  mpThreadPool = threadPool;
+  mThreadCount = min(threadCount, threadPool ? threadPool->getThreadCount() : 0u);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+cv::Size JpegDecoder::getSize() const
+{
+  return mSize;
+}
+
+//------------------------------------------------------------------------------
+// Returns the dimensions of the whole image at the current scale. If a region
+// was set, decode() only produces part of this (see getOutputRegion()).
+//------------------------------------------------------------------------------
+cv::Size JpegDecoder::getOutputSize()
+{
+  if (!mHeaderRead)
+  {
+    // Either nothing was read or decode() already ran
+    return mOutputSize;
+  }
+
+  if (setjmp(mError.setjmpBuffer))
+  {
+    return cv::Size();
+  }
+
+  computeScale();
+
+  return mOutputSize;
+}
+
+//------------------------------------------------------------------------------
+// The region of the scaled image (see getOutputSize()) that the last call to
+// decode() produced
+//------------------------------------------------------------------------------
+cv::Rect JpegDecoder::getOutputRegion() const
+{
+  return mOutputRegion;
+}
+
+//------------------------------------------------------------------------------
+// CMYK and YCCK data is left to OpenCV
+//------------------------------------------------------------------------------
+bool JpegDecoder::canDecode() const
+{
+  return (mInfo.jpeg_color_space == JCS_GRAYSCALE) ||
+         (mInfo.jpeg_color_space == JCS_YCbCr) ||
+         (mInfo.jpeg_color_space == JCS_RGB);
+}
+
+//------------------------------------------------------------------------------
+// Set the output color space and pick the smallest scale_num/8 that keeps both
+// output dimensions at or above the minimum scale. Must be called with the
+// error handler armed.
+//------------------------------------------------------------------------------
+void JpegDecoder::computeScale()
+{
+  if (mInfo.jpeg_color_space == JCS_GRAYSCALE)
+  {
+    mInfo.out_color_space = JCS_GRAYSCALE;
+  }
+  else
+  {
+#ifdef JCS_EXTENSIONS
+    // libjpeg-turbo can write OpenCV's channel order directly
+    mInfo.out_color_space = JCS_EXT_BGR;
+#else
+    mInfo.out_color_space = JCS_RGB;
+#endif
+  }
+
+  if (mFast)
+  {
+    mInfo.dct_method = JDCT_IFAST;
+    mInfo.do_fancy_upsampling = FALSE;
+    mInfo.do_block_smoothing = FALSE;
+  }
+  else
+  {
+    mInfo.dct_method = JDCT_ISLOW;
+    mInfo.do_fancy_upsampling = TRUE;
+    mInfo.do_block_smoothing = TRUE;
+  }
+
+  if (mScaleNum)
+  {
+    mInfo.scale_num = mScaleNum;
+    mInfo.scale_denom = 8;
+
+    jpeg_calc_output_dimensions(&mInfo);
+
+    mOutputSize = cv::Size(mInfo.output_width, mInfo.output_height);
+
+    return;
+  }
+
+  const unsigned minimumWidth  = (unsigned)ceil(mInfo.image_width * mMinimumScale - 1e-6);
+  const unsigned minimumHeight = (unsigned)ceil(mInfo.image_height * mMinimumScale - 1e-6);
+
+  // libjpeg-turbo supports every scale_num from 1 to 16 over a denominator of 8,
+  // older libjpeg versions round up to the nearest of 1/8, 1/4, 1/2 and 1/1
+  for (unsigned scaleNum = 1; scaleNum <= 8; ++scaleNum)
+  {
+    mInfo.scale_num = scaleNum;
+    mInfo.scale_denom = 8;
+
+    jpeg_calc_output_dimensions(&mInfo);
+
+    if ((mInfo.output_width >= minimumWidth) && (mInfo.output_height >= minimumHeight))
+    {
+      break;
+    }
+  }
+
+  mOutputSize = cv::Size(mInfo.output_width, mInfo.output_height);
+}
+
+//------------------------------------------------------------------------------
+// Map the requested full resolution region onto the scaled output, rounding
+// outwards so every requested source pixel is covered
+//------------------------------------------------------------------------------
+cv::Rect JpegDecoder::computeOutputRegion() const
+{
+  const cv::Rect whole(0, 0, mOutputSize.width, mOutputSize.height);
+
+  const cv::Rect region = mRegion & cv::Rect(0, 0, mSize.width, mSize.height);
+
+  if (!region.area())
+  {
+    return whole;
+  }
+
+  const double xf = (double)mOutputSize.width / (double)mSize.width;
+  const double yf = (double)mOutputSize.height / (double)mSize.height;
+
+  const int x0 = (int)floor(region.x * xf);
+  const int y0 = (int)floor(region.y * yf);
+  const int x1 = (int)ceil((region.x + region.width) * xf);
+  const int y1 = (int)ceil((region.y + region.height) * yf);
+
+  return cv::Rect(x0, y0, x1 - x0, y1 - y0) & whole;
+}
+
+//------------------------------------------------------------------------------
+// Size of the whole image when streaming, or an empty size if the decode
+// should be stored as is. DCT scaling only goes down in steps of 1/8, the
+// streaming downscaler covers the rest of the way to the minimum scale.
+//------------------------------------------------------------------------------
+cv::Size JpegDecoder::computeStreamingSize() const
+{
+  if (!mStreamingThreshold || (mMinimumScale <= 0.0) ||
+      ((size_t)mOutputRegion.area() <= mStreamingThreshold))
+  {
+    return cv::Size();
+  }
+
+  const cv::Size size(max(1, (int)ceil(mSize.width * mMinimumScale - 1e-6)),
+                      max(1, (int)ceil(mSize.height * mMinimumScale - 1e-6)));
+
+  if ((size.width >= mOutputSize.width) || (size.height >= mOutputSize.height))
+  {
+    return cv::Size();
+  }
+
+  return size;
+}
+
+//------------------------------------------------------------------------------
+// Decode into an 8-bit image, 1 channel for grayscale JPEGs and 3 channel BGR
+// otherwise (matching cv::IMREAD_UNCHANGED). If a region was set, columns
+// outside of it are never decoded (beyond iMCU rounding) and rows outside of it
+// are skipped without color conversion or upsampling.
+//
+// Scanlines are written straight into the rows of image. If it already has the
+// decoded size and type (e.g. a Mat wrapping a caller provided buffer) no
+// memory is allocated.
+//------------------------------------------------------------------------------
+bool JpegDecoder::decode(cv::Mat& image)
+{
+  if (!mHeaderRead || !canDecode())
+  {
+    return false;
+  }
+
+  mHeaderRead = false;
+
+  if (setjmp(mError.setjmpBuffer))
+  {
+    jpeg_abort_decompress(&mInfo);
+    mDownscaler.reset();
+    mBand.release();
+    image.release();
+    return false;
+  }
+
+  computeScale();
+
+#ifdef JPEG_DECODER_CAN_CROP
+  mOutputRegion = mBandRegion.area() ? mBandRegion : computeOutputRegion();
+#else
+  mOutputRegion = cv::Rect(0, 0, mOutputSize.width, mOutputSize.height);
+#endif
+
+  if (canDecodeInParallel())
+  {
+    return decodeParallel(image);
+  }
+
+  jpeg_start_decompress(&mInfo);
+
+#ifdef JPEG_DECODER_CAN_CROP
+  if (mOutputRegion.width < mOutputSize.width)
+  {
+    JDIMENSION xOffset = mOutputRegion.x;
+    JDIMENSION width = mOutputRegion.width;
+
+    // libjpeg moves the left edge back to an iMCU boundary and widens the
+    // region to match, output_width is updated accordingly
+    jpeg_crop_scanline(&mInfo, &xOffset, &width);
+
+    mOutputRegion.x = xOffset;
+    mOutputRegion.width = width;
+  }
+
+  if (mOutputRegion.y > 0)
+  {
+    jpeg_skip_scanlines(&mInfo, mOutputRegion.y);
+  }
+#endif
+
+  const unsigned firstOutputRow = mOutputRegion.y;
+  const unsigned lastOutputRow = mOutputRegion.y + mOutputRegion.height;
+
+  const cv::Size streamingSize = computeStreamingSize();
+  const int components = mInfo.output_components;
+
+  if (streamingSize.area())
+  {
+    // Only a band of scanlines is ever held at the decoded resolution
+    mDownscaler.reset(new AreaDownscaler(mOutputRegion, mOutputSize, streamingSize, components, image));
+    mBand.create(JPEG_DECODER_ROWS_PER_READ, mOutputRegion.width, CV_8UC(components));
+  }
+  else
+  {
+    image.create(mOutputRegion.height, mOutputRegion.width, CV_8UC(components));
+  }
+
+#ifndef JCS_EXTENSIONS
+  const int width = mOutputRegion.width;
+#endif
+
+  JSAMPROW rows[JPEG_DECODER_ROWS_PER_READ];
+
+  while (mInfo.output_scanline < lastOutputRow)
+  {
+    const unsigned firstRow = mInfo.output_scanline - firstOutputRow;
+    const unsigned rowCount = min((unsigned)JPEG_DECODER_ROWS_PER_READ,
+                                  lastOutputRow - mInfo.output_scanline);
+
+    for (unsigned i = 0; i < rowCount; ++i)
+    {
+      rows[i] = mDownscaler ? mBand.ptr(i) : image.ptr(firstRow + i);
+    }
+
+    const unsigned rowsRead = jpeg_read_scanlines(&mInfo, rows, rowCount);
+
+    for (unsigned i = 0; i < rowsRead; ++i)
+    {
+      unsigned char* p = rows[i];
+
+#ifndef JCS_EXTENSIONS
+      if (components == 3)
+      {
+        for (int x = 0; x < width; ++x)
+        {
+          swap(p[3*x], p[3*x + 2]);
+        }
+      }
+#endif
+
+      if (mDownscaler)
+      {
+        mDownscaler->pushRow(p);
+      }
+    }
+  }
+
+  if (mDownscaler)
+  {
+    mDownscaler->finish();
+
+    mOutputRegion = mDownscaler->getTargetRegion();
+    mOutputSize = streamingSize;
+
+    mDownscaler.reset();
+    mBand.release();
+  }
+
+  if (mInfo.output_scanline < mInfo.output_height)
+  {
+    // Rows below the region are never decoded
+    jpeg_abort_decompress(&mInfo);
+  }
+  else
+  {
+    jpeg_finish_decompress(&mInfo);
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Parallel decoding needs a single interleaved baseline scan with restart
+// markers, and must be worth it. Must be called with the error handler armed
+// and the scale computed.
+//------------------------------------------------------------------------------
+bool JpegDecoder::canDecodeInParallel()
+{
+#ifdef JPEG_DECODER_CAN_CROP
+  if (!mpThreadPool || (mThreadCount < 2) || mBandRegion.area())
+  {
+    return false;
+  }
+
+  if (mInfo.progressive_mode || !mInfo.restart_interval ||
+      (mInfo.comps_in_scan != mInfo.num_components))
+  {
+    return false;
+  }
+
+  if (((size_t)mOutputRegion.area() < JPEG_DECODER_PARALLEL_MIN_PIXELS) ||
+      computeStreamingSize().area())
+  {
+    return false;
+  }
+
+  // A single component scan codes one 8x8 block per MCU
+  const bool interleaved = (mInfo.comps_in_scan > 1);
+  const unsigned mcuWidth = interleaved ? 8 * mInfo.max_h_samp_factor : 8;
+
+  mMcuHeight = interleaved ? 8 * mInfo.max_v_samp_factor : 8;
+  mMcusPerRow = (mInfo.image_width + mcuWidth - 1) / mcuWidth;
+  mMcuRows = (mInfo.image_height + mMcuHeight - 1) / mMcuHeight;
+
+  if (!readLayout(mLayout))
+  {
+    return false;
+  }
+
+  // Every restart interval must be present, otherwise band boundaries can not
+  // be found
+  const size_t mcuCount = (size_t)mMcusPerRow * mMcuRows;
+  const size_t intervalCount = (mcuCount + mInfo.restart_interval - 1) / mInfo.restart_interval;
+
+  return (mLayout.restarts.size() + 1 == intervalCount);
+#else
+  return false;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Walk the marker segments up to the start of scan and then the entropy coded
+// data, recording where every restart marker is
+//------------------------------------------------------------------------------
+bool JpegDecoder::readLayout(StreamLayout& layout) const
+{
+  const unsigned char* data = mpData;
+  const size_t size = mDataSize;
+
+  layout.frameOffset = 0;
+  layout.dataBegin = 0;
+  layout.dataEnd = size;
+  layout.restarts.clear();
+
+  // Skip SOI
+  size_t position = 2;
+
+  while (position + 4 <= size)
+  {
+    if (data[position] != 0xFF)
+    {
+      return false;
+    }
+
+    const unsigned char marker = data[position + 1];
+
+    // Fill byte
+    if (marker == 0xFF)
+    {
+      position++;
+      continue;
+    }
+
+    const size_t length = (data[position + 2] << 8) | data[position + 3];
+
+    // Baseline and extended sequential frames
+    if ((marker == 0xC0) || (marker == 0xC1))
+    {
+      layout.frameOffset = position;
+    }
+
+    if (marker == 0xDA)
+    {
+      layout.dataBegin = position + 2 + length;
+      break;
+    }
+
+    position += 2 + length;
+  }
+
+  if (!layout.frameOffset || !layout.dataBegin || (layout.dataBegin >= size))
+  {
+    return false;
+  }
+
+  for (position = layout.dataBegin; position + 1 < size; ++position)
+  {
+    if (data[position] != 0xFF)
+    {
+      continue;
+    }
+
+    const unsigned char marker = data[position + 1];
+
+    // Stuffed zero byte or fill byte
+    if ((marker == 0x00) || (marker == 0xFF))
+    {
+      continue;
+    }
+
+    if ((marker >= 0xD0) && (marker <= 0xD7))
+    {
+      layout.restarts.push_back(position);
+      position++;
+      continue;
+    }
+
+    // EOI (or anything else) ends the scan
+    layout.dataEnd = position;
+    break;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Split the scan into bands of MCU rows that start on restart boundaries and
+// decode them concurrently, each straight into its rows of the image. Bands
+// that need vertical context for chroma upsampling also decode the group of
+// rows above and below them, but only keep their own rows, so the result is
+// identical to a serial decode.
+//------------------------------------------------------------------------------
+bool JpegDecoder::decodeParallel(cv::Mat& image)
+{
+  // Let libjpeg align the columns exactly as a serial decode would
+  jpeg_start_decompress(&mInfo);
+
+  if (mOutputRegion.width < mOutputSize.width)
+  {
+    JDIMENSION xOffset = mOutputRegion.x;
+    JDIMENSION width = mOutputRegion.width;
+
+    jpeg_crop_scanline(&mInfo, &xOffset, &width);
+
+    mOutputRegion.x = xOffset;
+    mOutputRegion.width = width;
+  }
+
+  jpeg_abort_decompress(&mInfo);
+
+  image.create(mOutputRegion.height, mOutputRegion.width, CV_8UC(mInfo.output_components));
+
+  // Restart boundaries coincide with the start of an MCU row every syncRows
+  unsigned a = mInfo.restart_interval;
+  unsigned b = mMcusPerRow;
+
+  while (b)
+  {
+    const unsigned t = a % b;
+    a = b;
+    b = t;
+  }
+
+  const unsigned syncRows = mInfo.restart_interval / a;
+
+  // Output rows per MCU row at this scale
+  const unsigned rowsPerMcu = mMcuHeight * mInfo.scale_num / 8;
+
+  const unsigned firstOutputRow = mOutputRegion.y;
+  const unsigned lastOutputRow = mOutputRegion.y + mOutputRegion.height;
+
+  const unsigned firstGroup = (firstOutputRow / rowsPerMcu) / syncRows;
+  const unsigned lastGroup = ((lastOutputRow + rowsPerMcu - 1) / rowsPerMcu + syncRows - 1) / syncRows;
+  const unsigned groupCount = lastGroup - firstGroup;
+  const unsigned bandCount = min(groupCount, mThreadCount);
+
+  vector<Band> bands;
+  vector<ThreadPool::Task> tasks;
+
+  // Each band writes a distinct element
+  vector<char> results(bandCount, 0);
+
+  bands.reserve(bandCount);
+
+  for (unsigned i = 0; i < bandCount; ++i)
+  {
+    Band band;
+    band.firstMcuRow = (firstGroup + groupCount * i / bandCount) * syncRows;
+    band.lastMcuRow = min((firstGroup + groupCount * (i + 1) / bandCount) * syncRows, mMcuRows);
+    band.firstOutputRow = max(band.firstMcuRow * rowsPerMcu, firstOutputRow);
+    band.lastOutputRow = min(band.lastMcuRow * rowsPerMcu, lastOutputRow);
+
+    if (band.lastOutputRow > band.firstOutputRow)
+    {
+      bands.push_back(band);
+    }
+  }
+
+  for (unsigned i = 0; i < bands.size(); ++i)
+  {
+    const Band& band = bands[i];
+
+    // Disjoint rows of the image, decoded in place
+    cv::Mat rows = image.rowRange(band.firstOutputRow - firstOutputRow,
+                                  band.lastOutputRow - firstOutputRow);
+
+    tasks.push_back(boost::bind(&JpegDecoder::decodeBand, this, band, rows, &results[i]));
+  }
+
+  if (!mpThreadPool->run(tasks))
+  {
+    return false;
+  }
+
+  return (count(results.begin(), results.begin() + bands.size(), 0) == 0);
+}
+
+//------------------------------------------------------------------------------
+// Build a standalone JPEG for one band (the original headers with the frame
+// height patched, followed by the band's restart intervals renumbered from
+// RST0) and decode the band's rows of it into image
+//------------------------------------------------------------------------------
+void JpegDecoder::decodeBand(const Band& band, cv::Mat image, char* result) const
+{
+  const unsigned restartInterval = mInfo.restart_interval;
+  const unsigned rowsPerMcu = mMcuHeight * mInfo.scale_num / 8;
+
+  // Chroma upsampling of the first and last rows needs their neighbours
+  const bool needsContext = mInfo.do_fancy_upsampling && (mInfo.max_v_samp_factor > 1);
+
+  // Expand to the surrounding restart boundaries
+  unsigned firstMcuRow = band.firstMcuRow;
+  unsigned lastMcuRow = band.lastMcuRow;
+
+  if (needsContext && (firstMcuRow > 0))
+  {
+    do
+    {
+      firstMcuRow--;
+    }
+    while ((firstMcuRow > 0) && ((size_t)firstMcuRow * mMcusPerRow) % restartInterval);
+  }
+
+  if (needsContext && (lastMcuRow < mMcuRows))
+  {
+    do
+    {
+      lastMcuRow++;
+    }
+    while ((lastMcuRow < mMcuRows) && ((size_t)lastMcuRow * mMcusPerRow) % restartInterval);
+  }
+
+  const size_t firstInterval = (size_t)firstMcuRow * mMcusPerRow / restartInterval;
+  const size_t lastInterval = (lastMcuRow == mMcuRows) ?
+                              mLayout.restarts.size() + 1 :
+                              (size_t)lastMcuRow * mMcusPerRow / restartInterval;
+
+  const size_t begin = firstInterval ? mLayout.restarts[firstInterval - 1] + 2 : mLayout.dataBegin;
+  const size_t end = (lastInterval > mLayout.restarts.size()) ? mLayout.dataEnd : mLayout.restarts[lastInterval - 1];
+
+  //--------------------------------
+  //  Assemble the band's stream
+  //--------------------------------
+  vector<unsigned char> stream;
+  stream.reserve(mLayout.dataBegin + (end - begin) + 2);
+
+  stream.insert(stream.end(), mpData, mpData + mLayout.dataBegin);
+
+  const unsigned height = min(lastMcuRow * mMcuHeight, (unsigned)mInfo.image_height) -
+                          firstMcuRow * mMcuHeight;
+
+  stream[mLayout.frameOffset + 5] = (unsigned char)(height >> 8);
+  stream[mLayout.frameOffset + 6] = (unsigned char)(height & 0xFF);
+
+  size_t position = begin;
+
+  for (size_t i = firstInterval; (i + 1 < lastInterval) && (i < mLayout.restarts.size()); ++i)
+  {
+    const size_t restart = mLayout.restarts[i];
+
+    stream.insert(stream.end(), mpData + position, mpData + restart);
+    stream.push_back(0xFF);
+    stream.push_back((unsigned char)(0xD0 + ((i - firstInterval) & 7)));
+
+    position = restart + 2;
+  }
+
+  stream.insert(stream.end(), mpData + position, mpData + end);
+  stream.push_back(0xFF);
+  stream.push_back(0xD9);
+
+  //--------------------------------
+  //        Decode the band
+  //--------------------------------
+  JpegDecoder decoder;
+
+  if (!decoder.readHeader(&stream.front(), stream.size()))
+  {
+    *result = 0;
+    return;
+  }
+
+  const unsigned bandFirstRow = firstMcuRow * rowsPerMcu;
+
+  decoder.mFast = mFast;
+  decoder.mScaleNum = mInfo.scale_num;
+  decoder.mBandRegion = cv::Rect(mOutputRegion.x,
+                                 band.firstOutputRow - bandFirstRow,
+                                 mOutputRegion.width,
+                                 band.lastOutputRow - band.firstOutputRow);
+
+  *result = decoder.decode(image) ? 1 : 0;
+}
+
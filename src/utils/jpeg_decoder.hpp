@@ -0,0 +1,178 @@
+#ifndef JPEG_DECODER_HPP
+#define JPEG_DECODER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include <cstdio>
+#include <csetjmp>
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// libjpeg(-turbo)
+#include <jpeglib.h>
+
+// Local
+#include "utils/area_downscaler.hpp"
+#include "utils/thread_pool.hpp"
+
+// jpeg_crop_scanline() and jpeg_skip_scanlines() are available in every
+// libjpeg-turbo release that reports a version number (2.0 and up)
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER)
+#define JPEG_DECODER_CAN_CROP 1
+#endif
+
+// Decodes producing fewer pixels than this are not worth splitting up across
+// threads
+#ifndef JPEG_DECODER_PARALLEL_MIN_PIXELS
+#define JPEG_DECODER_PARALLEL_MIN_PIXELS 4000000
+#endif
+
+//------------------------------------------------------------------------------
+// Decodes JPEG data directly through libjpeg so that we have access to options
+// OpenCV does not expose. The most important of these is DCT domain scaling,
+// which lets libjpeg produce a 1/8 ... 8/8 scaled image for a fraction of the
+// cost of a full decode.
+//------------------------------------------------------------------------------
+class JpegDecoder : boost::noncopyable
+{
+  public:
+
+    JpegDecoder();
+    ~JpegDecoder();
+
+    static bool isJpeg(const unsigned char* data, size_t size);
+    static int readExifOrientation(const unsigned char* data, size_t size);
+
+    bool readHeader(const unsigned char* data, size_t size);
+    void setMinimumScale(double minimumScale);
+    void setRegion(const cv::Rect& region);
+    void setStreamingThreshold(size_t pixels);
+    void setFast(bool fast);
+    void setThreadPool(ThreadPool* threadPool, unsigned threadCount);
+    bool decode(cv::Mat& image);
+
+    cv::Size getSize() const;
+    cv::Size getOutputSize();
+    cv::Rect getOutputRegion() const;
+
+  private:
+
+    struct ErrorManager
+    {
+      struct jpeg_error_mgr pub;
+      jmp_buf setjmpBuffer;
+    };
+
+    // Byte offsets into the input needed to cut a baseline JPEG into
+    // independently decodable bands at its restart markers
+    struct StreamLayout
+    {
+      size_t frameOffset;
+      size_t dataBegin;
+      size_t dataEnd;
+      std::vector<size_t> restarts;
+    };
+
+    // A band of whole MCU rows and the rows of the output it fills
+    struct Band
+    {
+      unsigned firstMcuRow;
+      unsigned lastMcuRow;
+      unsigned firstOutputRow;
+      unsigned lastOutputRow;
+    };
+
+    static void errorExit(j_common_ptr cinfo);
+    static void outputMessage(j_common_ptr cinfo);
+
+    bool canDecode() const;
+    void computeScale();
+    cv::Rect computeOutputRegion() const;
+    cv::Size computeStreamingSize() const;
+
+    bool canDecodeInParallel();
+    bool readLayout(StreamLayout& layout) const;
+    bool decodeParallel(cv::Mat& image);
+    void decodeBand(const Band& band, cv::Mat image, char* result) const;
+
+    struct jpeg_decompress_struct mInfo;
+    ErrorManager mError;
+    bool mHeaderRead;
+
+    // The input passed to readHeader()
+    const unsigned char* mpData;
+    size_t mDataSize;
+    cv::Size mSize;
+    double mMinimumScale;
+
+    // Trade a little accuracy for speed (integer IDCT, no fancy upsampling)
+    bool mFast;
+
+    // Requested region in full resolution coordinates (empty for everything)
+    cv::Rect mRegion;
+
+    // Size of the whole image at the chosen scale and the part of it that was
+    // actually decoded
+    cv::Size mOutputSize;
+    cv::Rect mOutputRegion;
+
+    // Decodes larger than this many pixels are streamed through mDownscaler
+    // in bands of mBand rows (members so they survive a longjmp)
+    size_t mStreamingThreshold;
+    boost::scoped_ptr<AreaDownscaler> mDownscaler;
+    cv::Mat mBand;
+
+    // Restart interval parallel decoding, see decodeParallel()
+    ThreadPool* mpThreadPool;
+    unsigned mThreadCount;
+    StreamLayout mLayout;
+    unsigned mMcuHeight;
+    unsigned mMcusPerRow;
+    unsigned mMcuRows;
+
+    // Set on the decoders of individual bands so that they use the same scale
+    // and columns as the whole image
+    unsigned mScaleNum;
+    cv::Rect mBandRegion;
+
+};
+
+#endif // JPEG_DECODER_HPP
@@ -0,0 +1,356 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/orientation.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+cv::Size orientSize(const cv::Size& size, int orientation)
+{
+  if ((orientation >= 5) && (orientation <= 8))
+  {
+    return cv::Size(size.height, size.width);
+  }
+
+  return size;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+cv::Rect orientRect(const cv::Rect& r, const cv::Size& size, int orientation)
+{
+  const int w = size.width;
+  const int h = size.height;
+
+  switch(orientation)
+  {
+    case 2: return cv::Rect(w - r.x - r.width, r.y, r.width, r.height);
+    case 3: return cv::Rect(w - r.x - r.width, h - r.y - r.height, r.width, r.height);
+    case 4: return cv::Rect(r.x, h - r.y - r.height, r.width, r.height);
+    case 5: return cv::Rect(r.y, r.x, r.height, r.width);
+    case 6: return cv::Rect(h - r.y - r.height, r.x, r.height, r.width);
+    case 7: return cv::Rect(h - r.y - r.height, w - r.x - r.width, r.height, r.width);
+    case 8: return cv::Rect(r.y, w - r.x - r.width, r.height, r.width);
+    default: return r;
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+int inverseOrientation(int orientation)
+{
+  switch(orientation)
+  {
+    case 6: return 8;
+    case 8: return 6;
+    default: return orientation;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Transpose an N x N block of pixels of PixelSize bytes: pixel i of source row
+// j becomes pixel j of target row i. Rows are given as pointers so flips come
+// for free by reversing their order.
+//------------------------------------------------------------------------------
+template <int N, int PixelSize>
+static inline void transposeBlock(const unsigned char* const* sourceRows,
+                                  unsigned char* const* targetRows)
+{
+  for (int i = 0; i < N; ++i)
+  {
+    unsigned char* target = targetRows[i];
+
+    for (int j = 0; j < N; ++j)
+    {
+      memcpy(target + j * PixelSize, sourceRows[j] + i * PixelSize, PixelSize);
+    }
+  }
+}
+
+#if defined(__SSE2__)
+
+//------------------------------------------------------------------------------
+// 8 x 8 block of 1 byte pixels
+//------------------------------------------------------------------------------
+template <>
+inline void transposeBlock<8, 1>(const unsigned char* const* sourceRows,
+                                 unsigned char* const* targetRows)
+{
+  const __m128i a01 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)sourceRows[0]),
+                                        _mm_loadl_epi64((const __m128i*)sourceRows[1]));
+  const __m128i a23 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)sourceRows[2]),
+                                        _mm_loadl_epi64((const __m128i*)sourceRows[3]));
+  const __m128i a45 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)sourceRows[4]),
+                                        _mm_loadl_epi64((const __m128i*)sourceRows[5]));
+  const __m128i a67 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)sourceRows[6]),
+                                        _mm_loadl_epi64((const __m128i*)sourceRows[7]));
+
+  // Pixels 0-3 and 4-7 of rows 0-3 and 4-7
+  const __m128i b0 = _mm_unpacklo_epi16(a01, a23);
+  const __m128i b1 = _mm_unpackhi_epi16(a01, a23);
+  const __m128i b2 = _mm_unpacklo_epi16(a45, a67);
+  const __m128i b3 = _mm_unpackhi_epi16(a45, a67);
+
+  // Two target rows each
+  const __m128i c0 = _mm_unpacklo_epi32(b0, b2);
+  const __m128i c1 = _mm_unpackhi_epi32(b0, b2);
+  const __m128i c2 = _mm_unpacklo_epi32(b1, b3);
+  const __m128i c3 = _mm_unpackhi_epi32(b1, b3);
+
+  _mm_storel_epi64((__m128i*)targetRows[0], c0);
+  _mm_storel_epi64((__m128i*)targetRows[1], _mm_unpackhi_epi64(c0, c0));
+  _mm_storel_epi64((__m128i*)targetRows[2], c1);
+  _mm_storel_epi64((__m128i*)targetRows[3], _mm_unpackhi_epi64(c1, c1));
+  _mm_storel_epi64((__m128i*)targetRows[4], c2);
+  _mm_storel_epi64((__m128i*)targetRows[5], _mm_unpackhi_epi64(c2, c2));
+  _mm_storel_epi64((__m128i*)targetRows[6], c3);
+  _mm_storel_epi64((__m128i*)targetRows[7], _mm_unpackhi_epi64(c3, c3));
+}
+
+//------------------------------------------------------------------------------
+// 4 x 4 block of 4 byte pixels
+//------------------------------------------------------------------------------
+template <>
+inline void transposeBlock<4, 4>(const unsigned char* const* sourceRows,
+                                 unsigned char* const* targetRows)
+{
+  const __m128i r0 = _mm_loadu_si128((const __m128i*)sourceRows[0]);
+  const __m128i r1 = _mm_loadu_si128((const __m128i*)sourceRows[1]);
+  const __m128i r2 = _mm_loadu_si128((const __m128i*)sourceRows[2]);
+  const __m128i r3 = _mm_loadu_si128((const __m128i*)sourceRows[3]);
+
+  const __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+  const __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+  const __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+  const __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+  _mm_storeu_si128((__m128i*)targetRows[0], _mm_unpacklo_epi64(t0, t1));
+  _mm_storeu_si128((__m128i*)targetRows[1], _mm_unpackhi_epi64(t0, t1));
+  _mm_storeu_si128((__m128i*)targetRows[2], _mm_unpacklo_epi64(t2, t3));
+  _mm_storeu_si128((__m128i*)targetRows[3], _mm_unpackhi_epi64(t2, t3));
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Transposes bands of target rows, optionally mirrored:
+//
+//   target(x, y) = source(flipY ? w - 1 - y : y, flipX ? h - 1 - x : x)
+//
+// with w x h the size of the source. Orientation 5 is the plain transpose,
+// 6 flips x, 7 both and 8 y.
+//------------------------------------------------------------------------------
+class TransposeBody : public cv::ParallelLoopBody
+{
+  public:
+
+    TransposeBody(const cv::Mat& source, cv::Mat& target, bool flipX, bool flipY) :
+      mSource(source),
+      mTarget(target),
+      mFlipX(flipX),
+      mFlipY(flipY)
+    {
+    }
+
+    //--------------------------------------------------------------------------
+    // range is in blocks of target rows
+    //--------------------------------------------------------------------------
+    virtual void operator()(const cv::Range& range) const
+    {
+      switch (mSource.elemSize())
+      {
+        case 1: transpose<8, 1>(range); break;
+        case 2: transpose<4, 2>(range); break;
+        case 3: transpose<4, 3>(range); break;
+        case 4: transpose<4, 4>(range); break;
+        case 8: transpose<4, 8>(range); break;
+      }
+    }
+
+    static bool canTranspose(const cv::Mat& image)
+    {
+      const size_t pixelSize = image.elemSize();
+
+      return (pixelSize <= 4) || (pixelSize == 8);
+    }
+
+  private:
+
+    //--------------------------------------------------------------------------
+    // Blocks are transposed N x N pixels at a time, whatever does not fill a
+    // kernel pixel by pixel
+    //--------------------------------------------------------------------------
+    template <int N, int PixelSize>
+    void transpose(const cv::Range& range) const
+    {
+      const unsigned char* sourceRows[N];
+      unsigned char* targetRows[N];
+      unsigned char* columns[N];
+
+      for (int block = range.start; block < range.end; ++block)
+      {
+        const int y0 = block * ORIENTATION_BLOCK_SIZE;
+        const int y1 = min(mTarget.rows, y0 + ORIENTATION_BLOCK_SIZE);
+
+        for (int x0 = 0; x0 < mTarget.cols; x0 += ORIENTATION_BLOCK_SIZE)
+        {
+          const int x1 = min(mTarget.cols, x0 + ORIENTATION_BLOCK_SIZE);
+
+          for (int y = y0; y < y1; y += N)
+          {
+            const int rows = min(N, y1 - y);
+
+            int x = x0;
+
+            if (rows == N)
+            {
+              // Source pixels of the N target rows, in increasing order
+              const int sourceX = mFlipY ? mSource.cols - y - N : y;
+
+              for (int i = 0; i < N; ++i)
+              {
+                targetRows[i] = mTarget.ptr(mFlipY ? y + N - 1 - i : y + i);
+              }
+
+              for (; x + N <= x1; x += N)
+              {
+                for (int j = 0; j < N; ++j)
+                {
+                  sourceRows[j] = mSource.ptr(getSourceRow(x + j)) + sourceX * PixelSize;
+                  columns[j] = targetRows[j] + x * PixelSize;
+                }
+
+                transposeBlock<N, PixelSize>(sourceRows, columns);
+              }
+            }
+
+            for (int ty = y; ty < y + rows; ++ty)
+            {
+              unsigned char* target = mTarget.ptr(ty);
+              const int sourceX = mFlipY ? mSource.cols - 1 - ty : ty;
+
+              for (int tx = x; tx < x1; ++tx)
+              {
+                memcpy(target + tx * PixelSize,
+                       mSource.ptr(getSourceRow(tx)) + sourceX * PixelSize,
+                       PixelSize);
+              }
+            }
+          }
+        }
+      }
+    }
+
+    int getSourceRow(int x) const
+    {
+      return mFlipX ? mSource.rows - 1 - x : x;
+    }
+
+    const cv::Mat& mSource;
+    cv::Mat& mTarget;
+    bool mFlipX;
+    bool mFlipY;
+
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void orientImage(const cv::Mat& source, cv::Mat& target, int orientation)
+{
+  cv::Mat oriented;
+
+  switch(orientation)
+  {
+    case 2: // horizontal flip
+      cv::flip(source, oriented, 1);
+      break;
+
+    case 3: // 180 rotate
+      cv::flip(source, oriented, -1);
+      break;
+
+    case 4: // vertical flip
+      cv::flip(source, oriented, 0);
+      break;
+
+    case 5: // transpose
+    case 6: // 90 rotate right
+    case 7: // transverse
+    case 8: // 90 rotate left
+    {
+      const bool flipX = (orientation == 6) || (orientation == 7);
+      const bool flipY = (orientation == 7) || (orientation == 8);
+
+      // Operations only see 8-bit images, anything deeper goes through OpenCV
+      if (!TransposeBody::canTranspose(source))
+      {
+        cv::transpose(source, oriented);
+
+        if (flipX || flipY)
+        {
+          cv::flip(oriented, oriented, flipX ? (flipY ? -1 : 1) : 0);
+        }
+
+        break;
+      }
+
+      oriented.create(orientSize(source.size(), orientation), source.type());
+
+      TransposeBody body(source, oriented, flipX, flipY);
+
+      const int blocks = (oriented.rows + ORIENTATION_BLOCK_SIZE - 1) / ORIENTATION_BLOCK_SIZE;
+
+      cv::parallel_for_(cv::Range(0, blocks), body);
+      break;
+    }
+
+    default:
+      oriented = (source.data == target.data) ? source : source.clone();
+      break;
+  }
+
+  target = oriented;
+}
@@ -0,0 +1,68 @@
+#ifndef ORIENTATION_HPP
+#define ORIENTATION_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// Rotations work through the image in square blocks of this many pixels, so
+// the rows read and written by a block stay in L1
+// This can be overridden at build time
+#ifndef ORIENTATION_BLOCK_SIZE
+#define ORIENTATION_BLOCK_SIZE 32
+#endif
+
+//------------------------------------------------------------------------------
+// Helpers for EXIF orientations (1 through 8, anything else is treated as 1)
+//------------------------------------------------------------------------------
+
+// Orientations 5 through 8 swap the width and height
+cv::Size orientSize(const cv::Size& size, int orientation);
+
+// Map a rectangle in an image of the given size to where it ends up after
+// applying the orientation
+cv::Rect orientRect(const cv::Rect& r, const cv::Size& size, int orientation);
+
+// The orientation that undoes the given one (only the two 90 degree rotations
+// are not their own inverse)
+int inverseOrientation(int orientation);
+
+// Apply the orientation to source in a single pass. Flips go through OpenCV,
+// the transposing orientations (5 through 8) through a cache-blocked
+// transpose with SSE2 kernels for 1 and 4 byte pixels. target may be source.
+void orientImage(const cv::Mat& source, cv::Mat& target, int orientation);
+
+#endif // ORIENTATION_HPP
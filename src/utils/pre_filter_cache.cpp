@@ -0,0 +1,228 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/pre_filter_cache.hpp"
+
+#include <cmath>
+#include <functional>
+
+// OpenCV
+#include <opencv2/imgproc.hpp>
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool PreFilterCache::Key::operator<(const Key& other) const
+{
+  if (data != other.data)
+  {
+    return less<const unsigned char*>()(data, other.data);
+  }
+
+  if (x != other.x)
+  {
+    return x < other.x;
+  }
+
+  if (y != other.y)
+  {
+    return y < other.y;
+  }
+
+  if (width != other.width)
+  {
+    return width < other.width;
+  }
+
+  if (height != other.height)
+  {
+    return height < other.height;
+  }
+
+  if (sigma != other.sigma)
+  {
+    return sigma < other.sigma;
+  }
+
+  return mode < other.mode;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+PreFilterCache::PreFilterCache() :
+  mMutex(),
+  mEntries()
+{
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+PreFilterCache::Key PreFilterCache::getKey(const cv::Mat& image, const cv::Rect& region, double sigma, int mode)
+{
+  Key key;
+  key.data = image.data;
+  key.x = region.x;
+  key.y = region.y;
+  key.width = region.width;
+  key.height = region.height;
+  key.sigma = sigma;
+  key.mode = mode;
+
+  return key;
+}
+
+//------------------------------------------------------------------------------
+// Announce one more get() of the same arguments, which has to happen before
+// any of them are read
+//------------------------------------------------------------------------------
+void PreFilterCache::addConsumer(const cv::Mat& image, const cv::Rect& region, double sigma, int mode)
+{
+  boost::mutex::scoped_lock lock(mMutex);
+
+  boost::shared_ptr<Entry>& entry = mEntries[getKey(image, region, sigma, mode)];
+
+  if (!entry)
+  {
+    entry.reset(new Entry());
+    entry->source = image;
+  }
+
+  entry->consumers++;
+}
+
+//------------------------------------------------------------------------------
+// The blurred region of image, which must not be modified
+//------------------------------------------------------------------------------
+cv::Mat PreFilterCache::get(const cv::Mat& image, const cv::Rect& region, double sigma, int mode)
+{
+  const Key key = getKey(image, region, sigma, mode);
+
+  boost::shared_ptr<Entry> entry;
+
+  {
+    boost::mutex::scoped_lock lock(mMutex);
+
+    map<Key, boost::shared_ptr<Entry> >::iterator found = mEntries.find(key);
+
+    if (found != mEntries.end())
+    {
+      entry = found->second;
+    }
+  }
+
+  cv::Mat blurred;
+
+  if (!entry)
+  {
+    blur(image(region), blurred, sigma, mode);
+    return blurred;
+  }
+
+  {
+    // Anyone else asking for the same region waits here until it is done
+    boost::mutex::scoped_lock lock(entry->mutex);
+
+    if (!entry->done)
+    {
+      blur(image(region), entry->blurred, sigma, mode);
+      entry->done = true;
+    }
+
+    blurred = entry->blurred;
+  }
+
+  // The last consumer drops the entry, the returned header keeps the pixels
+  // alive for as long as it needs them
+  boost::mutex::scoped_lock lock(mMutex);
+
+  if (--entry->consumers == 0)
+  {
+    mEntries.erase(key);
+  }
+
+  return blurred;
+}
+
+//------------------------------------------------------------------------------
+// Pixels around the source are read if it is part of a larger image
+//------------------------------------------------------------------------------
+void PreFilterCache::blur(const cv::Mat& source, cv::Mat& target, double sigma, int mode)
+{
+  if (mode == PreFilterModeFast)
+  {
+    boxBlur(source, target, sigma);
+  }
+  else
+  {
+    cv::GaussianBlur(source, target, cv::Size(0, 0), sigma);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Three box blurs whose variances add up to sigma^2, with odd widths as close
+// to each other as possible (Kovesi, "Fast Almost-Gaussian Filtering")
+//------------------------------------------------------------------------------
+void PreFilterCache::boxBlur(const cv::Mat& source, cv::Mat& target, double sigma)
+{
+  static const int passes = 3;
+
+  const double variance = sigma * sigma;
+  const double ideal = sqrt(12.0 * variance / passes + 1.0);
+
+  int lower = (int)floor(ideal);
+
+  if (lower % 2 == 0)
+  {
+    --lower;
+  }
+
+  const int upper = lower + 2;
+  const int lowerPasses = (int)floor((12.0 * variance - passes * lower * lower -
+                                      4.0 * passes * lower - 3.0 * passes) /
+                                     (-4.0 * lower - 4.0) + 0.5);
+
+  cv::Mat temp;
+
+  for (int i = 0; i < passes; ++i)
+  {
+    const int width = (i < lowerPasses) ? lower : upper;
+
+    // Passes alternate between the buffers and end up in target
+    const cv::Mat& from = (i == 0) ? source : ((i % 2) ? target : temp);
+    cv::Mat& to = (i % 2) ? temp : target;
+
+    cv::blur(from, to, cv::Size(width, width));
+  }
+}
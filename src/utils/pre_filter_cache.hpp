@@ -0,0 +1,117 @@
+#ifndef PRE_FILTER_CACHE_HPP
+#define PRE_FILTER_CACHE_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+
+#include <map>
+
+// Boost
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+enum
+{
+  PreFilterModeAccurate = 0,
+  PreFilterModeFast     = 1
+};
+
+//------------------------------------------------------------------------------
+// Gaussian blur of resize sources before they are shrunk. The fast mode
+// approximates the Gaussian with three box blurs, which cost the same for any
+// sigma.
+//
+// Resizes of a job that blur the same region of the same image share the
+// result through the cache. Every resize that will ask is registered up front
+// with addConsumer(). The first one to ask computes the blur while the others
+// wait, and the entry is dropped once its last consumer has read it. Regions
+// nobody registered for are blurred without being cached.
+//------------------------------------------------------------------------------
+class PreFilterCache : boost::noncopyable
+{
+  public:
+
+    PreFilterCache();
+
+    void addConsumer(const cv::Mat& image, const cv::Rect& region, double sigma, int mode);
+    cv::Mat get(const cv::Mat& image, const cv::Rect& region, double sigma, int mode);
+
+    static void blur(const cv::Mat& source, cv::Mat& target, double sigma, int mode);
+
+  private:
+
+    struct Key
+    {
+      bool operator<(const Key& other) const;
+
+      const unsigned char* data;
+      int x;
+      int y;
+      int width;
+      int height;
+      double sigma;
+      int mode;
+    };
+
+    struct Entry
+    {
+      Entry() : consumers(0), done(false) {}
+
+      // Registered consumers that have not read the result yet, guarded by
+      // the cache's mutex
+      unsigned consumers;
+
+      boost::mutex mutex;
+
+      // Keeps the buffer the key points to alive
+      cv::Mat source;
+
+      cv::Mat blurred;
+      bool done;
+    };
+
+    static Key getKey(const cv::Mat& image, const cv::Rect& region, double sigma, int mode);
+    static void boxBlur(const cv::Mat& source, cv::Mat& target, double sigma);
+
+    boost::mutex mMutex;
+    std::map<Key, boost::shared_ptr<Entry> > mEntries;
+
+};
+
+#endif // PRE_FILTER_CACHE_HPP
@@ -0,0 +1,1178 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/resampler.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+// Boost
+#include <boost/thread/mutex.hpp>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RESAMPLER_NEON 1
+#endif
+
+using namespace std;
+
+// Weights are fixed-point numbers with this many fractional bits
+static const int PRECISION_BITS = 14;
+static const int ROUNDING = 1 << (PRECISION_BITS - 1);
+
+//------------------------------------------------------------------------------
+// Weights for one axis. Target pixel i is the weighted sum of counts[i] source
+// pixels from starts[i] on, with the coefficients from i * taps on. Each row of
+// coefficients is padded with zeros to taps, a multiple of 8, so kernels may
+// read them in pairs or blocks of 8.
+//------------------------------------------------------------------------------
+struct Resampler::Weights
+{
+  int taps;
+  vector<int> starts;
+  vector<int> counts;
+  vector<short> coefficients;
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+class Resampler::RowBody : public cv::ParallelLoopBody
+{
+  public:
+
+    RowBody(const cv::Mat& source,
+            cv::Mat& target,
+            const Weights& columnWeights,
+            const Weights& rowWeights);
+
+    virtual void operator()(const cv::Range& range) const;
+
+  private:
+
+    const cv::Mat& mSource;
+    cv::Mat& mTarget;
+    const Weights& mColumnWeights;
+    const Weights& mRowWeights;
+
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+class Resampler::LinearRowBody : public cv::ParallelLoopBody
+{
+  public:
+
+    LinearRowBody(const cv::Mat& source,
+                  cv::Mat& target,
+                  const Weights& columnWeights,
+                  const Weights& rowWeights);
+
+    virtual void operator()(const cv::Range& range) const;
+
+  private:
+
+    const cv::Mat& mSource;
+    cv::Mat& mTarget;
+    const Weights& mColumnWeights;
+    const Weights& mRowWeights;
+
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+struct WeightsKey
+{
+  WeightsKey(int sourceLength, int targetLength, int filter) :
+    sourceLength(sourceLength),
+    targetLength(targetLength),
+    filter(filter)
+  {
+  }
+
+  bool operator<(const WeightsKey& other) const
+  {
+    if (sourceLength != other.sourceLength)
+    {
+      return sourceLength < other.sourceLength;
+    }
+
+    if (targetLength != other.targetLength)
+    {
+      return targetLength < other.targetLength;
+    }
+
+    return filter < other.filter;
+  }
+
+  int sourceLength;
+  int targetLength;
+  int filter;
+};
+
+//------------------------------------------------------------------------------
+// Mitchell-Netravali cubic with parameters b and c
+//------------------------------------------------------------------------------
+static double cubic(double x, double b, double c)
+{
+  x = fabs(x);
+
+  if (x < 1.0)
+  {
+    return ((12.0 - 9.0 * b - 6.0 * c) * x * x * x +
+            (-18.0 + 12.0 * b + 6.0 * c) * x * x +
+            (6.0 - 2.0 * b)) / 6.0;
+  }
+
+  if (x < 2.0)
+  {
+    return ((-b - 6.0 * c) * x * x * x +
+            (6.0 * b + 30.0 * c) * x * x +
+            (-12.0 * b - 48.0 * c) * x +
+            (8.0 * b + 24.0 * c)) / 6.0;
+  }
+
+  return 0.0;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static double sinc(double x)
+{
+  if (x == 0.0)
+  {
+    return 1.0;
+  }
+
+  x *= M_PI;
+
+  return sin(x) / x;
+}
+
+//------------------------------------------------------------------------------
+// Radius of the filter in source pixels before it is stretched
+//------------------------------------------------------------------------------
+static double filterSupport(int filter)
+{
+  switch (filter)
+  {
+    case ResamplerFilterCatrom:
+    case ResamplerFilterMitchell:
+      return 2.0;
+
+    case ResamplerFilterLanczos3:
+      return 3.0;
+
+    default:
+      return 1.0;
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static double filterValue(int filter, double x)
+{
+  switch (filter)
+  {
+    case ResamplerFilterCatrom:
+      return cubic(x, 0.0, 0.5);
+
+    case ResamplerFilterMitchell:
+      return cubic(x, 1.0 / 3.0, 1.0 / 3.0);
+
+    case ResamplerFilterLanczos3:
+      return (fabs(x) < 3.0) ? sinc(x) * sinc(x / 3.0) : 0.0;
+
+    default:
+      return max(0.0, 1.0 - fabs(x));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Two coefficients packed the way madd expects them next to two interleaved
+// pixels
+//------------------------------------------------------------------------------
+static inline int pairCoefficients(const short* coefficients)
+{
+  return (int)(((unsigned)(unsigned short)coefficients[1] << 16) |
+               (unsigned)(unsigned short)coefficients[0]);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static inline unsigned char clampPixel(int value)
+{
+  value >>= PRECISION_BITS;
+
+  return (unsigned char)((value < 0) ? 0 : ((value > 255) ? 255 : value));
+}
+
+//------------------------------------------------------------------------------
+// out[i] is the weighted sum of rows[0..count)[i] for the first length bytes.
+// Any number of channels works since every byte is filtered on its own.
+//------------------------------------------------------------------------------
+static void verticalPass(const unsigned char* const* rows,
+                         const short* coefficients,
+                         int count,
+                         int length,
+                         unsigned char* out)
+{
+  int i = 0;
+
+#if defined(__AVX2__)
+  const __m256i zero256 = _mm256_setzero_si256();
+
+  for (; i + 32 <= length; i += 32)
+  {
+    __m256i acc0 = _mm256_set1_epi32(ROUNDING);
+    __m256i acc1 = acc0;
+    __m256i acc2 = acc0;
+    __m256i acc3 = acc0;
+
+    // Taps in pairs, an odd last tap is paired with itself and a zero weight
+    for (int k = 0; k < count; k += 2)
+    {
+      const unsigned char* second = rows[(k + 1 < count) ? k + 1 : k];
+
+      const __m256i a = _mm256_loadu_si256((const __m256i*)(rows[k] + i));
+      const __m256i b = _mm256_loadu_si256((const __m256i*)(second + i));
+      const __m256i w = _mm256_set1_epi32(pairCoefficients(coefficients + k));
+
+      const __m256i lo = _mm256_unpacklo_epi8(a, b);
+      const __m256i hi = _mm256_unpackhi_epi8(a, b);
+
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero256), w));
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero256), w));
+      acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero256), w));
+      acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero256), w));
+    }
+
+    // The packs undo the unpacks within each 128 bit lane
+    const __m256i packed0 = _mm256_packs_epi32(_mm256_srai_epi32(acc0, PRECISION_BITS),
+                                               _mm256_srai_epi32(acc1, PRECISION_BITS));
+    const __m256i packed1 = _mm256_packs_epi32(_mm256_srai_epi32(acc2, PRECISION_BITS),
+                                               _mm256_srai_epi32(acc3, PRECISION_BITS));
+
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_packus_epi16(packed0, packed1));
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; i + 16 <= length; i += 16)
+  {
+    __m128i acc0 = _mm_set1_epi32(ROUNDING);
+    __m128i acc1 = acc0;
+    __m128i acc2 = acc0;
+    __m128i acc3 = acc0;
+
+    // Taps in pairs, an odd last tap is paired with itself and a zero weight
+    for (int k = 0; k < count; k += 2)
+    {
+      const unsigned char* second = rows[(k + 1 < count) ? k + 1 : k];
+
+      const __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+      const __m128i b = _mm_loadu_si128((const __m128i*)(second + i));
+      const __m128i w = _mm_set1_epi32(pairCoefficients(coefficients + k));
+
+      const __m128i lo = _mm_unpacklo_epi8(a, b);
+      const __m128i hi = _mm_unpackhi_epi8(a, b);
+
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+      acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+      acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+    }
+
+    const __m128i packed0 = _mm_packs_epi32(_mm_srai_epi32(acc0, PRECISION_BITS),
+                                            _mm_srai_epi32(acc1, PRECISION_BITS));
+    const __m128i packed1 = _mm_packs_epi32(_mm_srai_epi32(acc2, PRECISION_BITS),
+                                            _mm_srai_epi32(acc3, PRECISION_BITS));
+
+    _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(packed0, packed1));
+  }
+#endif
+
+#if defined(RESAMPLER_NEON)
+  for (; i + 16 <= length; i += 16)
+  {
+    int32x4_t acc0 = vdupq_n_s32(ROUNDING);
+    int32x4_t acc1 = acc0;
+    int32x4_t acc2 = acc0;
+    int32x4_t acc3 = acc0;
+
+    for (int k = 0; k < count; ++k)
+    {
+      const uint8x16_t pixels = vld1q_u8(rows[k] + i);
+      const int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(pixels)));
+      const int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(pixels)));
+      const short w = coefficients[k];
+
+      acc0 = vmlal_n_s16(acc0, vget_low_s16(lo), w);
+      acc1 = vmlal_n_s16(acc1, vget_high_s16(lo), w);
+      acc2 = vmlal_n_s16(acc2, vget_low_s16(hi), w);
+      acc3 = vmlal_n_s16(acc3, vget_high_s16(hi), w);
+    }
+
+    const int16x8_t packed0 = vcombine_s16(vqshrn_n_s32(acc0, PRECISION_BITS),
+                                           vqshrn_n_s32(acc1, PRECISION_BITS));
+    const int16x8_t packed1 = vcombine_s16(vqshrn_n_s32(acc2, PRECISION_BITS),
+                                           vqshrn_n_s32(acc3, PRECISION_BITS));
+
+    vst1q_u8(out + i, vcombine_u8(vqmovun_s16(packed0), vqmovun_s16(packed1)));
+  }
+#endif
+
+  for (; i < length; ++i)
+  {
+    int sum = ROUNDING;
+
+    for (int k = 0; k < count; ++k)
+    {
+      sum += rows[k][i] * coefficients[k];
+    }
+
+    out[i] = clampPixel(sum);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Filters a row of length target pixels from row, which must be readable for
+// (source width + taps) pixels plus 8 bytes.
+//------------------------------------------------------------------------------
+static void horizontalPass(const unsigned char* row,
+                           const int* starts,
+                           const int* counts,
+                           const short* coefficients,
+                           int taps,
+                           int length,
+                           int channels,
+                           unsigned char* out)
+{
+  if (channels == 1)
+  {
+    for (int x = 0; x < length; ++x)
+    {
+      const unsigned char* pixels = row + starts[x];
+      const short* weights = coefficients + x * taps;
+      const int count = counts[x];
+
+    #if defined(__SSE2__)
+      // 8 taps at a time, the coefficients past count are zero
+      const __m128i zero = _mm_setzero_si128();
+      __m128i acc = zero;
+
+      for (int k = 0; k < count; k += 8)
+      {
+        const __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pixels + k)), zero);
+        const __m128i w = _mm_loadu_si128((const __m128i*)(weights + k));
+
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(p, w));
+      }
+
+      acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+      acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+      const int sum = ROUNDING + _mm_cvtsi128_si32(acc);
+    #elif defined(RESAMPLER_NEON)
+      int32x4_t acc = vdupq_n_s32(0);
+
+      for (int k = 0; k < count; k += 8)
+      {
+        const int16x8_t p = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pixels + k)));
+        const int16x8_t w = vld1q_s16(weights + k);
+
+        acc = vmlal_s16(acc, vget_low_s16(p), vget_low_s16(w));
+        acc = vmlal_s16(acc, vget_high_s16(p), vget_high_s16(w));
+      }
+
+      int32x2_t pair = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+      pair = vpadd_s32(pair, pair);
+
+      const int sum = ROUNDING + vget_lane_s32(pair, 0);
+    #else
+      int sum = ROUNDING;
+
+      for (int k = 0; k < count; ++k)
+      {
+        sum += pixels[k] * weights[k];
+      }
+    #endif
+
+      out[x] = clampPixel(sum);
+    }
+
+    return;
+  }
+
+  for (int x = 0; x < length; ++x)
+  {
+    const unsigned char* pixels = row + starts[x] * channels;
+    const short* weights = coefficients + x * taps;
+    const int count = counts[x];
+
+    unsigned char* target = out + x * channels;
+
+  #if defined(__SSE2__)
+    // Pixel pairs interleaved channel by channel give one sum per channel
+    // in each 32 bit lane, the coefficient past an odd count is zero
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_set1_epi32(ROUNDING);
+
+    for (int k = 0; k < count; k += 2)
+    {
+      const __m128i a = _mm_loadl_epi64((const __m128i*)(pixels + k * channels));
+      const __m128i b = _mm_loadl_epi64((const __m128i*)(pixels + (k + 1) * channels));
+      const __m128i p = _mm_unpacklo_epi8(_mm_unpacklo_epi8(a, b), zero);
+
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(p, _mm_set1_epi32(pairCoefficients(weights + k))));
+    }
+
+    acc = _mm_srai_epi32(acc, PRECISION_BITS);
+    acc = _mm_packs_epi32(acc, acc);
+    acc = _mm_packus_epi16(acc, acc);
+
+    const int packed = _mm_cvtsi128_si32(acc);
+
+    memcpy(target, &packed, channels);
+  #elif defined(RESAMPLER_NEON)
+    int32x4_t acc = vdupq_n_s32(ROUNDING);
+
+    for (int k = 0; k < count; ++k)
+    {
+      const int16x8_t p = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pixels + k * channels)));
+
+      acc = vmlal_n_s16(acc, vget_low_s16(p), weights[k]);
+    }
+
+    const int16x8_t narrowed = vcombine_s16(vqshrn_n_s32(acc, PRECISION_BITS), vdup_n_s16(0));
+
+    unsigned char packed[8];
+    vst1_u8(packed, vqmovun_s16(narrowed));
+
+    memcpy(target, packed, channels);
+  #else
+    for (int c = 0; c < channels; ++c)
+    {
+      int sum = ROUNDING;
+
+      for (int k = 0; k < count; ++k)
+      {
+        sum += pixels[k * channels + c] * weights[k];
+      }
+
+      target[c] = clampPixel(sum);
+    }
+  #endif
+  }
+}
+
+//------------------------------------------------------------------------------
+// Linear light values have 15 bits, which keeps them positive in the signed
+// 16 bit lanes of the kernels and still tells the darkest sRGB levels apart
+//------------------------------------------------------------------------------
+static const int LINEAR_MAX = 32767;
+
+//------------------------------------------------------------------------------
+// sRGB transfer function lookup tables. Alpha is not gamma encoded and is only
+// rescaled.
+//------------------------------------------------------------------------------
+struct LinearLightTables
+{
+  LinearLightTables()
+  {
+    for (int i = 0; i < 256; ++i)
+    {
+      const double value = i / 255.0;
+      const double linear = (value <= 0.04045) ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+
+      toLinear[i] = (short)floor(linear * LINEAR_MAX + 0.5);
+      alphaToLinear[i] = (short)((i * LINEAR_MAX + 127) / 255);
+    }
+
+    for (int i = 0; i <= LINEAR_MAX; ++i)
+    {
+      const double linear = (double)i / LINEAR_MAX;
+      const double value = (linear <= 0.0031308) ? linear * 12.92 : 1.055 * pow(linear, 1.0 / 2.4) - 0.055;
+
+      fromLinear[i] = (unsigned char)floor(value * 255.0 + 0.5);
+      alphaFromLinear[i] = (unsigned char)((i * 255 + LINEAR_MAX / 2) / LINEAR_MAX);
+    }
+  }
+
+  short toLinear[256];
+  short alphaToLinear[256];
+  unsigned char fromLinear[LINEAR_MAX + 1];
+  unsigned char alphaFromLinear[LINEAR_MAX + 1];
+};
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static const LinearLightTables& getLinearLightTables()
+{
+  static const LinearLightTables tables;
+
+  return tables;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static void toLinearRow(const unsigned char* row, short* out, int width, int channels)
+{
+  const LinearLightTables& tables = getLinearLightTables();
+
+  if (channels == 4)
+  {
+    for (int x = 0; x < width * 4; x += 4)
+    {
+      out[x] = tables.toLinear[row[x]];
+      out[x + 1] = tables.toLinear[row[x + 1]];
+      out[x + 2] = tables.toLinear[row[x + 2]];
+      out[x + 3] = tables.alphaToLinear[row[x + 3]];
+    }
+
+    return;
+  }
+
+  for (int i = 0; i < width * channels; ++i)
+  {
+    out[i] = tables.toLinear[row[i]];
+  }
+}
+
+//------------------------------------------------------------------------------
+// The values must be clamped to [0, LINEAR_MAX] already
+//------------------------------------------------------------------------------
+static void fromLinearRow(const short* row, unsigned char* out, int width, int channels)
+{
+  const LinearLightTables& tables = getLinearLightTables();
+
+  if (channels == 4)
+  {
+    for (int x = 0; x < width * 4; x += 4)
+    {
+      out[x] = tables.fromLinear[row[x]];
+      out[x + 1] = tables.fromLinear[row[x + 1]];
+      out[x + 2] = tables.fromLinear[row[x + 2]];
+      out[x + 3] = tables.alphaFromLinear[row[x + 3]];
+    }
+
+    return;
+  }
+
+  for (int i = 0; i < width * channels; ++i)
+  {
+    out[i] = tables.fromLinear[row[i]];
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static inline short clampLinear(int value)
+{
+  value >>= PRECISION_BITS;
+
+  return (short)((value < 0) ? 0 : ((value > LINEAR_MAX) ? LINEAR_MAX : value));
+}
+
+//------------------------------------------------------------------------------
+// verticalPass() for rows of linear light values
+//------------------------------------------------------------------------------
+static void verticalPassLinear(const short* const* rows,
+                               const short* coefficients,
+                               int count,
+                               int length,
+                               short* out)
+{
+  int i = 0;
+
+#if defined(__AVX2__)
+  const __m256i zero256 = _mm256_setzero_si256();
+
+  for (; i + 16 <= length; i += 16)
+  {
+    __m256i acc0 = _mm256_set1_epi32(ROUNDING);
+    __m256i acc1 = acc0;
+
+    for (int k = 0; k < count; k += 2)
+    {
+      const short* second = rows[(k + 1 < count) ? k + 1 : k];
+
+      const __m256i a = _mm256_loadu_si256((const __m256i*)(rows[k] + i));
+      const __m256i b = _mm256_loadu_si256((const __m256i*)(second + i));
+      const __m256i w = _mm256_set1_epi32(pairCoefficients(coefficients + k));
+
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+    }
+
+    const __m256i packed = _mm256_packs_epi32(_mm256_srai_epi32(acc0, PRECISION_BITS),
+                                              _mm256_srai_epi32(acc1, PRECISION_BITS));
+
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_max_epi16(packed, zero256));
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; i + 8 <= length; i += 8)
+  {
+    __m128i acc0 = _mm_set1_epi32(ROUNDING);
+    __m128i acc1 = acc0;
+
+    for (int k = 0; k < count; k += 2)
+    {
+      const short* second = rows[(k + 1 < count) ? k + 1 : k];
+
+      const __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+      const __m128i b = _mm_loadu_si128((const __m128i*)(second + i));
+      const __m128i w = _mm_set1_epi32(pairCoefficients(coefficients + k));
+
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+    }
+
+    const __m128i packed = _mm_packs_epi32(_mm_srai_epi32(acc0, PRECISION_BITS),
+                                           _mm_srai_epi32(acc1, PRECISION_BITS));
+
+    _mm_storeu_si128((__m128i*)(out + i), _mm_max_epi16(packed, zero));
+  }
+#endif
+
+#if defined(RESAMPLER_NEON)
+  const int16x8_t zero = vdupq_n_s16(0);
+
+  for (; i + 8 <= length; i += 8)
+  {
+    int32x4_t acc0 = vdupq_n_s32(ROUNDING);
+    int32x4_t acc1 = acc0;
+
+    for (int k = 0; k < count; ++k)
+    {
+      const int16x8_t values = vld1q_s16(rows[k] + i);
+
+      acc0 = vmlal_n_s16(acc0, vget_low_s16(values), coefficients[k]);
+      acc1 = vmlal_n_s16(acc1, vget_high_s16(values), coefficients[k]);
+    }
+
+    const int16x8_t packed = vcombine_s16(vqshrn_n_s32(acc0, PRECISION_BITS),
+                                          vqshrn_n_s32(acc1, PRECISION_BITS));
+
+    vst1q_s16(out + i, vmaxq_s16(packed, zero));
+  }
+#endif
+
+  for (; i < length; ++i)
+  {
+    int sum = ROUNDING;
+
+    for (int k = 0; k < count; ++k)
+    {
+      sum += rows[k][i] * coefficients[k];
+    }
+
+    out[i] = clampLinear(sum);
+  }
+}
+
+//------------------------------------------------------------------------------
+// horizontalPass() for rows of linear light values, row must be readable for
+// (source width + taps) pixels plus 8 values
+//------------------------------------------------------------------------------
+static void horizontalPassLinear(const short* row,
+                                 const int* starts,
+                                 const int* counts,
+                                 const short* coefficients,
+                                 int taps,
+                                 int length,
+                                 int channels,
+                                 short* out)
+{
+  if (channels == 1)
+  {
+    for (int x = 0; x < length; ++x)
+    {
+      const short* values = row + starts[x];
+      const short* weights = coefficients + x * taps;
+      const int count = counts[x];
+
+    #if defined(__SSE2__)
+      // 8 taps at a time, the coefficients past count are zero
+      __m128i acc = _mm_setzero_si128();
+
+      for (int k = 0; k < count; k += 8)
+      {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(values + k));
+        const __m128i w = _mm_loadu_si128((const __m128i*)(weights + k));
+
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(v, w));
+      }
+
+      acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+      acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+      const int sum = ROUNDING + _mm_cvtsi128_si32(acc);
+    #elif defined(RESAMPLER_NEON)
+      int32x4_t acc = vdupq_n_s32(0);
+
+      for (int k = 0; k < count; k += 8)
+      {
+        const int16x8_t v = vld1q_s16(values + k);
+        const int16x8_t w = vld1q_s16(weights + k);
+
+        acc = vmlal_s16(acc, vget_low_s16(v), vget_low_s16(w));
+        acc = vmlal_s16(acc, vget_high_s16(v), vget_high_s16(w));
+      }
+
+      int32x2_t pair = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+      pair = vpadd_s32(pair, pair);
+
+      const int sum = ROUNDING + vget_lane_s32(pair, 0);
+    #else
+      int sum = ROUNDING;
+
+      for (int k = 0; k < count; ++k)
+      {
+        sum += values[k] * weights[k];
+      }
+    #endif
+
+      out[x] = clampLinear(sum);
+    }
+
+    return;
+  }
+
+  for (int x = 0; x < length; ++x)
+  {
+    const short* values = row + starts[x] * channels;
+    const short* weights = coefficients + x * taps;
+    const int count = counts[x];
+
+    short* target = out + x * channels;
+
+  #if defined(__SSE2__)
+    // Pixel pairs interleaved channel by channel give one sum per channel
+    // in each 32 bit lane, the coefficient past an odd count is zero
+    __m128i acc = _mm_set1_epi32(ROUNDING);
+
+    for (int k = 0; k < count; k += 2)
+    {
+      const __m128i a = _mm_loadl_epi64((const __m128i*)(values + k * channels));
+      const __m128i b = _mm_loadl_epi64((const __m128i*)(values + (k + 1) * channels));
+
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, b),
+                                              _mm_set1_epi32(pairCoefficients(weights + k))));
+    }
+
+    acc = _mm_srai_epi32(acc, PRECISION_BITS);
+    acc = _mm_max_epi16(_mm_packs_epi32(acc, acc), _mm_setzero_si128());
+
+    short packed[8];
+    _mm_storeu_si128((__m128i*)packed, acc);
+
+    memcpy(target, packed, channels * sizeof(short));
+  #elif defined(RESAMPLER_NEON)
+    int32x4_t acc = vdupq_n_s32(ROUNDING);
+
+    for (int k = 0; k < count; ++k)
+    {
+      acc = vmlal_n_s16(acc, vld1_s16(values + k * channels), weights[k]);
+    }
+
+    short packed[4];
+    vst1_s16(packed, vmax_s16(vqshrn_n_s32(acc, PRECISION_BITS), vdup_n_s16(0)));
+
+    memcpy(target, packed, channels * sizeof(short));
+  #else
+    for (int c = 0; c < channels; ++c)
+    {
+      int sum = ROUNDING;
+
+      for (int k = 0; k < count; ++k)
+      {
+        sum += values[k * channels + c] * weights[k];
+      }
+
+      target[c] = clampLinear(sum);
+    }
+  #endif
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+Resampler::RowBody::RowBody(const cv::Mat& source,
+                            cv::Mat& target,
+                            const Weights& columnWeights,
+                            const Weights& rowWeights) :
+  mSource(source),
+  mTarget(target),
+  mColumnWeights(columnWeights),
+  mRowWeights(rowWeights)
+{
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void Resampler::RowBody::operator()(const cv::Range& range) const
+{
+  const int channels = mSource.channels();
+  const int rowLength = mSource.cols * channels;
+
+  // Vertically filtered source row, padded for the reads of horizontalPass()
+  vector<unsigned char> row((mSource.cols + mColumnWeights.taps) * channels + 16, 0);
+  vector<const unsigned char*> rows(mRowWeights.taps);
+
+  for (int y = range.start; y < range.end; ++y)
+  {
+    const int start = mRowWeights.starts[y];
+    const int count = mRowWeights.counts[y];
+
+    for (int k = 0; k < count; ++k)
+    {
+      rows[k] = mSource.ptr(start + k);
+    }
+
+    verticalPass(&rows[0],
+                 &mRowWeights.coefficients[y * mRowWeights.taps],
+                 count,
+                 rowLength,
+                 &row[0]);
+
+    horizontalPass(&row[0],
+                   &mColumnWeights.starts[0],
+                   &mColumnWeights.counts[0],
+                   &mColumnWeights.coefficients[0],
+                   mColumnWeights.taps,
+                   mTarget.cols,
+                   channels,
+                   mTarget.ptr(y));
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+Resampler::LinearRowBody::LinearRowBody(const cv::Mat& source,
+                                        cv::Mat& target,
+                                        const Weights& columnWeights,
+                                        const Weights& rowWeights) :
+  mSource(source),
+  mTarget(target),
+  mColumnWeights(columnWeights),
+  mRowWeights(rowWeights)
+{
+}
+
+//------------------------------------------------------------------------------
+// Source rows are converted to linear light once and kept in a ring of taps
+// rows. The rows under a target row never collide in it since starts only
+// increase.
+//------------------------------------------------------------------------------
+void Resampler::LinearRowBody::operator()(const cv::Range& range) const
+{
+  const int channels = mSource.channels();
+  const int rowLength = mSource.cols * channels;
+  const int ringSize = mRowWeights.taps;
+
+  vector<short> ring(ringSize * rowLength);
+  vector<int> ringRows(ringSize, -1);
+
+  // Vertically filtered source row, padded for the reads of horizontalPassLinear()
+  vector<short> row((mSource.cols + mColumnWeights.taps) * channels + 8, 0);
+  vector<short> targetRow(mTarget.cols * channels);
+  vector<const short*> rows(mRowWeights.taps);
+
+  for (int y = range.start; y < range.end; ++y)
+  {
+    const int start = mRowWeights.starts[y];
+    const int count = mRowWeights.counts[y];
+
+    for (int k = 0; k < count; ++k)
+    {
+      const int sourceRow = start + k;
+      const int slot = sourceRow % ringSize;
+
+      short* linear = &ring[slot * rowLength];
+
+      if (ringRows[slot] != sourceRow)
+      {
+        toLinearRow(mSource.ptr(sourceRow), linear, mSource.cols, channels);
+        ringRows[slot] = sourceRow;
+      }
+
+      rows[k] = linear;
+    }
+
+    verticalPassLinear(&rows[0],
+                       &mRowWeights.coefficients[y * mRowWeights.taps],
+                       count,
+                       rowLength,
+                       &row[0]);
+
+    horizontalPassLinear(&row[0],
+                         &mColumnWeights.starts[0],
+                         &mColumnWeights.counts[0],
+                         &mColumnWeights.coefficients[0],
+                         mColumnWeights.taps,
+                         mTarget.cols,
+                         channels,
+                         &targetRow[0]);
+
+    fromLinearRow(&targetRow[0], mTarget.ptr(y), mTarget.cols, channels);
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+Resampler::Resampler(const cv::Size& sourceSize, const cv::Size& targetSize, int filter) :
+  mSourceSize(sourceSize),
+  mTargetSize(targetSize),
+  mColumnWeights(getWeights(sourceSize.width, targetSize.width, filter)),
+  mRowWeights(getWeights(sourceSize.height, targetSize.height, filter))
+{
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+bool Resampler::canResample(const cv::Mat& image)
+{
+  return !image.empty() && (image.depth() == CV_8U) && (image.channels() <= 4);
+}
+
+//------------------------------------------------------------------------------
+// The source must be of the size the resampler was created for and pass
+// canResample(). Target rows are filtered in parallel.
+//------------------------------------------------------------------------------
+void Resampler::resize(const cv::Mat& source, cv::Mat& target) const
+{
+  // Resizing in place needs a copy of the source to read from
+  const cv::Mat input = (source.data == target.data) ? source.clone() : source;
+
+  target.create(mTargetSize, source.type());
+
+  RowBody body(input, target, *mColumnWeights, *mRowWeights);
+
+  cv::parallel_for_(cv::Range(0, mTargetSize.height), body);
+}
+
+//------------------------------------------------------------------------------
+// Like resize(), but filters sRGB values in linear light so fine bright
+// detail is not darkened. Every source pixel goes through a lookup table on
+// the way in, which makes large reductions two to four times slower.
+//------------------------------------------------------------------------------
+void Resampler::resizeLinearLight(const cv::Mat& source, cv::Mat& target) const
+{
+  // Resizing in place needs a copy of the source to read from
+  const cv::Mat input = (source.data == target.data) ? source.clone() : source;
+
+  target.create(mTargetSize, source.type());
+
+  LinearRowBody body(input, target, *mColumnWeights, *mRowWeights);
+
+  cv::parallel_for_(cv::Range(0, mTargetSize.height), body);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+Resampler::WeightsPtr Resampler::getWeights(int sourceLength, int targetLength, int filter)
+{
+  // Shared by every resampler in the process
+  static boost::mutex cacheMutex;
+  static map<WeightsKey, WeightsPtr> cache;
+
+  const WeightsKey key(sourceLength, targetLength, filter);
+
+  {
+    boost::mutex::scoped_lock lock(cacheMutex);
+
+    map<WeightsKey, WeightsPtr>::const_iterator found = cache.find(key);
+
+    if (found != cache.end())
+    {
+      return found->second;
+    }
+  }
+
+  // Computed without holding the lock, threads racing to the same weights
+  // just compute them twice
+  WeightsPtr weights = computeWeights(sourceLength, targetLength, filter);
+
+  boost::mutex::scoped_lock lock(cacheMutex);
+
+  if (cache.size() >= RESAMPLER_WEIGHT_CACHE_SIZE)
+  {
+    cache.clear();
+  }
+
+  cache[key] = weights;
+
+  return weights;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+Resampler::WeightsPtr Resampler::computeWeights(int sourceLength, int targetLength, int filter)
+{
+  const double scale = (double)sourceLength / (double)targetLength;
+
+  // Like INTER_AREA, which only averages when shrinking
+  if ((filter == ResamplerFilterArea) && (scale <= 1.0))
+  {
+    filter = ResamplerFilterBilinear;
+  }
+
+  // Filters are stretched over scale source pixels when shrinking
+  const double filterScale = max(scale, 1.0);
+  const double support = filterSupport(filter) * filterScale;
+
+  vector<int> starts(targetLength);
+  vector<vector<double> > values(targetLength);
+
+  int taps = 1;
+
+  for (int i = 0; i < targetLength; ++i)
+  {
+    int first;
+    int last;
+
+    vector<double>& value = values[i];
+
+    if (filter == ResamplerFilterArea)
+    {
+      // Source pixels in proportion to how much of them [i, i + 1) covers
+      const double left = i * scale;
+      const double right = (i + 1) * scale;
+
+      first = max((int)floor(left), 0);
+      last = min((int)ceil(right), sourceLength);
+
+      for (int x = first; x < last; ++x)
+      {
+        value.push_back(max(0.0, min(right, x + 1.0) - max(left, (double)x)));
+      }
+    }
+    else
+    {
+      const double center = (i + 0.5) * scale;
+
+      first = max((int)floor(center - support + 0.5), 0);
+      last = min((int)floor(center + support + 0.5), sourceLength);
+
+      for (int x = first; x < last; ++x)
+      {
+        value.push_back(filterValue(filter, (x + 0.5 - center) / filterScale));
+      }
+    }
+
+    // Drop the zero weights on the edges of the filter
+    while (!value.empty() && (value.back() == 0.0))
+    {
+      value.pop_back();
+    }
+
+    while (!value.empty() && (value.front() == 0.0))
+    {
+      value.erase(value.begin());
+      ++first;
+    }
+
+    if (value.empty())
+    {
+      // Nearest pixel
+      first = min(max((int)((i + 0.5) * scale), 0), sourceLength - 1);
+      value.push_back(1.0);
+    }
+
+    starts[i] = first;
+    taps = max(taps, (int)value.size());
+  }
+
+  boost::shared_ptr<Weights> weights(new Weights());
+
+  weights->taps = (taps + 7) & ~7;
+  weights->starts.swap(starts);
+  weights->counts.resize(targetLength);
+  weights->coefficients.assign(targetLength * weights->taps, 0);
+
+  for (int i = 0; i < targetLength; ++i)
+  {
+    const vector<double>& value = values[i];
+    const int count = (int)value.size();
+
+    double total = 0.0;
+
+    for (int k = 0; k < count; ++k)
+    {
+      total += value[k];
+    }
+
+    short* coefficients = &weights->coefficients[i * weights->taps];
+
+    int sum = 0;
+    int largest = 0;
+
+    for (int k = 0; k < count; ++k)
+    {
+      const double scaled = floor(value[k] / total * (1 << PRECISION_BITS) + 0.5);
+
+      coefficients[k] = (short)max(-32768.0, min(32767.0, scaled));
+      sum += coefficients[k];
+
+      if (abs(coefficients[k]) > abs(coefficients[largest]))
+      {
+        largest = k;
+      }
+    }
+
+    // The rounding error goes to the largest weight so flat areas stay flat
+    coefficients[largest] += (short)((1 << PRECISION_BITS) - sum);
+
+    weights->counts[i] = count;
+  }
+
+  return weights;
+}
@@ -0,0 +1,108 @@
+#ifndef RESAMPLER_HPP
+#define RESAMPLER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+
+// Boost
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// Number of weight tables kept for reuse, each is a few KB. The cache is
+// emptied when it fills up.
+#ifndef RESAMPLER_WEIGHT_CACHE_SIZE
+#define RESAMPLER_WEIGHT_CACHE_SIZE 64
+#endif
+
+enum
+{
+  ResamplerFilterArea     = 0,
+  ResamplerFilterBilinear = 1,
+  ResamplerFilterCatrom   = 2,
+  ResamplerFilterMitchell = 3,
+  ResamplerFilterLanczos3 = 4
+};
+
+//------------------------------------------------------------------------------
+// Separable resampler for 8-bit images of 1 to 4 channels. Each target row is
+// filtered vertically from the source rows under it and then horizontally,
+// using 14 bit fixed-point weights and SSE2/AVX2/NEON kernels where the build
+// targets them.
+//
+// Filters are stretched when downscaling so every source pixel contributes
+// (bilinear included). The area filter weights source pixels by how much of
+// them each target pixel covers, and is bilinear when upscaling like OpenCV's
+// INTER_AREA.
+//
+// resizeLinearLight() decodes sRGB to 15 bit linear light through lookup
+// tables, filters that with 16 bit kernels and encodes the result again.
+//
+// The weights for a (source length, target length, filter) are computed once
+// and shared by every resampler in the process.
+//------------------------------------------------------------------------------
+class Resampler : boost::noncopyable
+{
+  public:
+
+    Resampler(const cv::Size& sourceSize, const cv::Size& targetSize, int filter);
+
+    static bool canResample(const cv::Mat& image);
+
+    void resize(const cv::Mat& source, cv::Mat& target) const;
+    void resizeLinearLight(const cv::Mat& source, cv::Mat& target) const;
+
+  private:
+
+    struct Weights;
+    class RowBody;
+    class LinearRowBody;
+
+    typedef boost::shared_ptr<const Weights> WeightsPtr;
+
+    static WeightsPtr getWeights(int sourceLength, int targetLength, int filter);
+    static WeightsPtr computeWeights(int sourceLength, int targetLength, int filter);
+
+    cv::Size mSourceSize;
+    cv::Size mTargetSize;
+
+    WeightsPtr mColumnWeights;
+    WeightsPtr mRowWeights;
+
+};
+
+#endif // RESAMPLER_HPP
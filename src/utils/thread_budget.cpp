@@ -0,0 +1,151 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/thread_budget.hpp"
+#include "utils/thread_pool.hpp"
+
+#include <algorithm>
+
+// Boost
+#include <boost/thread.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+
+// See ThreadBudget::set()
+static boost::mutex budgetMutex;
+static bool budgetSet = false;
+static ThreadAllocation budget;
+
+// Jobs holding an ImageSlot, guarded by budgetMutex
+static unsigned runningImages = 0;
+static boost::condition_variable imageReleased;
+
+//------------------------------------------------------------------------------
+// Waits until fewer than the budget's images are running (immediately without
+// a budget)
+//------------------------------------------------------------------------------
+ThreadBudget::ImageSlot::ImageSlot()
+{
+  boost::mutex::scoped_lock lock(budgetMutex);
+
+  while (budgetSet && (runningImages >= budget.images))
+  {
+    imageReleased.wait(lock);
+  }
+
+  runningImages++;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+ThreadBudget::ImageSlot::~ImageSlot()
+{
+  {
+    boost::mutex::scoped_lock lock(budgetMutex);
+
+    runningImages--;
+  }
+
+  imageReleased.notify_one();
+}
+
+//------------------------------------------------------------------------------
+// Divide threads (0 for one per core) between images processed at the same
+// time. Each image runs up to operations of its operations at once (0 for as
+// many as its share of threads) and the rest of its share goes to the kernels
+// of each operation.
+//------------------------------------------------------------------------------
+ThreadAllocation ThreadBudget::allocate(unsigned threads, unsigned images, unsigned operations)
+{
+  ThreadAllocation allocation;
+
+  allocation.threads = threads ? threads : max(boost::thread::hardware_concurrency(), 1u);
+  allocation.images = min(max(images, 1u), allocation.threads);
+
+  const unsigned share = allocation.threads / allocation.images;
+
+  allocation.operations = operations ? min(operations, share) : share;
+  allocation.kernel = share / allocation.operations;
+
+  return allocation;
+}
+
+//------------------------------------------------------------------------------
+// Make allocate(threads, images, operations) the process wide budget. This
+// sizes the shared thread pool and OpenCV's thread count, so it must be called
+// before any job starts.
+//------------------------------------------------------------------------------
+void ThreadBudget::set(unsigned threads, unsigned images, unsigned operations)
+{
+  const ThreadAllocation allocation = allocate(threads, images, operations);
+
+  ThreadPool::setSharedThreadCount(allocation.threads);
+
+  {
+    boost::mutex::scoped_lock lock(budgetMutex);
+
+    budget = allocation;
+    budgetSet = true;
+  }
+
+  // More images may fit now
+  imageReleased.notify_all();
+
+  cv::setNumThreads(allocation.kernel);
+}
+
+//------------------------------------------------------------------------------
+// The allocation set with set(), or what is used without a budget
+//------------------------------------------------------------------------------
+ThreadAllocation ThreadBudget::get()
+{
+  boost::mutex::scoped_lock lock(budgetMutex);
+
+  if (budgetSet)
+  {
+    return budget;
+  }
+
+  ThreadAllocation allocation;
+
+  allocation.threads = ThreadPool::getShared().getThreadCount();
+  allocation.images = 1;
+  allocation.operations = allocation.threads;
+  allocation.kernel = max(cv::getNumThreads(), 1);
+
+  return allocation;
+}
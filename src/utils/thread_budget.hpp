@@ -0,0 +1,81 @@
+#ifndef THREAD_BUDGET_HPP
+#define THREAD_BUDGET_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+//------------------------------------------------------------------------------
+// How the threads of the process are divided. Each of images (jobs running at
+// the same time, e.g. callers of ArionResize() on different threads) gets an
+// equal share, runs up to operations of its operations at once and each
+// operation runs its kernels (OpenCV's and ours) on up to kernel threads.
+//------------------------------------------------------------------------------
+struct ThreadAllocation
+{
+  unsigned threads;
+  unsigned images;
+  unsigned operations;
+  unsigned kernel;
+};
+
+//------------------------------------------------------------------------------
+// Process wide thread budget. Until set() is called nothing is limited:
+// operations may use every thread of the shared pool and OpenCV keeps its own
+// thread count.
+//------------------------------------------------------------------------------
+class ThreadBudget
+{
+  public:
+
+    // Held by a job while it runs, at most the budget's images are held at a
+    // time and further jobs wait for one to be released
+    class ImageSlot : boost::noncopyable
+    {
+      public:
+
+        ImageSlot();
+        ~ImageSlot();
+    };
+
+    static ThreadAllocation allocate(unsigned threads, unsigned images, unsigned operations);
+
+    static void set(unsigned threads, unsigned images, unsigned operations);
+    static ThreadAllocation get();
+
+};
+
+#endif // THREAD_BUDGET_HPP
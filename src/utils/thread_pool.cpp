@@ -0,0 +1,242 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/thread_pool.hpp"
+
+#include <algorithm>
+
+// Boost
+#include <boost/scoped_ptr.hpp>
+
+using namespace std;
+
+// See getShared()
+static boost::mutex sharedMutex;
+static boost::scoped_ptr<ThreadPool> sharedPool;
+static unsigned sharedThreadCount = 0;
+
+//------------------------------------------------------------------------------
+// Requested size of the shared pool, must be called with sharedMutex held
+//------------------------------------------------------------------------------
+static unsigned getSharedThreadCount()
+{
+  return sharedThreadCount ? sharedThreadCount : boost::thread::hardware_concurrency();
+}
+
+//------------------------------------------------------------------------------
+// threadCount includes the calling thread, so threadCount - 1 workers are
+// started. A count of 0 or 1 runs everything on the calling thread.
+//------------------------------------------------------------------------------
+ThreadPool::ThreadPool(unsigned threadCount) :
+  mThreads(),
+  mMutex(),
+  mCondition(),
+  mQueue(),
+  mStopping(false),
+  mThreadCount(max(threadCount, 1u))
+{
+  for (unsigned i = 1; i < mThreadCount; ++i)
+  {
+    mThreads.create_thread(boost::bind(&ThreadPool::workerLoop, this));
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+ThreadPool::~ThreadPool()
+{
+  {
+    boost::mutex::scoped_lock lock(mMutex);
+    mStopping = true;
+  }
+
+  mCondition.notify_all();
+  mThreads.join_all();
+}
+
+//------------------------------------------------------------------------------
+// Process wide pool, with one thread per core unless setSharedThreadCount() was
+// called first
+//------------------------------------------------------------------------------
+ThreadPool& ThreadPool::getShared()
+{
+  boost::mutex::scoped_lock lock(sharedMutex);
+
+  if (!sharedPool)
+  {
+    sharedPool.reset(new ThreadPool(getSharedThreadCount()));
+  }
+
+  return *sharedPool;
+}
+
+//------------------------------------------------------------------------------
+// Size of the shared pool (0 for one thread per core). A pool of another size
+// is replaced, so this must not be called while the shared pool is in use.
+//------------------------------------------------------------------------------
+void ThreadPool::setSharedThreadCount(unsigned threadCount)
+{
+  boost::mutex::scoped_lock lock(sharedMutex);
+
+  sharedThreadCount = threadCount;
+
+  if (sharedPool && (sharedPool->getThreadCount() != max(getSharedThreadCount(), 1u)))
+  {
+    sharedPool.reset();
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+unsigned ThreadPool::getThreadCount() const
+{
+  return mThreadCount;
+}
+
+//------------------------------------------------------------------------------
+// Run all tasks and wait for them to finish. Returns false if any task threw.
+//------------------------------------------------------------------------------
+bool ThreadPool::run(const vector<Task>& tasks)
+{
+  Batch batch;
+
+  if (tasks.empty())
+  {
+    return true;
+  }
+
+  // Nothing to gain from queuing a single task (or without workers)
+  if ((tasks.size() == 1) || (mThreadCount == 1))
+  {
+    for (vector<Task>::const_iterator task = tasks.begin(); task != tasks.end(); ++task)
+    {
+      Job job;
+      job.task = *task;
+      job.batch = &batch;
+
+      batch.remaining++;
+      execute(job);
+    }
+
+    return !batch.failed;
+  }
+
+  boost::mutex::scoped_lock lock(mMutex);
+
+  for (vector<Task>::const_iterator task = tasks.begin(); task != tasks.end(); ++task)
+  {
+    Job job;
+    job.task = *task;
+    job.batch = &batch;
+
+    mQueue.push_back(job);
+  }
+
+  batch.remaining = tasks.size();
+
+  mCondition.notify_all();
+
+  while (batch.remaining)
+  {
+    if (mQueue.empty())
+    {
+      // Remaining tasks are running on other threads
+      mCondition.wait(lock);
+      continue;
+    }
+
+    Job job = mQueue.front();
+    mQueue.pop_front();
+
+    lock.unlock();
+    execute(job);
+    lock.lock();
+  }
+
+  return !batch.failed;
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+void ThreadPool::workerLoop()
+{
+  boost::mutex::scoped_lock lock(mMutex);
+
+  while (true)
+  {
+    while (mQueue.empty() && !mStopping)
+    {
+      mCondition.wait(lock);
+    }
+
+    if (mStopping)
+    {
+      return;
+    }
+
+    Job job = mQueue.front();
+    mQueue.pop_front();
+
+    lock.unlock();
+    execute(job);
+    lock.lock();
+  }
+}
+
+//------------------------------------------------------------------------------
+// Run a single job and mark it as done in its batch
+//------------------------------------------------------------------------------
+void ThreadPool::execute(const Job& job)
+{
+  bool failed = false;
+
+  try
+  {
+    job.task();
+  }
+  catch (...)
+  {
+    failed = true;
+  }
+
+  boost::mutex::scoped_lock lock(mMutex);
+
+  job.batch->failed = job.batch->failed || failed;
+  job.batch->remaining--;
+
+  if (job.batch->remaining == 0)
+  {
+    mCondition.notify_all();
+  }
+}
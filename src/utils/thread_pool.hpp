@@ -0,0 +1,97 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include <deque>
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+//------------------------------------------------------------------------------
+// Fixed size pool of worker threads. run() hands a batch of tasks to the
+// workers and blocks until all of them are done. The calling thread works on
+// queued tasks while it waits, so tasks may safely call run() themselves.
+//------------------------------------------------------------------------------
+class ThreadPool : boost::noncopyable
+{
+  public:
+
+    typedef boost::function<void ()> Task;
+
+    explicit ThreadPool(unsigned threadCount);
+    ~ThreadPool();
+
+    static ThreadPool& getShared();
+    static void setSharedThreadCount(unsigned threadCount);
+
+    unsigned getThreadCount() const;
+    bool run(const std::vector<Task>& tasks);
+
+  private:
+
+    struct Batch
+    {
+      Batch() : remaining(0), failed(false) {}
+
+      unsigned remaining;
+      bool failed;
+    };
+
+    struct Job
+    {
+      Task task;
+      Batch* batch;
+    };
+
+    void workerLoop();
+    void execute(const Job& job);
+
+    boost::thread_group mThreads;
+    boost::mutex mMutex;
+
+    // Signalled when work is queued or a job finishes
+    boost::condition_variable mCondition;
+
+    std::deque<Job> mQueue;
+    bool mStopping;
+    unsigned mThreadCount;
+
+};
+
+#endif // THREAD_POOL_HPP
@@ -0,0 +1,432 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/unsharp_mask.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define UNSHARP_MASK_NEON 1
+#endif
+
+using namespace std;
+
+// Fractional bits of the Gaussian weights, the blurred values and the amount
+static const int WEIGHT_BITS = 14;
+static const int BLUR_BITS = 7;
+static const int AMOUNT_BITS = 8;
+
+static const int SHARPEN_BITS = BLUR_BITS + AMOUNT_BITS;
+
+//------------------------------------------------------------------------------
+// Index i of a line of n mirrored around its end pixels (BORDER_REFLECT_101)
+//------------------------------------------------------------------------------
+static int reflect(int i, int n)
+{
+  if (n == 1)
+  {
+    return 0;
+  }
+
+  while ((i < 0) || (i >= n))
+  {
+    i = (i < 0) ? -i : 2 * (n - 1) - i;
+  }
+
+  return i;
+}
+
+//------------------------------------------------------------------------------
+// Two weights packed the way madd expects them next to two interleaved values
+//------------------------------------------------------------------------------
+static inline int pairWeights(short first, short second)
+{
+  return (int)(((unsigned)(unsigned short)second << 16) | (unsigned)(unsigned short)first);
+}
+
+//------------------------------------------------------------------------------
+// out[i] is the weighted sum of rows[0..count)[i] with BLUR_BITS fractional
+// bits, weights has an even number of entries
+//------------------------------------------------------------------------------
+static void verticalBlur(const unsigned char* const* rows,
+                         const short* weights,
+                         int count,
+                         int length,
+                         short* out)
+{
+  static const int rounding = 1 << (WEIGHT_BITS - BLUR_BITS - 1);
+
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; i + 16 <= length; i += 16)
+  {
+    __m128i acc0 = _mm_set1_epi32(rounding);
+    __m128i acc1 = acc0;
+    __m128i acc2 = acc0;
+    __m128i acc3 = acc0;
+
+    // Rows in pairs, an odd last row is paired with itself and a zero weight
+    for (int k = 0; k < count; k += 2)
+    {
+      const unsigned char* second = rows[(k + 1 < count) ? k + 1 : k];
+
+      const __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+      const __m128i b = _mm_loadu_si128((const __m128i*)(second + i));
+      const __m128i w = _mm_set1_epi32(pairWeights(weights[k], weights[k + 1]));
+
+      const __m128i lo = _mm_unpacklo_epi8(a, b);
+      const __m128i hi = _mm_unpackhi_epi8(a, b);
+
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+      acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+      acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+    }
+
+    static const int shift = WEIGHT_BITS - BLUR_BITS;
+
+    _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(_mm_srai_epi32(acc0, shift),
+                                                          _mm_srai_epi32(acc1, shift)));
+    _mm_storeu_si128((__m128i*)(out + i + 8), _mm_packs_epi32(_mm_srai_epi32(acc2, shift),
+                                                              _mm_srai_epi32(acc3, shift)));
+  }
+#elif defined(UNSHARP_MASK_NEON)
+  for (; i + 16 <= length; i += 16)
+  {
+    int32x4_t acc0 = vdupq_n_s32(rounding);
+    int32x4_t acc1 = acc0;
+    int32x4_t acc2 = acc0;
+    int32x4_t acc3 = acc0;
+
+    for (int k = 0; k < count; ++k)
+    {
+      const uint8x16_t pixels = vld1q_u8(rows[k] + i);
+      const int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(pixels)));
+      const int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(pixels)));
+
+      acc0 = vmlal_n_s16(acc0, vget_low_s16(lo), weights[k]);
+      acc1 = vmlal_n_s16(acc1, vget_high_s16(lo), weights[k]);
+      acc2 = vmlal_n_s16(acc2, vget_low_s16(hi), weights[k]);
+      acc3 = vmlal_n_s16(acc3, vget_high_s16(hi), weights[k]);
+    }
+
+    vst1q_s16(out + i, vcombine_s16(vqshrn_n_s32(acc0, WEIGHT_BITS - BLUR_BITS),
+                                    vqshrn_n_s32(acc1, WEIGHT_BITS - BLUR_BITS)));
+    vst1q_s16(out + i + 8, vcombine_s16(vqshrn_n_s32(acc2, WEIGHT_BITS - BLUR_BITS),
+                                        vqshrn_n_s32(acc3, WEIGHT_BITS - BLUR_BITS)));
+  }
+#endif
+
+  for (; i < length; ++i)
+  {
+    int sum = rounding;
+
+    for (int k = 0; k < count; ++k)
+    {
+      sum += rows[k][i] * weights[k];
+    }
+
+    out[i] = (short)(sum >> (WEIGHT_BITS - BLUR_BITS));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Blur blurred horizontally (step apart values belong to the same channel) and
+// sharpen source with it. blurred must have count / 2 reflected pixels before
+// and after the length values.
+//------------------------------------------------------------------------------
+static void horizontalSharpen(const short* blurred,
+                              const short* weights,
+                              int count,
+                              int step,
+                              const unsigned char* source,
+                              int length,
+                              short amount,
+                              short threshold,
+                              unsigned char* out)
+{
+  static const int rounding = 1 << (WEIGHT_BITS - 1);
+  static const int sharpenRounding = 1 << (SHARPEN_BITS - 1);
+
+  const int radius = count / 2;
+
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i below = _mm_set1_epi16((short)(threshold - 1));
+  const __m128i factors = _mm_set1_epi32(pairWeights(amount, 1 << AMOUNT_BITS));
+
+  for (; i + 8 <= length; i += 8)
+  {
+    __m128i acc0 = _mm_set1_epi32(rounding);
+    __m128i acc1 = acc0;
+
+    for (int k = 0; k < count; k += 2)
+    {
+      const short* first = blurred + i + (k - radius) * step;
+      const short* second = (k + 1 < count) ? first + step : first;
+
+      const __m128i a = _mm_loadu_si128((const __m128i*)first);
+      const __m128i b = _mm_loadu_si128((const __m128i*)second);
+      const __m128i w = _mm_set1_epi32(pairWeights(weights[k], weights[k + 1]));
+
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+    }
+
+    const __m128i blur = _mm_packs_epi32(_mm_srai_epi32(acc0, WEIGHT_BITS),
+                                         _mm_srai_epi32(acc1, WEIGHT_BITS));
+
+    const __m128i pixels = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(source + i)), zero),
+                                          BLUR_BITS);
+
+    __m128i difference = _mm_sub_epi16(pixels, blur);
+
+    // Differences below the threshold are dropped
+    const __m128i magnitude = _mm_max_epi16(difference, _mm_sub_epi16(zero, difference));
+    difference = _mm_and_si128(difference, _mm_cmpgt_epi16(magnitude, below));
+
+    // pixel + amount * difference
+    __m128i sharp0 = _mm_madd_epi16(_mm_unpacklo_epi16(difference, pixels), factors);
+    __m128i sharp1 = _mm_madd_epi16(_mm_unpackhi_epi16(difference, pixels), factors);
+
+    sharp0 = _mm_srai_epi32(_mm_add_epi32(sharp0, _mm_set1_epi32(sharpenRounding)), SHARPEN_BITS);
+    sharp1 = _mm_srai_epi32(_mm_add_epi32(sharp1, _mm_set1_epi32(sharpenRounding)), SHARPEN_BITS);
+
+    const __m128i packed = _mm_packs_epi32(sharp0, sharp1);
+
+    _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(packed, packed));
+  }
+#elif defined(UNSHARP_MASK_NEON)
+  const int16x8_t limit = vdupq_n_s16(threshold);
+
+  for (; i + 8 <= length; i += 8)
+  {
+    int32x4_t acc0 = vdupq_n_s32(rounding);
+    int32x4_t acc1 = acc0;
+
+    for (int k = 0; k < count; ++k)
+    {
+      const int16x8_t values = vld1q_s16(blurred + i + (k - radius) * step);
+
+      acc0 = vmlal_n_s16(acc0, vget_low_s16(values), weights[k]);
+      acc1 = vmlal_n_s16(acc1, vget_high_s16(values), weights[k]);
+    }
+
+    const int16x8_t blur = vcombine_s16(vqshrn_n_s32(acc0, WEIGHT_BITS),
+                                        vqshrn_n_s32(acc1, WEIGHT_BITS));
+
+    const int16x8_t pixels = vshlq_n_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(source + i))), BLUR_BITS);
+
+    int16x8_t difference = vsubq_s16(pixels, blur);
+
+    // Differences below the threshold are dropped
+    difference = vandq_s16(difference, vreinterpretq_s16_u16(vcgeq_s16(vabsq_s16(difference), limit)));
+
+    // pixel + amount * difference
+    const int32x4_t sharp0 = vmlal_n_s16(vshll_n_s16(vget_low_s16(pixels), AMOUNT_BITS),
+                                         vget_low_s16(difference), amount);
+    const int32x4_t sharp1 = vmlal_n_s16(vshll_n_s16(vget_high_s16(pixels), AMOUNT_BITS),
+                                         vget_high_s16(difference), amount);
+
+    const int16x8_t packed = vcombine_s16(vrshrn_n_s32(sharp0, SHARPEN_BITS),
+                                          vrshrn_n_s32(sharp1, SHARPEN_BITS));
+
+    vst1_u8(out + i, vqmovun_s16(packed));
+  }
+#endif
+
+  for (; i < length; ++i)
+  {
+    int sum = rounding;
+
+    for (int k = 0; k < count; ++k)
+    {
+      sum += blurred[i + (k - radius) * step] * weights[k];
+    }
+
+    const int pixel = source[i] << BLUR_BITS;
+
+    int difference = pixel - (sum >> WEIGHT_BITS);
+
+    if (abs(difference) < threshold)
+    {
+      difference = 0;
+    }
+
+    const int sharp = (difference * amount + (pixel << AMOUNT_BITS) + sharpenRounding) >> SHARPEN_BITS;
+
+    out[i] = (unsigned char)max(0, min(255, sharp));
+  }
+}
+
+//------------------------------------------------------------------------------
+// target is (re)allocated unless it already has the size and type of source
+//------------------------------------------------------------------------------
+UnsharpMask::UnsharpMask(const cv::Mat& source,
+                         cv::Mat& target,
+                         double radius,
+                         double amount,
+                         unsigned threshold) :
+  mSource(source),
+  mTarget(),
+  mRadius(0),
+  mChannels(source.channels()),
+  mRowLength(source.cols * source.channels()),
+  mWeights(),
+  mAmount((short)min(floor(amount * (1 << AMOUNT_BITS) + 0.5), 32767.0)),
+  mThreshold((short)(min(threshold, 255u) << BLUR_BITS)),
+  mRing(),
+  mRingRows(),
+  mRows(),
+  mBlurred(),
+  mRow(0)
+{
+  target.create(source.size(), source.type());
+
+  // Shares the buffer of the caller's image
+  mTarget = target;
+
+  // The kernel size GaussianBlur() picks for 8-bit images
+  if (radius > 0.0)
+  {
+    mRadius = ((int)floor(radius * 6.0 + 1.5) | 1) / 2;
+  }
+
+  const int count = 2 * mRadius + 1;
+
+  vector<double> gaussian(count);
+  double total = 0.0;
+
+  for (int k = 0; k < count; ++k)
+  {
+    const double x = k - mRadius;
+
+    gaussian[k] = (radius > 0.0) ? exp(-x * x / (2.0 * radius * radius)) : 1.0;
+    total += gaussian[k];
+  }
+
+  mWeights.assign(count + 1, 0);
+
+  int sum = 0;
+
+  for (int k = 0; k < count; ++k)
+  {
+    mWeights[k] = (short)floor(gaussian[k] / total * (1 << WEIGHT_BITS) + 0.5);
+    sum += mWeights[k];
+  }
+
+  // The rounding error goes to the center so flat areas stay flat
+  mWeights[mRadius] += (short)((1 << WEIGHT_BITS) - sum);
+
+  mRing.resize(count * mRowLength);
+  mRingRows.assign(count, -1);
+  mRows.resize(count);
+  mBlurred.resize(mRowLength + 2 * mRadius * mChannels);
+}
+
+//------------------------------------------------------------------------------
+// Sharpen the rows up to lastRow (exclusive) that have not been sharpened yet.
+// Rows of the target before lastRow may be changed between calls, rows after
+// it must still hold the source if target is the source.
+//------------------------------------------------------------------------------
+void UnsharpMask::process(int lastRow)
+{
+  const int count = 2 * mRadius + 1;
+  const int rows = mSource.rows;
+  const int width = mSource.cols;
+
+  for (; mRow < min(lastRow, rows); ++mRow)
+  {
+    for (int k = 0; k < count; ++k)
+    {
+      mRows[k] = getSourceRow(reflect(mRow + k - mRadius, rows));
+    }
+
+    short* blurred = &mBlurred[mRadius * mChannels];
+
+    verticalBlur(&mRows[0], &mWeights[0], count, mRowLength, blurred);
+
+    // Mirror the row ends for the horizontal blur
+    for (int k = 1; k <= mRadius; ++k)
+    {
+      const int left = reflect(-k, width);
+      const int right = reflect(width - 1 + k, width);
+
+      memcpy(blurred - k * mChannels, blurred + left * mChannels, mChannels * sizeof(short));
+      memcpy(blurred + (width - 1 + k) * mChannels, blurred + right * mChannels, mChannels * sizeof(short));
+    }
+
+    horizontalSharpen(blurred,
+                      &mWeights[0],
+                      count,
+                      mChannels,
+                      mRows[mRadius],
+                      mRowLength,
+                      mAmount,
+                      mThreshold,
+                      mTarget.ptr(mRow));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Rows are copied to the ring the first time they are needed, which is before
+// the target row on top of them is written. The rows around the current one
+// never collide in it.
+//------------------------------------------------------------------------------
+const unsigned char* UnsharpMask::getSourceRow(int row)
+{
+  const int slot = row % (int)mRingRows.size();
+
+  unsigned char* copy = &mRing[slot * mRowLength];
+
+  if (mRingRows[slot] != row)
+  {
+    memcpy(copy, mSource.ptr(row), mRowLength);
+    mRingRows[slot] = row;
+  }
+
+  return copy;
+}
@@ -0,0 +1,103 @@
+#ifndef UNSHARP_MASK_HPP
+#define UNSHARP_MASK_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+//------------------------------------------------------------------------------
+// Unsharp mask for 8-bit images of any number of channels:
+//
+//   target = source + amount * (source - gaussian(source, radius))
+//
+// Pixels that differ from the blurred image by less than threshold levels are
+// left alone, which keeps flat areas (and the JPEG noise in them) from being
+// amplified.
+//
+// Rows are sharpened in a single streaming pass with fixed-point arithmetic
+// and SSE2/NEON kernels where the build targets them. The rows the blur still
+// needs are copied to a small ring, so target may be the source itself. The
+// Gaussian has the same support as the one OpenCV derives from the radius.
+//------------------------------------------------------------------------------
+class UnsharpMask : boost::noncopyable
+{
+  public:
+
+    UnsharpMask(const cv::Mat& source,
+                cv::Mat& target,
+                double radius,
+                double amount,
+                unsigned threshold);
+
+    void process(int lastRow);
+
+  private:
+
+    const unsigned char* getSourceRow(int row);
+
+    cv::Mat mSource;
+    cv::Mat mTarget;
+
+    int mRadius;
+    int mChannels;
+    int mRowLength;
+
+    // Fixed-point Gaussian weights, padded with a zero to an even count
+    std::vector<short> mWeights;
+
+    short mAmount;
+    short mThreshold;
+
+    // Copies of the source rows around the current one
+    std::vector<unsigned char> mRing;
+    std::vector<int> mRingRows;
+    std::vector<const unsigned char*> mRows;
+
+    // Vertically blurred row with mRadius reflected pixels on either side
+    std::vector<short> mBlurred;
+
+    // Next row to sharpen
+    int mRow;
+
+};
+
+#endif // UNSHARP_MASK_HPP
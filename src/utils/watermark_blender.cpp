@@ -0,0 +1,563 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+#include "utils/watermark_blender.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define WATERMARK_BLENDER_NEON 1
+#endif
+
+using namespace std;
+
+// Fractional bits of the amounts
+static const int AMOUNT_BITS = 8;
+
+// Pixels staged and blended together
+static const int CHUNK = 32;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+static unsigned short toFixed(double amount)
+{
+  amount = min(1.0, max(0.0, amount));
+
+  return (unsigned short)(amount * (1 << AMOUNT_BITS) + 0.5);
+}
+
+//------------------------------------------------------------------------------
+// inverse[i] = 256 - opacity, where the opacity is amounts[i] * alpha[i] / 255
+// rounded, i.e. the weight left to the image pixel
+//------------------------------------------------------------------------------
+static void getInverseOpacities(const unsigned char* alpha,
+                                const unsigned short* amounts,
+                                int count,
+                                unsigned short* inverse)
+{
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i rounding = _mm_set1_epi16(128);
+  const __m128i divisor = _mm_set1_epi16(257);
+  const __m128i one = _mm_set1_epi16(1 << AMOUNT_BITS);
+
+  for (; i + 8 <= count; i += 8)
+  {
+    const __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(alpha + i)), zero);
+    const __m128i w = _mm_loadu_si128((const __m128i*)(amounts + i));
+
+    // (t + 128) * 257 >> 16 is t / 255 rounded for any t below 65408
+    const __m128i t = _mm_add_epi16(_mm_mullo_epi16(a, w), rounding);
+    const __m128i opacity = _mm_mulhi_epu16(t, divisor);
+
+    _mm_storeu_si128((__m128i*)(inverse + i), _mm_sub_epi16(one, opacity));
+  }
+#elif defined(WATERMARK_BLENDER_NEON)
+  const uint16x8_t rounding = vdupq_n_u16(128);
+  const uint16x8_t one = vdupq_n_u16(1 << AMOUNT_BITS);
+
+  for (; i + 8 <= count; i += 8)
+  {
+    const uint16x8_t a = vmovl_u8(vld1_u8(alpha + i));
+    const uint16x8_t t = vaddq_u16(vmulq_u16(a, vld1q_u16(amounts + i)), rounding);
+
+    const uint16x4_t lo = vshrn_n_u32(vmull_n_u16(vget_low_u16(t), 257), 16);
+    const uint16x4_t hi = vshrn_n_u32(vmull_n_u16(vget_high_u16(t), 257), 16);
+
+    vst1q_u16(inverse + i, vsubq_u16(one, vcombine_u16(lo, hi)));
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    const unsigned t = (unsigned)alpha[i] * amounts[i] + 128;
+
+    inverse[i] = (unsigned short)((1 << AMOUNT_BITS) - ((t * 257) >> 16));
+  }
+}
+
+//------------------------------------------------------------------------------
+// pixels[i] = (pixels[i] * inverse[i] + color[i] * amounts[i]) / 256 rounded.
+// The color is premultiplied, so the sum stays within 16 bits.
+//------------------------------------------------------------------------------
+static void blendPlane(unsigned char* pixels,
+                       const unsigned char* color,
+                       const unsigned short* amounts,
+                       const unsigned short* inverse,
+                       int count)
+{
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i rounding = _mm_set1_epi16(1 << (AMOUNT_BITS - 1));
+
+  for (; i + 8 <= count; i += 8)
+  {
+    const __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pixels + i)), zero);
+    const __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(color + i)), zero);
+
+    __m128i sum = _mm_mullo_epi16(p, _mm_loadu_si128((const __m128i*)(inverse + i)));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(c, _mm_loadu_si128((const __m128i*)(amounts + i))));
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, rounding), AMOUNT_BITS);
+
+    _mm_storel_epi64((__m128i*)(pixels + i), _mm_packus_epi16(sum, sum));
+  }
+#elif defined(WATERMARK_BLENDER_NEON)
+  const uint16x8_t rounding = vdupq_n_u16(1 << (AMOUNT_BITS - 1));
+
+  for (; i + 8 <= count; i += 8)
+  {
+    uint16x8_t sum = vmulq_u16(vmovl_u8(vld1_u8(pixels + i)), vld1q_u16(inverse + i));
+    sum = vmlaq_u16(sum, vmovl_u8(vld1_u8(color + i)), vld1q_u16(amounts + i));
+    sum = vshrq_n_u16(vaddq_u16(sum, rounding), AMOUNT_BITS);
+
+    vst1_u8(pixels + i, vmovn_u16(sum));
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    const unsigned sum = (unsigned)pixels[i] * inverse[i] +
+                         (unsigned)color[i] * amounts[i] +
+                         (1 << (AMOUNT_BITS - 1));
+
+    pixels[i] = (unsigned char)(sum >> AMOUNT_BITS);
+  }
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+WatermarkBlender::WatermarkBlender(const Watermark& watermark, double amount) :
+    mWatermark(watermark),
+    mOrigin(0, 0),
+    mRepeat(true),
+    mpAmounts(0),
+    mBlockAmounts(),
+    mBlockSize(0),
+    mColumnBlocks(),
+    mColumnWeights()
+{
+  fill(mAmounts, mAmounts + 256, toFixed(amount));
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+WatermarkBlender::WatermarkBlender(const Watermark& watermark, double minimum, double maximum) :
+    mWatermark(watermark),
+    mOrigin(0, 0),
+    mRepeat(true),
+    mpAmounts(mAmounts),
+    mBlockAmounts(),
+    mBlockSize(0),
+    mColumnBlocks(),
+    mColumnWeights()
+{
+  for (int brightness = 0; brightness < 256; ++brightness)
+  {
+    mAmounts[brightness] =
+        toFixed((maximum - minimum) * log10(1.0 + 9.0 * brightness / 255.0) + minimum);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Block centers are at (block + 1/2) * size. Finds the block whose center is at
+// or before position and the weight of the next one, out of 256.
+//------------------------------------------------------------------------------
+static void getBlockWeight(int position, int size, int blocks, int& block, unsigned short& weight)
+{
+  // Twice the distance from the first center
+  const int distance = 2 * position + 1 - size;
+
+  if (distance <= 0)
+  {
+    block = 0;
+    weight = 0;
+    return;
+  }
+
+  block = distance / (2 * size);
+
+  if (block >= blocks - 1)
+  {
+    block = blocks - 1;
+    weight = 0;
+    return;
+  }
+
+  weight = (unsigned short)(((distance - block * 2 * size) << AMOUNT_BITS) / (2 * size));
+}
+
+//------------------------------------------------------------------------------
+// Blends bands of image rows
+//------------------------------------------------------------------------------
+class WatermarkBlender::RowBody : public cv::ParallelLoopBody
+{
+  public:
+
+    RowBody(const WatermarkBlender& blender, cv::Mat& image) :
+      mBlender(blender),
+      mImage(image)
+    {
+    }
+
+    virtual void operator()(const cv::Range& range) const
+    {
+      switch (mImage.channels())
+      {
+        case 1:
+          mBlender.blendRows<1>(mImage, range.start, range.end);
+          break;
+        case 3:
+          mBlender.blendRows<3>(mImage, range.start, range.end);
+          break;
+        case 4:
+          mBlender.blendRows<4>(mImage, range.start, range.end);
+          break;
+        default:
+          break;
+      }
+    }
+
+  private:
+
+    const WatermarkBlender& mBlender;
+    cv::Mat& mImage;
+
+};
+
+//------------------------------------------------------------------------------
+// The origin is the image position of the watermark's top left corner and may
+// be outside of the image
+//------------------------------------------------------------------------------
+void WatermarkBlender::setPosition(const cv::Point& origin, bool repeat)
+{
+  mOrigin = origin;
+  mRepeat = repeat;
+}
+
+//------------------------------------------------------------------------------
+// Base the amounts of an adaptive watermark on the mean brightness of each
+// blockSize x blockSize block of image, which must have the size of the images
+// blended. Block sums are accumulated in one pass over the rows rather than
+// from an integral image, which would take 8 bytes per pixel. Has no effect on
+// a fixed amount.
+//------------------------------------------------------------------------------
+void WatermarkBlender::setBlocks(const cv::Mat& image, int blockSize)
+{
+  if (!mpAmounts || image.empty() || (image.depth() != CV_8U) || (blockSize < 1))
+  {
+    return;
+  }
+
+  const int channels = image.channels();
+  const int blockCols = (image.cols + blockSize - 1) / blockSize;
+  const int blockRows = (image.rows + blockSize - 1) / blockSize;
+
+  mBlockSize = blockSize;
+  mBlockAmounts.create(blockRows, blockCols + 1, CV_16UC1);
+
+  vector<unsigned> sums(blockCols);
+
+  for (int by = 0; by < blockRows; ++by)
+  {
+    const int y0 = by * blockSize;
+    const int y1 = min(image.rows, y0 + blockSize);
+
+    fill(sums.begin(), sums.end(), 0u);
+
+    for (int y = y0; y < y1; ++y)
+    {
+      const unsigned char* row = image.ptr<unsigned char>(y);
+
+      for (int bx = 0; bx < blockCols; ++bx)
+      {
+        const int x1 = min(image.cols, (bx + 1) * blockSize);
+
+        unsigned sum = 0;
+
+        for (int x = bx * blockSize; x < x1; ++x)
+        {
+          const unsigned char* pixel = row + x * channels;
+
+          if (channels == 1)
+          {
+            sum += pixel[0];
+          }
+          else
+          {
+            // The same approximation as for per pixel brightness
+            sum += (pixel[2] + pixel[2] + pixel[2] + pixel[0] + pixel[1] + pixel[1] + pixel[1] + pixel[1]) >> 3;
+          }
+        }
+
+        sums[bx] += sum;
+      }
+    }
+
+    unsigned short* amounts = mBlockAmounts.ptr<unsigned short>(by);
+
+    for (int bx = 0; bx < blockCols; ++bx)
+    {
+      const unsigned count = (y1 - y0) * (min(image.cols, (bx + 1) * blockSize) - bx * blockSize);
+
+      amounts[bx] = mpAmounts[(sums[bx] + count / 2) / count];
+    }
+
+    amounts[blockCols] = amounts[blockCols - 1];
+  }
+
+  mColumnBlocks.resize(image.cols);
+  mColumnWeights.resize(image.cols);
+
+  for (int x = 0; x < image.cols; ++x)
+  {
+    getBlockWeight(x, blockSize, blockCols, mColumnBlocks[x], mColumnWeights[x]);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Block amounts of an image row, interpolated between the block rows above and
+// below it
+//------------------------------------------------------------------------------
+void WatermarkBlender::getRowAmounts(int row, unsigned short* amounts) const
+{
+  int block;
+  unsigned short weight;
+
+  getBlockWeight(row, mBlockSize, mBlockAmounts.rows, block, weight);
+
+  const unsigned short* above = mBlockAmounts.ptr<unsigned short>(block);
+  const unsigned short* below = mBlockAmounts.ptr<unsigned short>(min(block + 1, mBlockAmounts.rows - 1));
+
+  for (int i = 0; i < mBlockAmounts.cols; ++i)
+  {
+    amounts[i] = (unsigned short)((above[i] * ((1 << AMOUNT_BITS) - weight) + below[i] * weight +
+                                   (1 << (AMOUNT_BITS - 1))) >> AMOUNT_BITS);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Blend rows [firstRow, lastRow) of image
+//------------------------------------------------------------------------------
+void WatermarkBlender::blend(cv::Mat& image, int firstRow, int lastRow) const
+{
+  if (!mRepeat)
+  {
+    // Only the rows the watermark covers
+    firstRow = max(firstRow, mOrigin.y);
+    lastRow = min(lastRow, mOrigin.y + mWatermark.alpha.rows);
+  }
+
+  if (mWatermark.spans.empty() || (image.depth() != CV_8U) || (firstRow >= lastRow))
+  {
+    return;
+  }
+
+  const double bytes = (double)(lastRow - firstRow) * image.cols * image.elemSize();
+
+  RowBody body(*this, image);
+
+  cv::parallel_for_(cv::Range(firstRow, lastRow), body, max(1.0, bytes / WATERMARK_BAND_BYTES));
+}
+
+//------------------------------------------------------------------------------
+// Each span of the watermark row is blended at every horizontal repeat, or at
+// the origin only, clipped to the image. Image pixels are staged as planes in
+// chunks, blended, and written back.
+//------------------------------------------------------------------------------
+template <int Channels>
+void WatermarkBlender::blendRows(cv::Mat& image, int firstRow, int lastRow) const
+{
+  const int watermarkRows = mWatermark.alpha.rows;
+  const int watermarkCols = mWatermark.alpha.cols;
+  const int cols = image.cols;
+
+  unsigned char planes[3][CHUNK];
+  unsigned short amounts[CHUNK];
+  unsigned short inverse[CHUNK];
+
+  const bool blocks = !mBlockAmounts.empty();
+
+  vector<unsigned short> rowAmounts(blocks ? mBlockAmounts.cols : 0);
+
+  // A fixed amount does not change from pixel to pixel
+  fill(amounts, amounts + CHUNK, mAmounts[0]);
+
+  // Column of the image where the first (or only) copy starts
+  int firstOffset = mOrigin.x;
+
+  if (mRepeat)
+  {
+    firstOffset = mOrigin.x % watermarkCols;
+
+    if (firstOffset > 0)
+    {
+      firstOffset -= watermarkCols;
+    }
+  }
+
+  const int endOffset = mRepeat ? cols : min(cols, firstOffset + 1);
+
+  int wy = (firstRow - mOrigin.y) % watermarkRows;
+
+  if (wy < 0)
+  {
+    wy += watermarkRows;
+  }
+
+  for (int y = firstRow; y < lastRow; ++y, wy = (wy + 1 == watermarkRows) ? 0 : wy + 1)
+  {
+    unsigned char* row = image.ptr<unsigned char>(y);
+
+    const unsigned char* alpha = mWatermark.alpha.ptr<unsigned char>(wy);
+    const unsigned char* colors[3];
+
+    if (Channels == 1)
+    {
+      colors[0] = mWatermark.gray.ptr<unsigned char>(wy);
+    }
+    else
+    {
+      colors[0] = mWatermark.blue.ptr<unsigned char>(wy);
+      colors[1] = mWatermark.green.ptr<unsigned char>(wy);
+      colors[2] = mWatermark.red.ptr<unsigned char>(wy);
+    }
+
+    if (blocks)
+    {
+      getRowAmounts(y, &rowAmounts[0]);
+    }
+
+    const int* spanBegin = &mWatermark.spans[0] + mWatermark.rowSpans[wy];
+    const int* spanEnd = &mWatermark.spans[0] + mWatermark.rowSpans[wy + 1];
+
+    for (int offset = firstOffset; offset < endOffset; offset += watermarkCols)
+    {
+      for (const int* span = spanBegin; span != spanEnd; span += 2)
+      {
+        const int x0 = max(0, offset + span[0]);
+        const int x1 = min(cols, offset + span[1]);
+
+        if (offset + span[0] >= cols)
+        {
+          break;
+        }
+
+        for (int x = x0; x < x1; x += CHUNK)
+        {
+          const int count = min(CHUNK, x1 - x);
+          const int wx = x - offset;
+
+          unsigned char* pixels = row + x * Channels;
+
+          if (Channels > 1)
+          {
+            for (int i = 0; i < count; ++i)
+            {
+              planes[0][i] = pixels[i * Channels];
+              planes[1][i] = pixels[i * Channels + 1];
+              planes[2][i] = pixels[i * Channels + 2];
+            }
+          }
+
+          if (blocks)
+          {
+            for (int i = 0; i < count; ++i)
+            {
+              const unsigned short* pair = &rowAmounts[0] + mColumnBlocks[x + i];
+              const unsigned weight = mColumnWeights[x + i];
+
+              amounts[i] = (unsigned short)((pair[0] * ((1 << AMOUNT_BITS) - weight) + pair[1] * weight +
+                                             (1 << (AMOUNT_BITS - 1))) >> AMOUNT_BITS);
+            }
+          }
+          else if (mpAmounts)
+          {
+            for (int i = 0; i < count; ++i)
+            {
+              unsigned brightness;
+
+              if (Channels == 1)
+              {
+                brightness = pixels[i];
+              }
+              else
+              {
+                // Use a fast approximation for brightness
+                // http://stackoverflow.com/questions/596216/formula-to-determine-brightness-of-rgb-color
+                const unsigned b = planes[0][i];
+                const unsigned g = planes[1][i];
+                const unsigned r = planes[2][i];
+
+                brightness = (r + r + r + b + g + g + g + g) >> 3;
+              }
+
+              amounts[i] = mpAmounts[brightness];
+            }
+          }
+
+          getInverseOpacities(alpha + wx, amounts, count, inverse);
+
+          if (Channels == 1)
+          {
+            blendPlane(pixels, colors[0] + wx, amounts, inverse, count);
+          }
+          else
+          {
+            // The alpha channel of BGRA images is left as is
+            for (int c = 0; c < 3; ++c)
+            {
+              blendPlane(planes[c], colors[c] + wx, amounts, inverse, count);
+            }
+
+            for (int i = 0; i < count; ++i)
+            {
+              pixels[i * Channels] = planes[0][i];
+              pixels[i * Channels + 1] = planes[1][i];
+              pixels[i * Channels + 2] = planes[2][i];
+            }
+          }
+        }
+      }
+    }
+  }
+}
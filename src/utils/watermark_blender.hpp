@@ -0,0 +1,126 @@
+#ifndef WATERMARK_BLENDER_HPP
+#define WATERMARK_BLENDER_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// Local
+#include "utils/watermark_cache.hpp"
+
+// Rows are blended in parallel in bands of at least this many bytes, so small
+// outputs stay on the calling thread
+// This can be overridden at build time
+#ifndef WATERMARK_BAND_BYTES
+#define WATERMARK_BAND_BYTES (64 * 1024)
+#endif
+
+// Side in pixels of the blocks adaptive_block watermarks average brightness over
+// This can be overridden at build time
+#ifndef WATERMARK_BLOCK_SIZE
+#define WATERMARK_BLOCK_SIZE 16
+#endif
+
+//------------------------------------------------------------------------------
+// Blends a watermark into 8-bit gray, BGR or BGRA images in place. It is placed
+// with its top left corner at an origin and either repeated from there over
+// the whole image (by default from the image's top left corner) or blended
+// once. The alpha channel of BGRA images is left as is.
+//
+// Each pixel gets the watermark's color with an opacity of its alpha times an
+// amount. The amount is either fixed or, for adaptive watermarks, a log curve
+// of the pixel's brightness between a minimum and a maximum:
+//
+//   amount = (maximum - minimum) * log10(1 + 9 * brightness / 255) + minimum
+//
+// so that watermarks stay visible without overwhelming dark areas. With
+// setBlocks() the brightness is the mean of the block of the image the pixel
+// is in, and amounts are interpolated between block centers, which is smoother
+// and cheaper per pixel. Blending uses 8 fractional bits, the curve is a table
+// by brightness and runs of fully transparent watermark pixels are skipped.
+// Pixels are blended in chunks of 32, 8 at a time with SSE2/NEON where the
+// build targets them.
+//
+// Rows are independent and are split in bands between OpenCV's threads, so the
+// kernel level of the thread budget applies (see ThreadBudget).
+//------------------------------------------------------------------------------
+class WatermarkBlender : boost::noncopyable
+{
+  public:
+
+    WatermarkBlender(const Watermark& watermark, double amount);
+    WatermarkBlender(const Watermark& watermark, double minimum, double maximum);
+
+    void setPosition(const cv::Point& origin, bool repeat);
+    void setBlocks(const cv::Mat& image, int blockSize);
+
+    void blend(cv::Mat& image, int firstRow, int lastRow) const;
+
+  private:
+
+    class RowBody;
+
+    template <int Channels>
+    void blendRows(cv::Mat& image, int firstRow, int lastRow) const;
+
+    void getRowAmounts(int row, unsigned short* amounts) const;
+
+    const Watermark& mWatermark;
+
+    cv::Point mOrigin;
+    bool mRepeat;
+
+    // Null for a fixed amount, otherwise the amount by brightness
+    const unsigned short* mpAmounts;
+    unsigned short mAmounts[256];
+
+    // Amounts by block when set, with a last column repeating the one before
+    // so that interpolation never reads past it
+    cv::Mat mBlockAmounts;
+    int mBlockSize;
+
+    // Block to the left of each image column and the weight of the next one
+    std::vector<int> mColumnBlocks;
+    std::vector<unsigned short> mColumnWeights;
+
+};
+
+#endif // WATERMARK_BLENDER_HPP
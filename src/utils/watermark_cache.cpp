@@ -0,0 +1,336 @@
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include "utils/watermark_cache.hpp"
+
+#include <vector>
+
+// Boost
+#include <boost/filesystem.hpp>
+
+// OpenCV
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+size_t Watermark::getBytes() const
+{
+  return alpha.total() + blue.total() + green.total() + red.total() + gray.total() +
+         (spans.size() + rowSpans.size()) * sizeof(int);
+}
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+WatermarkCache::WatermarkCache(size_t budgetBytes) :
+  mMutex(),
+  mBudgetBytes(budgetBytes),
+  mBytes(0),
+  mEntries(),
+  mIndex()
+{
+}
+
+//------------------------------------------------------------------------------
+// Process wide cache, so that watermarks outlive a job
+//------------------------------------------------------------------------------
+WatermarkCache& WatermarkCache::getShared()
+{
+  // Initialization of function statics is thread safe
+  static WatermarkCache cache(ARION_WATERMARK_CACHE_BYTES);
+
+  return cache;
+}
+
+//------------------------------------------------------------------------------
+// The watermark at path scaled to size, or as decoded if size is empty. Null
+// if it can't be read.
+//------------------------------------------------------------------------------
+boost::shared_ptr<const Watermark> WatermarkCache::get(const string& path, const cv::Size& size)
+{
+  const bool scaled = (size.width > 0) && (size.height > 0);
+  const Key key(path, scaled ? make_pair(size.width, size.height) : make_pair(0, 0));
+
+  boost::system::error_code error;
+
+  const time_t modified = boost::filesystem::last_write_time(path, error);
+
+  if (error)
+  {
+    return boost::shared_ptr<const Watermark>();
+  }
+
+  const size_t fileSize = (size_t)boost::filesystem::file_size(path, error);
+
+  if (error)
+  {
+    return boost::shared_ptr<const Watermark>();
+  }
+
+  boost::shared_ptr<Entry> entry;
+
+  {
+    boost::mutex::scoped_lock lock(mMutex);
+
+    map<Key, Entries::iterator>::iterator found = mIndex.find(key);
+
+    if (found != mIndex.end())
+    {
+      if (((*found->second)->modified == modified) && ((*found->second)->fileSize == fileSize))
+      {
+        entry = *found->second;
+
+        // Now the most recently used
+        mEntries.splice(mEntries.begin(), mEntries, found->second);
+      }
+      else
+      {
+        // The file has changed since it was decoded
+        remove(*found->second);
+      }
+    }
+
+    if (!entry)
+    {
+      entry.reset(new Entry());
+      entry->key = key;
+      entry->modified = modified;
+      entry->fileSize = fileSize;
+
+      mEntries.push_front(entry);
+      mIndex[key] = mEntries.begin();
+    }
+  }
+
+  boost::mutex::scoped_lock entryLock(entry->mutex);
+
+  if (!entry->done)
+  {
+    if (scaled)
+    {
+      // Scaled from the decoded watermark, which is cached on its own
+      const boost::shared_ptr<const Watermark> watermark = get(path);
+
+      if (watermark)
+      {
+        entry->watermark = scale(*watermark, cv::Size(key.second.first, key.second.second));
+      }
+    }
+    else
+    {
+      entry->watermark = prepare(cv::imread(path, cv::IMREAD_UNCHANGED));
+    }
+
+    entry->done = true;
+
+    boost::mutex::scoped_lock lock(mMutex);
+
+    map<Key, Entries::iterator>::iterator found = mIndex.find(key);
+
+    // Unless it was replaced or evicted while decoding
+    if ((found != mIndex.end()) && (*found->second == entry))
+    {
+      if (entry->watermark)
+      {
+        entry->bytes = entry->watermark->getBytes();
+        mBytes += entry->bytes;
+
+        evict();
+      }
+      else
+      {
+        // Try again next time
+        remove(entry);
+      }
+    }
+  }
+
+  return entry->watermark;
+}
+
+//------------------------------------------------------------------------------
+// Premultiply and split a decoded watermark (8 or 16 bit gray, BGR or BGRA).
+// Watermarks without an alpha channel are opaque.
+//------------------------------------------------------------------------------
+boost::shared_ptr<const Watermark> WatermarkCache::prepare(const cv::Mat& image)
+{
+  if (image.empty())
+  {
+    return boost::shared_ptr<const Watermark>();
+  }
+
+  cv::Mat bgra = image;
+
+  if (bgra.depth() == CV_16U)
+  {
+    bgra.convertTo(bgra, CV_8U, 1.0 / 257.0);
+  }
+  else if (bgra.depth() != CV_8U)
+  {
+    return boost::shared_ptr<const Watermark>();
+  }
+
+  if (bgra.channels() == 1)
+  {
+    cv::cvtColor(bgra, bgra, cv::COLOR_GRAY2BGRA);
+  }
+  else if (bgra.channels() == 3)
+  {
+    cv::cvtColor(bgra, bgra, cv::COLOR_BGR2BGRA);
+  }
+
+  boost::shared_ptr<Watermark> watermark(new Watermark());
+
+  vector<cv::Mat> planes;
+  cv::split(bgra, planes);
+
+  cv::Mat gray;
+  cv::cvtColor(bgra, gray, cv::COLOR_BGRA2GRAY);
+
+  watermark->alpha = planes[3];
+
+  cv::multiply(planes[0], planes[3], watermark->blue, 1.0 / 255.0);
+  cv::multiply(planes[1], planes[3], watermark->green, 1.0 / 255.0);
+  cv::multiply(planes[2], planes[3], watermark->red, 1.0 / 255.0);
+  cv::multiply(gray, planes[3], watermark->gray, 1.0 / 255.0);
+
+  findSpans(watermark->alpha, watermark->spans, watermark->rowSpans);
+
+  return watermark;
+}
+
+//------------------------------------------------------------------------------
+// Resize each plane of a prepared watermark. The colors are premultiplied, so
+// they can be filtered like the alpha without dark fringes.
+//------------------------------------------------------------------------------
+boost::shared_ptr<const Watermark> WatermarkCache::scale(const Watermark& watermark, const cv::Size& size)
+{
+  if (watermark.alpha.empty() || (size.width <= 0) || (size.height <= 0))
+  {
+    return boost::shared_ptr<const Watermark>();
+  }
+
+  const bool shrink = (size.width < watermark.alpha.cols) || (size.height < watermark.alpha.rows);
+  const int interpolation = shrink ? cv::INTER_AREA : cv::INTER_LINEAR;
+
+  boost::shared_ptr<Watermark> scaled(new Watermark());
+
+  cv::resize(watermark.alpha, scaled->alpha, size, 0, 0, interpolation);
+  cv::resize(watermark.blue, scaled->blue, size, 0, 0, interpolation);
+  cv::resize(watermark.green, scaled->green, size, 0, 0, interpolation);
+  cv::resize(watermark.red, scaled->red, size, 0, 0, interpolation);
+  cv::resize(watermark.gray, scaled->gray, size, 0, 0, interpolation);
+
+  // Rounding may leave a color above its alpha, which the blender does not
+  // expect of premultiplied colors
+  cv::min(scaled->blue, scaled->alpha, scaled->blue);
+  cv::min(scaled->green, scaled->alpha, scaled->green);
+  cv::min(scaled->red, scaled->alpha, scaled->red);
+  cv::min(scaled->gray, scaled->alpha, scaled->gray);
+
+  findSpans(scaled->alpha, scaled->spans, scaled->rowSpans);
+
+  return scaled;
+}
+
+//------------------------------------------------------------------------------
+// Runs of columns with a non-zero alpha in each row, see Watermark
+//------------------------------------------------------------------------------
+void WatermarkCache::findSpans(const cv::Mat& alpha, vector<int>& spans, vector<int>& rowSpans)
+{
+  spans.clear();
+  rowSpans.assign(1, 0);
+
+  for (int y = 0; y < alpha.rows; ++y)
+  {
+    const unsigned char* row = alpha.ptr<unsigned char>(y);
+
+    const size_t rowStart = spans.size();
+
+    for (int x = 0; x < alpha.cols; ++x)
+    {
+      if (!row[x])
+      {
+        continue;
+      }
+
+      const int begin = x;
+
+      while ((x < alpha.cols) && row[x])
+      {
+        x++;
+      }
+
+      // Join the previous run across a short gap
+      if ((spans.size() > rowStart) && (begin - spans.back() < WATERMARK_SPAN_GAP))
+      {
+        spans.back() = x;
+      }
+      else
+      {
+        spans.push_back(begin);
+        spans.push_back(x);
+      }
+    }
+
+    rowSpans.push_back((int)spans.size());
+  }
+}
+
+//------------------------------------------------------------------------------
+// Must be called with mMutex held
+//------------------------------------------------------------------------------
+void WatermarkCache::remove(const boost::shared_ptr<Entry>& entry)
+{
+  map<Key, Entries::iterator>::iterator found = mIndex.find(entry->key);
+
+  mBytes -= entry->bytes;
+
+  mEntries.erase(found->second);
+  mIndex.erase(found);
+}
+
+//------------------------------------------------------------------------------
+// Drop least recently used entries until the cache is within budget. Callers
+// still holding a watermark keep it. Must be called with mMutex held.
+//------------------------------------------------------------------------------
+void WatermarkCache::evict()
+{
+  while ((mBytes > mBudgetBytes) && !mEntries.empty())
+  {
+    remove(mEntries.back());
+  }
+}
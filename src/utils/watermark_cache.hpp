@@ -0,0 +1,146 @@
+#ifndef WATERMARK_CACHE_HPP
+#define WATERMARK_CACHE_HPP
+
+//------------------------------------------------------------------------------
+//
+// Copyright (c) 2015-2016 Paul Filitchkin, Snapwire
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in
+//      the documentation and/or other materials provided with the
+//      distribution.
+//
+//    * Neither the name of the organization nor the names of its contributors
+//      may be used to endorse or promote products derived from this software
+//      without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//------------------------------------------------------------------------------
+
+
+#include <ctime>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Boost
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+// OpenCV
+#include <opencv2/core/core.hpp>
+
+// Decoded watermarks kept by the shared cache, in bytes
+// This can be overridden at build time
+#ifndef ARION_WATERMARK_CACHE_BYTES
+#define ARION_WATERMARK_CACHE_BYTES (64 * 1024 * 1024)
+#endif
+
+// Transparent gaps in a watermark row shorter than this many pixels are
+// blended rather than skipped
+// This can be overridden at build time
+#ifndef WATERMARK_SPAN_GAP
+#define WATERMARK_SPAN_GAP 32
+#endif
+
+//------------------------------------------------------------------------------
+// A watermark ready for blending. Each plane is 8 bit and has the size of the
+// watermark: its alpha, and its blue, green, red and luminance (for grayscale
+// outputs) premultiplied by alpha, i.e. value * alpha / 255.
+//
+// The columns of row r that are not fully transparent are the [begin, end)
+// pairs in spans[rowSpans[r]] up to spans[rowSpans[r + 1]].
+//------------------------------------------------------------------------------
+struct Watermark
+{
+  size_t getBytes() const;
+
+  cv::Mat alpha;
+  cv::Mat blue;
+  cv::Mat green;
+  cv::Mat red;
+  cv::Mat gray;
+
+  std::vector<int> spans;
+  std::vector<int> rowSpans;
+};
+
+//------------------------------------------------------------------------------
+// Watermarks by path and size. A file is decoded once, and scaled once to each
+// size it is asked for, and kept until it changes (its modification time or
+// size differs) or it is evicted, least recently used first, to stay within
+// the byte budget. The first caller to ask for a file at a size prepares it
+// while the others wait.
+//------------------------------------------------------------------------------
+class WatermarkCache : boost::noncopyable
+{
+  public:
+
+    explicit WatermarkCache(size_t budgetBytes);
+
+    static WatermarkCache& getShared();
+
+    boost::shared_ptr<const Watermark> get(const std::string& path, const cv::Size& size = cv::Size());
+
+    static boost::shared_ptr<const Watermark> prepare(const cv::Mat& image);
+    static boost::shared_ptr<const Watermark> scale(const Watermark& watermark, const cv::Size& size);
+
+  private:
+
+    // Path and size, an empty size for the watermark as decoded
+    typedef std::pair<std::string, std::pair<int, int> > Key;
+
+    static void findSpans(const cv::Mat& alpha, std::vector<int>& spans, std::vector<int>& rowSpans);
+
+    struct Entry
+    {
+      Entry() : modified(0), fileSize(0), bytes(0), done(false) {}
+
+      boost::mutex mutex;
+
+      Key key;
+      std::time_t modified;
+      size_t fileSize;
+      size_t bytes;
+
+      // Null if the file could not be decoded
+      boost::shared_ptr<const Watermark> watermark;
+      bool done;
+    };
+
+    typedef std::list<boost::shared_ptr<Entry> > Entries;
+
+    void remove(const boost::shared_ptr<Entry>& entry);
+    void evict();
+
+    boost::mutex mMutex;
+    size_t mBudgetBytes;
+    size_t mBytes;
+
+    // Most recently used first, mIndex points into it by key
+    Entries mEntries;
+    std::map<Key, Entries::iterator> mIndex;
+
+};
+
+#endif // WATERMARK_CACHE_HPP
@@ -2,13 +2,19 @@
 # -*- coding: utf-8 -*-
 
 import os
+import math
+import struct
 import unittest
 import json
+import zlib
+import ctypes
+import threading
 from subprocess import Popen, PIPE
 
 class TestArion(unittest.TestCase):
 
   ARION_PATH = '../../build/arion'
+  CARION_PATH = '../../build/libcarion.so'
   
   # Images for general purpose testing (leave off file:// for testing)
   IMAGE_1_PATH = '../../examples/images/image-1.jpg'
@@ -27,17 +33,24 @@ class TestArion(unittest.TestCase):
   LANDSCAPE_7_PATH = 'file://../images/Landscape_7.jpg'
   LANDSCAPE_8_PATH = 'file://../images/Landscape_8.jpg'
   
+  # Baseline JPEG with restart markers, see test_parallel_decode
+  RESTART_INTERVAL_PATH = 'file://../images/restart_interval.jpg'
+
   OUTPUT_IMAGE_PATH = 'output/'
 
   # -------------------------------------------------------------------------------
   #  Helper function for calling Arion
   # -------------------------------------------------------------------------------
-  def call_arion(self, input_url, operations):
+  def call_arion(self, input_url, operations, options=None):
 
     input_dict = {'input_url':        input_url,
                   'correct_rotation': True,
                   'operations':       operations}
 
+    # Additional job level options
+    if options:
+      input_dict.update(options)
+
     input_string = json.dumps(input_dict, separators=(',', ':'))
 
     p = Popen([self.ARION_PATH, "--input", input_string], stdout=PIPE)
@@ -101,6 +114,80 @@ class TestArion(unittest.TestCase):
     self.assertEqual(output['failed_operations'], 1)
     self.assertEqual(output['total_operations'], 1)
  
+  # -------------------------------------------------------------------------------
+  #  Helper function for reading the pixels of an 8-bit, non-interlaced PNG
+  #  (as written by Arion). Returns width, height, channels and the pixel bytes.
+  # -------------------------------------------------------------------------------
+  def read_png_pixels(self, path):
+
+    with open(path, 'rb') as f:
+      data = f.read()
+
+    channels_by_color_type = {0: 1, 2: 3, 4: 2, 6: 4}
+
+    position = 8
+    compressed = b''
+
+    while position < len(data):
+      length, chunk_type = struct.unpack('>I4s', data[position:position + 8])
+      chunk = data[position + 8:position + 8 + length]
+
+      if chunk_type == b'IHDR':
+        width, height, depth, color_type, _, _, interlace = struct.unpack('>IIBBBBB', chunk)
+        self.assertEqual(depth, 8)
+        self.assertEqual(interlace, 0)
+        channels = channels_by_color_type[color_type]
+      elif chunk_type == b'IDAT':
+        compressed += chunk
+
+      position += 12 + length
+
+    raw = bytearray(zlib.decompress(compressed))
+    stride = width * channels
+    pixels = bytearray(stride * height)
+    previous = bytearray(stride)
+
+    # Undo the per row filters
+    for y in range(height):
+      filter_type = raw[y * (stride + 1)]
+      row = raw[y * (stride + 1) + 1:(y + 1) * (stride + 1)]
+
+      for x in range(stride):
+        a = row[x - channels] if x >= channels else 0
+        b = previous[x]
+        c = previous[x - channels] if x >= channels else 0
+
+        if filter_type == 1:
+          row[x] = (row[x] + a) & 0xFF
+        elif filter_type == 2:
+          row[x] = (row[x] + b) & 0xFF
+        elif filter_type == 3:
+          row[x] = (row[x] + ((a + b) >> 1)) & 0xFF
+        elif filter_type == 4:
+          p = a + b - c
+          pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+          predictor = a if (pa <= pb and pa <= pc) else (b if pb <= pc else c)
+          row[x] = (row[x] + predictor) & 0xFF
+
+      pixels[y * stride:(y + 1) * stride] = row
+      previous = row
+
+    return width, height, channels, pixels
+
+  # -------------------------------------------------------------------------------
+  #  Helper function for computing the PSNR (dB) between two equal sized images
+  # -------------------------------------------------------------------------------
+  def psnr(self, a, b):
+
+    self.assertEqual(len(a), len(b))
+
+    squared_error = sum((x - y) * (x - y) for x, y in zip(a, b))
+
+    if squared_error == 0:
+      return float('inf')
+
+    return 10.0 * math.log10(255.0 * 255.0 * len(a) / squared_error)
+
   # -------------------------------------------------------------------------------
   #  Helper function for creating output url
   # -------------------------------------------------------------------------------
@@ -1046,6 +1133,40 @@ class TestArion(unittest.TestCase):
 
     #self.verifySuccess(output, 200, 200);
     
+  # -------------------------------------------------------------------------------
+  # Crops from opposite sides of rotated sources. Only the union of the crop
+  # regions gets decoded, mapped back through the EXIF orientation.
+  # -------------------------------------------------------------------------------
+  def test_resize_fill_region_decode(self):
+
+    for index, path in enumerate([self.LANDSCAPE_1_PATH, self.LANDSCAPE_6_PATH, self.LANDSCAPE_8_PATH]):
+
+      operations = []
+
+      for gravity in ['west', 'east']:
+        operations.append({
+          'type': 'resize',
+          'params':
+          {
+            'width':      100,
+            'height':     300,
+            'type':       'fill',
+            'gravity':    gravity,
+            'output_url': self.outputUrlHelper('test_region_decode_' + str(index) + '_' + gravity + '.jpg')
+          }
+        })
+
+      output = self.call_arion(path, operations)
+
+      self.assertTrue(output['result'])
+      self.assertEqual(output['failed_operations'], 0)
+      self.assertEqual(output['width'], 600)
+      self.assertEqual(output['height'], 450)
+
+      for gravity in ['west', 'east']:
+        output = self.read_image(self.outputUrlHelper('test_region_decode_' + str(index) + '_' + gravity + '.jpg'))
+        self.verifySuccess(output, 100, 300)
+
   # -------------------------------------------------------------------------------
   # -------------------------------------------------------------------------------
   def test_basic_read_meta(self):
@@ -1086,7 +1207,194 @@ class TestArion(unittest.TestCase):
     self.assertTrue("roadtrip" in keywords)
     self.assertTrue("sea" in keywords)
     self.assertTrue("sunset" in keywords)
-  
+
+  # -------------------------------------------------------------------------------
+  # Sharpening and watermarking run together over tiles of rows. The result must
+  # match sharpening the whole image first and watermarking it afterwards (here a
+  # second job on the sharpened PNG, which is already the requested size).
+  # -------------------------------------------------------------------------------
+  def test_sharpen_watermark_tiles(self):
+
+    sharpen = {
+      'sharpen_amount':    150,
+      'sharpen_radius':    1.0,
+      'sharpen_threshold': 5
+    }
+
+    for watermark_type in ['standard', 'adaptive']:
+      watermark = {
+        'watermark_url':    '../images/watermark.png',
+        'watermark_type':   watermark_type,
+        'watermark_amount': 0.4,
+        'watermark_min':    0.2,
+        'watermark_max':    0.6
+      }
+
+      def resize(input_url, name, width, height, params):
+        operation = {
+          'type': 'resize',
+          'params': {
+            'width':      width,
+            'height':     height,
+            'type':       'fill',
+            'output_url': self.outputUrlHelper('test_sharpen_watermark_tiles_' + name + '.png')
+          }
+        }
+
+        operation['params'].update(params)
+
+        output = self.call_arion(input_url, [operation])
+
+        self.assertTrue(output['result'])
+
+        return self.read_png_pixels(self.outputUrlHelper('test_sharpen_watermark_tiles_' + name + '.png'))
+
+      params = dict(sharpen)
+      params.update(watermark)
+
+      fused = resize(self.IMAGE_1_PATH, 'fused', 800, 533, params)
+      sharpened = resize(self.IMAGE_1_PATH, 'sharpened', 800, 533, sharpen)
+      separate = resize(self.outputUrlHelper('test_sharpen_watermark_tiles_sharpened.png'), 'separate', 800, 533, watermark)
+
+      self.assertEqual(fused[0:3], (800, 533, 3))
+      self.assertEqual(fused, separate)
+      self.assertNotEqual(fused, sharpened)
+
+  # -------------------------------------------------------------------------------
+  # Metadata is parsed on a helper thread while resizes write XMP to their
+  # outputs, the keywords must not change
+  # -------------------------------------------------------------------------------
+  def test_read_meta_concurrent_xmp(self):
+
+    expected = ['Adriatic Sea', 'Balkans', 'Croatia', 'Europe', 'island',
+                'outdoors', 'road', 'roadtrip', 'sea', 'sunset']
+
+    operations = [
+      {
+        'type': 'read_meta',
+        'params': {
+          'info': True
+        }
+      }
+    ]
+
+    for index in range(4):
+      operations.append({
+        'type': 'resize',
+        'params': {
+          'width':         200 + 100 * index,
+          'height':        200,
+          'type':          'width',
+          'preserve_meta': True,
+          'output_url':    self.outputUrlHelper('test_read_meta_concurrent_xmp_' + str(index) + '.jpg')
+        }
+      })
+
+    for attempt in range(3):
+      output = self.call_arion(self.IMAGE_1_PATH, operations)
+
+      self.assertTrue(output['result'])
+      self.assertEqual(output['failed_operations'], 0)
+      self.assertEqual(sorted(output['info'][0]['keywords']), expected)
+
+    # The outputs inherited the XMP packet
+    for index in range(4):
+      output = self.read_image(self.outputUrlHelper('test_read_meta_concurrent_xmp_' + str(index) + '.jpg'))
+
+      self.assertEqual(sorted(output['info'][0]['keywords']), expected)
+
+  # -------------------------------------------------------------------------------
+  # Regular input files are memory mapped, anything else (here a named pipe) is
+  # read into memory instead. Pixels and metadata come out the same either way.
+  # -------------------------------------------------------------------------------
+  def test_input_file_mapping(self):
+
+    operations = [
+      {
+        'type': 'fingerprint',
+        'params': {
+          'type': 'md5'
+        }
+      },
+      {
+        'type': 'read_meta',
+        'params': {
+          'info': True
+        }
+      }
+    ]
+
+    pipe_path = self.outputUrlHelper('test_input_file_mapping.jpg')
+
+    if os.path.exists(pipe_path):
+      os.remove(pipe_path)
+
+    os.mkfifo(pipe_path)
+
+    def write_pipe():
+      with open(self.IMAGE_1_PATH, 'rb') as source:
+        with open(pipe_path, 'wb') as pipe:
+          pipe.write(source.read())
+
+    writer = threading.Thread(target=write_pipe)
+    writer.start()
+
+    try:
+      outputs = [self.call_arion(self.IMAGE_1_PATH, operations),
+                 self.call_arion(pipe_path, operations)]
+    finally:
+      # Unblocks the writer if arion never opened the pipe
+      if writer.is_alive():
+        open(pipe_path, 'rb').close()
+
+      writer.join()
+      os.remove(pipe_path)
+
+    for output in outputs:
+      self.assertTrue(output['result'])
+      self.assertEqual((output['width'], output['height']), (1296, 864))
+      self.assertEqual(output['info'][0]['md5'], 'c8d342a627da420e77c2e90a10f75689')
+      self.assertTrue('Croatia' in output['info'][1]['keywords'])
+
+  # -------------------------------------------------------------------------------
+  # Jobs that never look at pixels get their dimensions from the container header
+  # -------------------------------------------------------------------------------
+  def test_metadata_only_job(self):
+
+    output_url = self.outputUrlHelper('test_metadata_only_job.jpg')
+
+    operations = [
+      {
+        'type': 'read_meta',
+        'params': {
+          'info': True
+        }
+      },
+      {
+        'type': 'copy',
+        'params': {
+          'output_url': output_url
+        }
+      }
+    ]
+
+    output = self.call_arion(self.LANDSCAPE_6_PATH, operations)
+
+    self.assertTrue(output['result'])
+    self.assertEqual(output['failed_operations'], 0)
+    self.assertEqual(output['total_operations'], 2)
+    self.assertEqual(output['width'], 600)
+    self.assertEqual(output['height'], 450)
+
+    output = self.read_image(output_url)
+
+    self.verifySuccess(output, 600, 450)
+
+    # Non-JPEG sources fall back to the dimensions found by Exiv2
+    output = self.read_image('../../examples/images/watermark.png')
+
+    self.verifySuccess(output, 1000, 1000)
+
   # -------------------------------------------------------------------------------
   # -------------------------------------------------------------------------------
   def test_jpg_orienation(self):
@@ -1256,6 +1564,884 @@ class TestArion(unittest.TestCase):
     }
     self.verifyFailure(self.call_arion(self.IMAGE_1_PATH, [operation]))
 
+  # -------------------------------------------------------------------------------
+  # image-1.jpg has a 256x171 EXIF thumbnail which can only be used for smaller
+  # outputs and only if the job allows it
+  # -------------------------------------------------------------------------------
+  def test_allow_preview(self):
+
+    for width, allow_preview, source in [(200, True, 'preview'),
+                                         (200, False, 'image'),
+                                         (400, True, 'image')]:
+
+      output_url = self.outputUrlHelper('test_allow_preview_' + str(width) + '.jpg')
+
+      operation = {
+        'type': 'resize',
+        'params':
+        {
+          'width':      width,
+          'height':     width,
+          'type':       'width',
+          'output_url': output_url
+        }
+      }
+
+      output = self.call_arion(self.IMAGE_1_PATH, [operation], {'allow_preview': allow_preview})
+
+      self.verifySuccess(output, 1296, 864)
+      self.assertEqual(output['decode_source'], source)
+
+      output = self.read_image(output_url)
+
+      self.verifySuccess(output, width, int(round(width * 864.0 / 1296.0)))
+
+  # -------------------------------------------------------------------------------
+  # image-1.jpg has EXIF data but no orientation tag, and resizes without
+  # preserve_meta don't need metadata. Previews are found through the metadata,
+  # so it still has to be read when they are allowed.
+  # -------------------------------------------------------------------------------
+  def test_allow_preview_without_metadata(self):
+
+    operations = [{
+      'type': 'resize',
+      'params':
+      {
+        'width':      width,
+        'height':     width,
+        'type':       'width',
+        'output_url': self.outputUrlHelper('test_allow_preview_metadata_' + str(width) + '.jpg')
+      }
+    } for width in [200, 150]]
+
+    output = self.call_arion(self.IMAGE_1_PATH, operations, {'allow_preview': True})
+
+    self.assertTrue(output['result'])
+    self.assertEqual(output['failed_operations'], 0)
+    self.assertEqual(output['decode_source'], 'preview')
+
+    for width in [200, 150]:
+      output = self.read_image(self.outputUrlHelper('test_allow_preview_metadata_' + str(width) + '.jpg'))
+
+      self.verifySuccess(output, width, int(round(width * 864.0 / 1296.0)))
+
+  # -------------------------------------------------------------------------------
+  # -------------------------------------------------------------------------------
+  def test_decode_speed(self):
+
+    pixels = {}
+
+    for decode_speed in ['fast', 'accurate']:
+
+      output_url = self.outputUrlHelper('test_decode_speed_' + decode_speed + '.png')
+
+      # Large enough that the JPEG is decoded at full scale, where the fast
+      # IDCT is used
+      operation = {
+        'type': 'resize',
+        'params':
+        {
+          'width':      1000,
+          'height':     1000,
+          'type':       'width',
+          'output_url': output_url
+        }
+      }
+
+      output = self.call_arion(self.IMAGE_1_PATH, [operation], {'decode_speed': decode_speed})
+
+      self.verifySuccess(output, 1296, 864)
+
+      pixels[decode_speed] = self.read_png_pixels(output_url)
+
+    # The fast decode is not exact, but close
+    self.assertEqual(pixels['fast'][0:3], pixels['accurate'][0:3])
+    self.assertNotEqual(pixels['fast'][3], pixels['accurate'][3])
+    self.assertGreater(self.psnr(pixels['fast'][3], pixels['accurate'][3]), 40.0)
+
+    # Fingerprints always hash an accurate decode
+    fingerprint = {'type': 'fingerprint', 'params': {'type': 'md5'}}
+
+    output = self.call_arion(self.IMAGE_1_PATH, [fingerprint], {'decode_speed': 'fast'})
+
+    self.assertEqual(output['info'][0]['md5'], 'c8d342a627da420e77c2e90a10f75689')
+
+  # -------------------------------------------------------------------------------
+  # Large JPEGs with restart markers are decoded in bands on several threads. The
+  # fixture (2449x1637, 4:2:0, a restart interval per MCU row) is large enough
+  # for that and its height is not a multiple of the 16 row MCU. The result must
+  # be identical to a serial decode, forced here with a budget of one thread.
+  # -------------------------------------------------------------------------------
+  def test_parallel_decode(self):
+
+    outputs = {}
+
+    for mode in ['parallel', 'serial']:
+      output_url = self.outputUrlHelper('test_parallel_decode_' + mode + '.png')
+
+      operations = [
+        {
+          'type': 'fingerprint',
+          'params': {
+            'type': 'md5'
+          }
+        },
+        {
+          'type': 'resize',
+          'params': {
+            'width':      2400,
+            'height':     2400,
+            'type':       'width',
+            'output_url': output_url
+          }
+        }
+      ]
+
+      options = {'thread_budget': {'threads': 1}} if mode == 'serial' else None
+
+      output = self.call_arion(self.RESTART_INTERVAL_PATH, operations, options)
+
+      self.assertTrue(output['result'])
+      self.assertEqual(output['failed_operations'], 0)
+      self.assertEqual((output['width'], output['height']), (2449, 1637))
+
+      if (mode == 'parallel') and (output['thread_allocation']['kernel'] < 2):
+        self.skipTest('Parallel decoding needs at least two threads')
+
+      with open(output_url, 'rb') as f:
+        outputs[mode] = (output['info'][0]['md5'], f.read())
+
+    self.assertEqual(outputs['parallel'][0], outputs['serial'][0])
+    self.assertTrue(outputs['parallel'][1] == outputs['serial'][1])
+
+  # -------------------------------------------------------------------------------
+  # A low streaming threshold makes the decode go through the band downscaler
+  # (the JPEG is decoded at 1/2 scale, 648x432, and streamed down to what the
+  # resize needs), which must stay close to a resize of the full decode
+  # -------------------------------------------------------------------------------
+  def test_streaming_decode(self):
+
+    outputs = {}
+
+    for name, threshold in [('streaming', 100000), ('full', 0)]:
+      output_url = self.outputUrlHelper('test_streaming_decode_' + name + '.png')
+
+      operation = {
+        'type': 'resize',
+        'params': {
+          'width':      500,
+          'height':     500,
+          'type':       'width',
+          'output_url': output_url
+        }
+      }
+
+      output = self.call_arion(self.IMAGE_1_PATH, [operation], {'streaming_decode_pixels': threshold})
+
+      self.verifySuccess(output, 1296, 864)
+
+      outputs[name] = self.read_png_pixels(output_url)
+
+    self.assertEqual(outputs['streaming'][0:3], outputs['full'][0:3])
+    self.assertGreater(self.psnr(outputs['streaming'][3], outputs['full'][3]), 35.0)
+
+  # -------------------------------------------------------------------------------
+  # Several small outputs let the JPEG be decoded at a reduced resolution, but the
+  # reported source dimensions and output dimensions must not change
+  # -------------------------------------------------------------------------------
+  def test_reduced_resolution_decode(self):
+
+    operations = []
+
+    for width in [100, 320, 640]:
+      operations.append({
+        'type': 'resize',
+        'params':
+        {
+          'width':      width,
+          'height':     width,
+          'type':       'fill',
+          'output_url': self.outputUrlHelper('test_reduced_decode_' + str(width) + '.jpg')
+        }
+      })
+
+    output = self.call_arion(self.IMAGE_1_PATH, operations)
+
+    self.assertTrue(output['result'])
+    self.assertEqual(output['failed_operations'], 0)
+    self.assertEqual(output['total_operations'], 3)
+    self.assertEqual(output['width'], 1296)
+    self.assertEqual(output['height'], 864)
+
+    for width in [100, 320, 640]:
+      output = self.read_image(self.outputUrlHelper('test_reduced_decode_' + str(width) + '.jpg'))
+      self.verifySuccess(output, width, width)
+
+  # -------------------------------------------------------------------------------
+  # Landscape_6 is stored in portrait and rotated by its EXIF orientation
+  # -------------------------------------------------------------------------------
+  def test_jpg_orientation_resize(self):
+
+    output_url = self.outputUrlHelper('test_jpg_orientation_resize.jpg')
+
+    operation = {
+      'type': 'resize',
+      'params':
+      {
+        'width':      300,
+        'height':     1000,
+        'type':       'width',
+        'output_url': output_url
+      }
+    }
+
+    output = self.call_arion(self.LANDSCAPE_6_PATH, [operation])
+
+    self.verifySuccess(output, 600, 450)
+
+    output = self.read_image(output_url)
+
+    self.verifySuccess(output, 300, 225)
+
+  # -------------------------------------------------------------------------------
+  # Resizes rotate their own outputs instead of the source, which gives the same
+  # result as rotating the source (forced here by a fingerprint, which needs
+  # the upright source), including the crop gravity
+  # -------------------------------------------------------------------------------
+  def test_orientation_after_resize(self):
+
+    paths = [self.LANDSCAPE_1_PATH, self.LANDSCAPE_2_PATH, self.LANDSCAPE_3_PATH,
+             self.LANDSCAPE_4_PATH, self.LANDSCAPE_5_PATH, self.LANDSCAPE_6_PATH,
+             self.LANDSCAPE_7_PATH, self.LANDSCAPE_8_PATH]
+
+    def operation(name):
+      return {
+        'type': 'resize',
+        'params':
+        {
+          'width':      200,
+          'height':     100,
+          'type':       'fill',
+          'gravity':    'northwest',
+          'output_url': self.outputUrlHelper('test_orientation_after_resize_' + name + '.png')
+        }
+      }
+
+    fingerprint = {'type': 'fingerprint', 'params': {'type': 'md5'}}
+
+    upright = None
+
+    for index, path in enumerate(paths):
+      name = str(index + 1)
+
+      output = self.call_arion(path, [operation(name)])
+      self.assertTrue(output['result'])
+
+      output = self.call_arion(path, [operation(name + '_rotated'), fingerprint])
+      self.assertTrue(output['result'])
+
+      deferred = self.read_png_pixels(self.outputUrlHelper('test_orientation_after_resize_' + name + '.png'))
+      rotated = self.read_png_pixels(self.outputUrlHelper('test_orientation_after_resize_' + name + '_rotated.png'))
+
+      self.assertEqual(deferred[0:2], (200, 100))
+      self.assertEqual(deferred[0:3], rotated[0:3])
+      self.assertGreater(self.psnr(deferred[3], rotated[3]), 40.0)
+
+      # Every orientation of the test image ends up the same way up
+      if upright is None:
+        upright = deferred
+      else:
+        self.assertGreater(self.psnr(deferred[3], upright[3]), 25.0)
+
+  # -------------------------------------------------------------------------------
+  # Grayscale inputs stay single channel and alpha is kept, which shows up in the
+  # color type of the PNG IHDR chunk (0 = gray, 6 = RGBA)
+  # -------------------------------------------------------------------------------
+  def test_native_channels(self):
+
+    for input_url, name, color_type in [('file://../images/gray_input.jpg', 'gray', 0),
+                                        ('file://../images/watermark.png', 'alpha', 6)]:
+
+      output_url = self.outputUrlHelper('test_native_channels_' + name + '.png')
+
+      operation = {
+        'type': 'resize',
+        'params':
+        {
+          'width':         200,
+          'height':        200,
+          'type':          'width',
+          'watermark_url': '../images/watermark2.png',
+          'output_url':    output_url
+        }
+      }
+
+      output = self.call_arion(input_url, [operation])
+
+      self.verifySuccess(output)
+
+      with open(output_url, 'rb') as f:
+        header = f.read(26)
+
+      self.assertEqual(ord(header[25]), color_type)
+
+  # -------------------------------------------------------------------------------
+  # Smaller outputs are resized from larger results of the same job. They must
+  # report which result they came from and stay visually identical to a direct
+  # resize of the source.
+  # -------------------------------------------------------------------------------
+  def test_resize_cascade(self):
+
+    widths = [600, 280, 120]
+
+    def operations(prefix):
+      return [{
+        'type': 'resize',
+        'params':
+        {
+          'width':      width,
+          'height':     width,
+          'type':       'width',
+          'output_url': self.outputUrlHelper(prefix + str(width) + '.png')
+        }
+      } for width in widths]
+
+    output = self.call_arion(self.IMAGE_1_PATH, operations('test_cascade_'))
+
+    self.assertTrue(output['result'])
+    self.assertEqual(output['total_operations'], 3)
+
+    derived_from = [info['derived_from'] for info in output['info']]
+    self.assertEqual(derived_from, ['source', 0, 1])
+
+    output = self.call_arion(self.IMAGE_1_PATH, operations('test_cascade_direct_'),
+                             {'resize_cascade_factor': 0})
+
+    self.assertTrue(output['result'])
+
+    derived_from = [info['derived_from'] for info in output['info']]
+    self.assertEqual(derived_from, ['source', 'source', 'source'])
+
+    for width in widths:
+      cascade = self.read_png_pixels(self.outputUrlHelper('test_cascade_' + str(width) + '.png'))
+      direct = self.read_png_pixels(self.outputUrlHelper('test_cascade_direct_' + str(width) + '.png'))
+
+      self.assertEqual(cascade[0:3], direct[0:3])
+      self.assertGreater(self.psnr(cascade[3], direct[3]), 35.0)
+
+  # -------------------------------------------------------------------------------
+  # A resize never starts from a result that was filtered differently, e.g. a
+  # plain output from a pre-filtered one
+  # -------------------------------------------------------------------------------
+  def test_resize_cascade_filters(self):
+
+    operations = [{
+      'type': 'resize',
+      'params':
+      {
+        'width':      width,
+        'height':     width,
+        'type':       'width',
+        'pre_filter': pre_filter,
+        'output_url': self.outputUrlHelper('test_cascade_filters_' + str(width) + '.png')
+      }
+    } for width, pre_filter in [(600, True), (280, False), (120, True)]]
+
+    output = self.call_arion(self.IMAGE_1_PATH, operations)
+
+    self.assertTrue(output['result'])
+
+    derived_from = [info['derived_from'] for info in output['info']]
+    self.assertEqual(derived_from, ['source', 'source', 0])
+
+  # -------------------------------------------------------------------------------
+  # Each resampling filter gives an image close to the default INTER_AREA resize,
+  # an unknown filter falls back to the default
+  # -------------------------------------------------------------------------------
+  def test_resize_filters(self):
+
+    filters = ['default', 'bogus', 'area', 'bilinear', 'catrom', 'mitchell', 'lanczos3']
+
+    operations = []
+
+    for resize_filter in filters:
+      params = {
+        'width':      640,
+        'height':     640,
+        'type':       'width',
+        'output_url': self.outputUrlHelper('test_filter_' + resize_filter + '.png')
+      }
+
+      if resize_filter != 'default':
+        params['filter'] = resize_filter
+
+      operations.append({'type': 'resize', 'params': params})
+
+    output = self.call_arion(self.IMAGE_1_PATH, operations, {'resize_cascade_factor': 0})
+
+    self.assertTrue(output['result'])
+    self.assertEqual(output['total_operations'], len(filters))
+
+    default = self.read_png_pixels(self.outputUrlHelper('test_filter_default.png'))
+
+    self.assertEqual(default[0:2], (640, 427))
+
+    for resize_filter in filters[1:]:
+      image = self.read_png_pixels(self.outputUrlHelper('test_filter_' + resize_filter + '.png'))
+
+      self.assertEqual(image[0:3], default[0:3])
+
+      if resize_filter == 'bogus':
+        self.assertEqual(image[3], default[3])
+      else:
+        self.assertGreater(self.psnr(image[3], default[3]), 30.0)
+
+  # -------------------------------------------------------------------------------
+  # Large reductions of sources that are not decoded at a reduced scale (here a
+  # 1000x1000 PNG) go through the resampler's area filter in a single pass, so
+  # the default is identical to asking for the area filter
+  # -------------------------------------------------------------------------------
+  def test_large_area_resize(self):
+
+    operations = []
+
+    for resize_filter in ['default', 'area']:
+      params = {
+        'width':      120,
+        'height':     120,
+        'type':       'square',
+        'output_url': self.outputUrlHelper('test_large_area_resize_' + resize_filter + '.png')
+      }
+
+      if resize_filter != 'default':
+        params['filter'] = resize_filter
+
+      operations.append({'type': 'resize', 'params': params})
+
+    output = self.call_arion('../../examples/images/watermark.png', operations)
+
+    self.assertTrue(output['result'])
+
+    default = self.read_png_pixels(self.outputUrlHelper('test_large_area_resize_default.png'))
+    area = self.read_png_pixels(self.outputUrlHelper('test_large_area_resize_area.png'))
+
+    self.assertEqual(default[0:2], (120, 120))
+    self.assertEqual(default, area)
+
+  # -------------------------------------------------------------------------------
+  # Resizing in linear light keeps the image but does not darken fine detail, so
+  # the result is brighter on average
+  # -------------------------------------------------------------------------------
+  def test_linear_light(self):
+
+    operations = []
+
+    for linear_light in [False, True]:
+      operations.append({
+        'type': 'resize',
+        'params':
+        {
+          'width':        320,
+          'height':       320,
+          'type':         'width',
+          'linear_light': linear_light,
+          'output_url':   self.outputUrlHelper('test_linear_light_' + str(linear_light) + '.png')
+        }
+      })
+
+    output = self.call_arion(self.IMAGE_1_PATH, operations, {'resize_cascade_factor': 0})
+
+    self.assertTrue(output['result'])
+
+    default = self.read_png_pixels(self.outputUrlHelper('test_linear_light_False.png'))
+    linear = self.read_png_pixels(self.outputUrlHelper('test_linear_light_True.png'))
+
+    self.assertEqual(linear[0:3], default[0:3])
+    self.assertGreater(self.psnr(linear[3], default[3]), 30.0)
+    self.assertGreater(sum(linear[3]), sum(default[3]))
+
+  # -------------------------------------------------------------------------------
+  # The fast pre-filter is close to the accurate one, and resizes sharing a
+  # pre-filtered source give the same result as one on its own
+  # -------------------------------------------------------------------------------
+  def test_pre_filter_mode(self):
+
+    def operation(name, mode):
+      return {
+        'type': 'resize',
+        'params':
+        {
+          'width':           640,
+          'height':          640,
+          'type':            'width',
+          'pre_filter':      True,
+          'pre_filter_mode': mode,
+          'output_url':      self.outputUrlHelper('test_pre_filter_' + name + '.png')
+        }
+      }
+
+    output = self.call_arion(self.IMAGE_1_PATH, [operation('accurate', 'accurate'),
+                                                 operation('fast', 'fast'),
+                                                 operation('fast_shared', 'fast')],
+                             {'resize_cascade_factor': 0})
+
+    self.assertTrue(output['result'])
+
+    output = self.call_arion(self.IMAGE_1_PATH, [operation('fast_alone', 'fast')])
+
+    self.assertTrue(output['result'])
+
+    accurate = self.read_png_pixels(self.outputUrlHelper('test_pre_filter_accurate.png'))
+    fast = self.read_png_pixels(self.outputUrlHelper('test_pre_filter_fast.png'))
+    shared = self.read_png_pixels(self.outputUrlHelper('test_pre_filter_fast_shared.png'))
+    alone = self.read_png_pixels(self.outputUrlHelper('test_pre_filter_fast_alone.png'))
+
+    self.assertEqual(fast[0:3], accurate[0:3])
+    self.assertGreater(self.psnr(fast[3], accurate[3]), 35.0)
+
+    self.assertEqual(shared, fast)
+    self.assertEqual(alone, fast)
+
+  # -------------------------------------------------------------------------------
+  # Sharpening leaves pixels that differ from their surroundings by less than
+  # the threshold alone, a threshold of 255 leaves the whole image alone
+  # -------------------------------------------------------------------------------
+  def test_sharpen_threshold(self):
+
+    operations = []
+
+    for threshold in [None, 0, 10, 255]:
+      params = {
+        'width':      640,
+        'height':     640,
+        'type':       'width',
+        'output_url': self.outputUrlHelper('test_sharpen_threshold_' + str(threshold) + '.png')
+      }
+
+      if threshold is not None:
+        params['sharpen_amount'] = 150
+        params['sharpen_radius'] = 1.0
+        params['sharpen_threshold'] = threshold
+
+      operations.append({'type': 'resize', 'params': params})
+
+    output = self.call_arion(self.IMAGE_1_PATH, operations)
+
+    self.assertTrue(output['result'])
+
+    plain = self.read_png_pixels(self.outputUrlHelper('test_sharpen_threshold_None.png'))
+    sharpened = self.read_png_pixels(self.outputUrlHelper('test_sharpen_threshold_0.png'))
+    thresholded = self.read_png_pixels(self.outputUrlHelper('test_sharpen_threshold_10.png'))
+    untouched = self.read_png_pixels(self.outputUrlHelper('test_sharpen_threshold_255.png'))
+
+    def changed(image):
+      return sum(1 for a, b in zip(image[3], plain[3]) if a != b)
+
+    self.assertEqual(sharpened[0:3], plain[0:3])
+    self.assertGreater(self.psnr(sharpened[3], plain[3]), 25.0)
+    self.assertGreater(changed(sharpened), changed(thresholded))
+    self.assertGreater(changed(thresholded), 0)
+    self.assertEqual(untouched, plain)
+
+  # -------------------------------------------------------------------------------
+  # Outputs of a job share one decoded watermark, which must blend the same for
+  # each of them
+  # -------------------------------------------------------------------------------
+  def test_shared_watermark(self):
+
+    operations = []
+
+    for i in range(4):
+      operations.append({
+        'type': 'resize',
+        'params':
+        {
+          'width':            300,
+          'height':           200,
+          'type':             'fill',
+          'watermark_url':    '../images/watermark.png',
+          'watermark_type':   'standard',
+          'watermark_amount': 0.5,
+          'output_url':       self.outputUrlHelper('test_shared_watermark_' + str(i) + '.png')
+        }
+      })
+
+    output = self.call_arion(self.IMAGE_1_PATH, operations, {'resize_cascade_factor': 0})
+
+    self.assertTrue(output['result'])
+
+    first = self.read_png_pixels(self.outputUrlHelper('test_shared_watermark_0.png'))
+
+    for i in range(1, 4):
+      self.assertEqual(self.read_png_pixels(self.outputUrlHelper('test_shared_watermark_' + str(i) + '.png')), first)
+
+  # -------------------------------------------------------------------------------
+  # A watermark blended with no opacity leaves the output as it is, for the
+  # standard, adaptive (brightness table) and adaptive_block types
+  # -------------------------------------------------------------------------------
+  def test_watermark_blend(self):
+
+    def resize(name, params):
+      operation = {
+        'type': 'resize',
+        'params':
+        {
+          'width':      300,
+          'height':     200,
+          'type':       'fill',
+          'output_url': self.outputUrlHelper('test_watermark_blend_' + name + '.png')
+        }
+      }
+
+      operation['params'].update(params)
+
+      output = self.call_arion(self.IMAGE_1_PATH, [operation])
+
+      self.assertTrue(output['result'])
+
+      return self.read_png_pixels(self.outputUrlHelper('test_watermark_blend_' + name + '.png'))
+
+    plain = resize('plain', {})
+
+    for name, params in [('standard', {'watermark_type': 'standard', 'watermark_amount': 0.0}),
+                         ('adaptive', {'watermark_type': 'adaptive', 'watermark_min': 0.0, 'watermark_max': 0.0}),
+                         ('adaptive_block', {'watermark_type': 'adaptive_block', 'watermark_min': 0.0, 'watermark_max': 0.0})]:
+      params['watermark_url'] = '../images/watermark.png'
+      self.assertEqual(resize(name, params), plain)
+
+    blended = resize('blended', {'watermark_url':    '../images/watermark.png',
+                                 'watermark_type':   'standard',
+                                 'watermark_amount': 0.5})
+
+    self.assertNotEqual(blended, plain)
+
+  # -------------------------------------------------------------------------------
+  # A watermark with a gravity is scaled to a fraction of the output width and
+  # placed once, inside the margin. The scaled watermark is cached, so a second
+  # output of the same size blends the same.
+  # -------------------------------------------------------------------------------
+  def test_watermark_position(self):
+
+    def resize(name, params):
+      operation = {
+        'type': 'resize',
+        'params':
+        {
+          'width':      300,
+          'height':     200,
+          'type':       'fill',
+          'output_url': self.outputUrlHelper('test_watermark_position_' + name + '.png')
+        }
+      }
+
+      operation['params'].update(params)
+
+      output = self.call_arion(self.IMAGE_1_PATH, [operation])
+
+      self.assertTrue(output['result'])
+
+      return self.read_png_pixels(self.outputUrlHelper('test_watermark_position_' + name + '.png'))
+
+    params = {
+      'watermark_url':     '../images/watermark.png',
+      'watermark_type':    'standard',
+      'watermark_amount':  1.0,
+      'watermark_gravity': 'southeast',
+      'watermark_scale':   0.25,
+      'watermark_margin':  10
+    }
+
+    plain = resize('plain', {})
+    placed = resize('placed', params)
+
+    width, height, channels, pixels = placed
+
+    changed = [(i // channels % width, i // channels // width)
+               for i in range(len(pixels)) if pixels[i] != plain[3][i]]
+
+    self.assertTrue(changed)
+    self.assertGreaterEqual(min(x for x, y in changed), 300 - 10 - 75)
+    self.assertLess(max(x for x, y in changed), 300 - 10)
+    self.assertLess(max(y for x, y in changed), 200 - 10)
+
+    self.assertEqual(resize('placed_again', params), placed)
+
+  # -------------------------------------------------------------------------------
+  # Block averaged adaptive watermarks stay close to the per pixel adaptive type
+  # -------------------------------------------------------------------------------
+  def test_watermark_adaptive_block(self):
+
+    outputs = {}
+
+    for watermark_type in ['adaptive', 'adaptive_block']:
+      output_url = self.outputUrlHelper('test_watermark_' + watermark_type + '.png')
+
+      operation = {
+        'type': 'resize',
+        'params':
+        {
+          'width':          400,
+          'height':         400,
+          'type':           'fill',
+          'watermark_url':  '../images/watermark.png',
+          'watermark_type': watermark_type,
+          'watermark_min':  0.1,
+          'watermark_max':  0.5,
+          'output_url':     output_url
+        }
+      }
+
+      output = self.call_arion('../images/watermark_test_input.jpg', [operation])
+
+      self.assertTrue(output['result'])
+
+      outputs[watermark_type] = self.read_png_pixels(output_url)
+
+    self.assertGreater(self.psnr(outputs['adaptive'][3], outputs['adaptive_block'][3]), 30.0)
+
+  # -------------------------------------------------------------------------------
+  # The thread budget divides threads between images, operations and kernels and
+  # the allocation used is reported. A budget in the job only limits that job, the
+  # shared pool keeps its size.
+  # -------------------------------------------------------------------------------
+  def test_thread_budget(self):
+
+    operation = {
+      'type': 'resize',
+      'params':
+      {
+        'width':      200,
+        'height':     200,
+        'type':       'fill',
+        'output_url': self.outputUrlHelper('test_thread_budget.jpg')
+      }
+    }
+
+    output = self.call_arion(self.IMAGE_1_PATH, [operation])
+
+    self.assertTrue(output['result'])
+
+    pool_threads = output['thread_allocation']['pool_threads']
+
+    for budget, max_parallel_ops, allocation in [
+        ({'threads': 8, 'images': 2, 'operations': 2}, 0, (8, 2, 2, 2)),
+        ({'threads': 8, 'images': 2, 'operations': 2}, 1, (8, 2, 1, 2)),
+        ({'threads': 8, 'images': 2},                  0, (8, 2, 4, 1)),
+        ({'threads': 2, 'images': 4, 'operations': 4}, 0, (2, 2, 1, 1))]:
+
+      options = {'thread_budget': budget}
+
+      if max_parallel_ops:
+        options['max_parallel_ops'] = max_parallel_ops
+
+      output = self.call_arion(self.IMAGE_1_PATH, [operation], options)
+
+      self.assertTrue(output['result'])
+
+      info = output['thread_allocation']
+
+      self.assertEqual((info['threads'], info['images'], info['operations'], info['kernel']), allocation)
+      self.assertEqual(info['pool_threads'], pool_threads)
+
+  # -------------------------------------------------------------------------------
+  # The command line sets the process wide budget before the job runs
+  # -------------------------------------------------------------------------------
+  def test_command_line_thread_budget(self):
+
+    input_string = json.dumps({
+      'input_url':  self.IMAGE_1_PATH,
+      'operations': [{
+        'type': 'resize',
+        'params': {
+          'width':      200,
+          'height':     200,
+          'type':       'fill',
+          'output_url': self.outputUrlHelper('test_command_line_thread_budget.jpg')
+        }
+      }]
+    }, separators=(',', ':'))
+
+    p = Popen([self.ARION_PATH, "--threads", "3", "--operations", "1", "--input", input_string], stdout=PIPE)
+
+    output = json.loads(p.communicate()[0])
+
+    self.assertTrue(output['result'])
+
+    info = output['thread_allocation']
+
+    self.assertEqual((info['threads'], info['images'], info['operations'], info['kernel']), (3, 1, 1, 3))
+    self.assertEqual(info['pool_threads'], 3)
+
+  # -------------------------------------------------------------------------------
+  # The process wide budget is set through the C API (or the command line, see
+  # test_command_line_thread_budget) and sizes the shared thread pool
+  # -------------------------------------------------------------------------------
+  def test_shared_thread_budget(self):
+
+    carion = ctypes.CDLL(self.CARION_PATH)
+    carion.ArionSetThreadBudget.argtypes = [ctypes.c_uint, ctypes.c_uint, ctypes.c_uint]
+    carion.ArionRunJson.argtypes = [ctypes.c_char_p]
+    carion.ArionRunJson.restype = ctypes.c_char_p
+
+    input_string = json.dumps({
+      'input_url':  self.IMAGE_1_PATH,
+      'operations': [{
+        'type': 'resize',
+        'params': {
+          'width':      200,
+          'height':     200,
+          'type':       'fill',
+          'output_url': self.outputUrlHelper('test_shared_thread_budget.jpg')
+        }
+      }]
+    })
+
+    for threads, images, operations, allocation in [(3, 1, 0, (3, 1, 3, 1)),
+                                                    (6, 2, 1, (6, 2, 1, 3))]:
+      carion.ArionSetThreadBudget(threads, images, operations)
+
+      output = json.loads(carion.ArionRunJson(input_string.encode('utf-8')))
+
+      self.assertTrue(output['result'])
+
+      info = output['thread_allocation']
+
+      self.assertEqual((info['threads'], info['images'], info['operations'], info['kernel']), allocation)
+      self.assertEqual(info['pool_threads'], threads)
+
+  # -------------------------------------------------------------------------------
+  # Operations of a job run concurrently, but results are reported in the order
+  # they were given and a failing operation is counted exactly once
+  # -------------------------------------------------------------------------------
+  def test_max_parallel_ops(self):
+
+    widths = [500, 400, 0, 300, 200, 100]
+
+    operations = [{
+      'type': 'resize',
+      'params':
+      {
+        'width':      width,
+        'height':     width,
+        'type':       'fill',
+        'output_url': self.outputUrlHelper('test_parallel_' + str(width) + '.jpg')
+      }
+    } for width in widths]
+
+    for max_parallel_ops in [1, 4]:
+      output = self.call_arion(self.IMAGE_1_PATH, operations, {'max_parallel_ops': max_parallel_ops})
+
+      self.assertFalse(output['result'])
+      self.assertEqual(output['total_operations'], 6)
+      self.assertEqual(output['failed_operations'], 1)
+
+      for width, info in zip(widths, output['info']):
+        self.assertEqual(info['output_url'], 'file://' + self.outputUrlHelper('test_parallel_' + str(width) + '.jpg'))
+        self.assertEqual(info['result'], width != 0)
+
+        if width:
+          self.assertEqual(info['output_width'], width)
+
   # -------------------------------------------------------------------------------
   #  Called only once
   # -------------------------------------------------------------------------------